@@ -0,0 +1,176 @@
+// --------------------------------------------------------------------
+// Boundary particle walls
+// "Versatile Rigid-Fluid Coupling for Incompressible SPH", Akinci, Ihmsen,
+// Akinci, Solenthaler and Teschner, SIGGRAPH 2012
+//
+// The walls of the container and of the world are sampled with a single
+// layer of particles that never move. Each sample b carries a weight
+//		psi_b = rest_density * volume / sum_k q_bk^2
+// (the sum running over the samples around b, b itself included), so a
+// densely sampled corner does not count more than a flat wall, and a wall
+// adds to a fluid particle's density what a layer of fluid at rest would.
+// The pressure on a wall is mirrored from the fluid particle itself.
+//
+// The samples and their boundaryIndex are built once from container_width,
+// container_height, container_top, opening_width and the world bounds, and
+// only again when the opening or the world size is toggled, the rest
+// density changes, or a scene file changes the geometry or r (worldVersion).
+
+std::vector<Particle> boundaryParticles;
+IndexType boundaryIndex(4093, r*2);
+
+// the geometry (and rest density) the samples were built for:
+static float boundaryDensity = -1.f;
+static int boundaryOpening = -1;
+static int boundaryShrink = -1;
+static int boundaryWorld = -1;
+
+// --------------------------------------------------------------------
+// Sample the rectangle origin + s * u + t * v, 0 <= s <= lenU, 0 <= t <= lenV
+// with the given spacing, leaving out the opening of the container floor.
+static void AddWallSamples(const glm::vec3 &origin, const glm::vec3 &u, const glm::vec3 &v,
+	const float lenU, const float lenV, const float gap, const bool containerFloor)
+{
+	const int nu = (int)(lenU / gap + 0.5f);
+	const int nv = (int)(lenV / gap + 0.5f);
+	for (int i = 0; i <= nu; i++)
+	{
+		for (int j = 0; j <= nv; j++)
+		{
+			const glm::vec3 pos = origin + (lenU * i / (float)nu) * u + (lenV * j / (float)nv) * v;
+			if (containerFloor && useOpening &&
+				fabs(pos.x) < opening_width / 2 && fabs(pos.z) < opening_width / 2)
+				continue;
+
+			Particle p;
+			p.pos = p.pos_old = pos;
+			p.r = p.g = p.b = 0.f;
+			p.vel = glm::vec3(0.f);
+			p.force = glm::vec3(0.f);
+			p.mass = 1.f;
+			p.rho = p.rho_near = 0.f;
+			p.press = p.press_near = 0.f;
+			p.sigma = 3.f;
+			p.beta = 4.f;
+			p.r_density = rest_density;
+			p.dt = dT;
+			p.level = 0;
+			p.calmSteps = 0;
+			p.asleep = p.wakeUp = 0;
+			boundaryParticles.push_back(p);
+		}
+	}
+}
+
+// --------------------------------------------------------------------
+void BuildBoundaryParticles()
+{
+	// the wallNeighbors of the particles point into the old samples (the
+	// density pass finds them again)
+	for (auto &particle : particles)
+		particle.wallNeighbors.clear();
+	boundaryParticles.clear();
+	boundaryIndex.SetCellSize(r * 2);	// (r may have changed)
+
+	const float gap = r * 0.5f;
+	const glm::vec3 X(1.f, 0.f, 0.f), Y(0.f, 1.f, 0.f), Z(0.f, 0.f, 1.f);
+
+	// the container: floor (with its opening), lid and four walls
+	const float cw = container_width;
+	const float ch = container_top - container_height;
+	AddWallSamples(glm::vec3(-cw, container_height, -cw), X, Z, 2.f * cw, 2.f * cw, gap, true);
+	AddWallSamples(glm::vec3(-cw, container_top, -cw), X, Z, 2.f * cw, 2.f * cw, gap, false);
+	AddWallSamples(glm::vec3(-cw, container_height, -cw), Y, Z, ch, 2.f * cw, gap, false);
+	AddWallSamples(glm::vec3(cw, container_height, -cw), Y, Z, ch, 2.f * cw, gap, false);
+	AddWallSamples(glm::vec3(-cw, container_height, -cw), X, Y, 2.f * cw, ch, gap, false);
+	AddWallSamples(glm::vec3(-cw, container_height, cw), X, Y, 2.f * cw, ch, gap, false);
+
+	// the world: floor, and walls up to the container
+	const float bound = shrinkWorld ? SIM_W * 3.f : SIM_W;
+	AddWallSamples(glm::vec3(-bound, bottom, -SIM_W), X, Z, 2.f * bound, 2.f * SIM_W, gap, false);
+	AddWallSamples(glm::vec3(-bound, bottom, -SIM_W), Y, Z, container_height, 2.f * SIM_W, gap, false);
+	AddWallSamples(glm::vec3(bound, bottom, -SIM_W), Y, Z, container_height, 2.f * SIM_W, gap, false);
+	AddWallSamples(glm::vec3(-bound, bottom, -SIM_W), X, Y, 2.f * bound, container_height, gap, false);
+	AddWallSamples(glm::vec3(-bound, bottom, SIM_W), X, Y, 2.f * bound, container_height, gap, false);
+
+	// from here on the samples never move, so the pointers stay good
+	for (auto &b : boundaryParticles)
+		boundaryIndex.Insert(b.pos, &b);
+
+	// psi: how much of a fluid particle each sample stands in for
+	if (!boundaryParticles.empty())
+		WeighWallSamples(&boundaryParticles[0], (int)boundaryParticles.size(), boundaryIndex);
+
+	boundaryDensity = rest_density;
+	boundaryOpening = useOpening;
+	boundaryShrink = shrinkWorld;
+	boundaryWorld = worldVersion;
+}
+
+// build the samples if there are none yet or the geometry has changed:
+// (call outside of any parallel region)
+void UpdateBoundaryParticles()
+{
+	if (boundaryOpening != useOpening || boundaryShrink != shrinkWorld || boundaryWorld != worldVersion ||
+		boundaryDensity != rest_density)
+		BuildBoundaryParticles();
+}
+
+// --------------------------------------------------------------------
+// The walls and the rigid bodies (see rigidbody.cpp) both come as samples:
+static inline bool UseWallSamples()
+{
+	return useBoundaryParticles || (useRigidBodies && !rigidBodies.empty());
+}
+
+// Fill particle.wallNeighbors with the boundary and body samples inside the
+// radius of support and add their psi-weighted 'far' and 'near' distances
+// to d and dn.
+void FindWallNeighbors(Particle &particle, float &d, float &dn)
+{
+	particle.wallNeighbors.clear();
+
+	ScratchArena::Scope scratch(ThreadArena());
+	IndexType::NeighborList neigh = IndexType::MakeNeighborList();
+	if (useBoundaryParticles)
+		boundaryIndex.Neighbors(particle.pos, neigh);
+	if (useRigidBodies)
+		bodyIndex.Neighbors(particle.pos, neigh);
+	for (int j = 0; j < (int)neigh.size(); j++)
+	{
+		const glm::vec3 rij = neigh[j]->pos - particle.pos;
+		const float len2 = glm::dot(rij, rij);
+		if (len2 >= rsq)
+			continue;
+
+		float len;
+		const float q = KernelQ(len2, len);
+		const float psi = neigh[j]->mass / particle.mass;
+		d += psi * q * q;
+		dn += psi * q * q * q;
+
+		Neighbor n;
+		n.j = neigh[j];
+		n.q = q;
+		n.q2 = q * q;
+#ifdef CACHE_PAIR_GEOMETRY
+		n.dir = len > 0.f ? rij * (1.f / len) : glm::vec3(0.f);
+#endif
+		particle.wallNeighbors.push_back(n);
+	}
+}
+
+// The push of the walls on Particle i, with the pressures mirrored from i.
+// Walls only ever push, so a fluid particle below rest is not sucked in.
+static inline glm::vec3 WallPressureDisplacement(const Particle &particle)
+{
+	const float press = glm::max(particle.press, 0.f);
+
+	glm::vec3 dX(0.f);
+	for (const Neighbor &n : particle.wallNeighbors)
+	{
+		const float psi = (*n.j).mass / particle.mass;
+		dX += PairDirection(particle, n) * (psi * (n.q * 2.f * press + n.q2 * 2.f * particle.press_near));
+	}
+	return dX;
+}
@@ -0,0 +1,311 @@
+// --------------------------------------------------------------------
+// Checkpoints
+//
+// SaveCheckpoint( ) writes the particles and the simulation parameters to
+// a binary file, LoadCheckpoint( ) puts them back, so a settled pool can
+// be restarted instead of poured and settled again. The file is
+//	- a CHECKPOINT_HEADER_BYTES header: magic, version, particle count,
+//	  checksum, the parameters and toggles,
+//	- then one array per particle field (structure of arrays), each on a
+//	  64 byte boundary, in the order of CheckpointArrays.
+// Loading maps the file instead of reading it: the arrays are copied
+// straight from the mapping into the particles in parallel, with no
+// parsing and no allocation per particle (the neighbor lists are found
+// again by the next step). The checksum is computed over 1 MB blocks in
+// parallel, so checking it also runs at memory speed.
+//
+// The fluid is all there is in a checkpoint: the colliders, boundary
+// samples and rigid bodies belong to the scene and are not saved. The
+// watchdog keeps its snapshots in the same arrays (see watchdog.cpp).
+
+const char CHECKPOINT_MAGIC[8] = {'S', 'P', 'H', 'C', 'K', 'P', 'T', '\0'};
+const uint32_t CHECKPOINT_VERSION = 1;
+const size_t CHECKPOINT_HEADER_BYTES = 256;
+
+struct CheckpointHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t headerBytes;
+	uint64_t count;			// particles
+	uint64_t checksum;		// of everything after the header
+
+	float G;
+	float rest_density;
+	float dT;
+	float mass;
+	float frameDT;
+	int32_t whichSolver;
+	int32_t useGravity;
+	int32_t externalForce;
+	int32_t shrinkWorld;
+	int32_t useOpening;
+	int32_t useFusedPass;
+	int32_t useAdaptiveDT;
+	int32_t useLocalDT;
+	int32_t useSleeping;
+	int32_t useBoundaryParticles;
+};
+static_assert(sizeof(CheckpointHeader) <= CHECKPOINT_HEADER_BYTES, "the checkpoint header has outgrown its space");
+
+// where the arrays of a checkpoint are, once it is in memory
+struct CheckpointArrays
+{
+	glm::vec3 *pos, *pos_old, *vel, *force;
+	float *mass, *rho, *rho_near, *press, *press_near;
+	float *sigma, *beta, *r_density, *dt;
+	int32_t *level, *calmSteps, *asleep;
+};
+
+// --------------------------------------------------------------------
+template <typename T>
+static inline void PlaceCheckpointArray(char *base, size_t &at, const size_t count, T *&array)
+{
+	array = base != NULL ? (T *)(base + at) : NULL;
+	at += (count * sizeof(T) + 63) & ~(size_t)63;
+}
+
+// Point the arrays of count particles into the payload at base (NULL to
+// just measure it) and return its size in bytes.
+static size_t LayOutCheckpoint(char *base, const size_t count, CheckpointArrays &a)
+{
+	size_t at = 0;
+	PlaceCheckpointArray(base, at, count, a.pos);
+	PlaceCheckpointArray(base, at, count, a.pos_old);
+	PlaceCheckpointArray(base, at, count, a.vel);
+	PlaceCheckpointArray(base, at, count, a.force);
+	PlaceCheckpointArray(base, at, count, a.mass);
+	PlaceCheckpointArray(base, at, count, a.rho);
+	PlaceCheckpointArray(base, at, count, a.rho_near);
+	PlaceCheckpointArray(base, at, count, a.press);
+	PlaceCheckpointArray(base, at, count, a.press_near);
+	PlaceCheckpointArray(base, at, count, a.sigma);
+	PlaceCheckpointArray(base, at, count, a.beta);
+	PlaceCheckpointArray(base, at, count, a.r_density);
+	PlaceCheckpointArray(base, at, count, a.dt);
+	PlaceCheckpointArray(base, at, count, a.level);
+	PlaceCheckpointArray(base, at, count, a.calmSteps);
+	PlaceCheckpointArray(base, at, count, a.asleep);
+	return at;
+}
+
+// FNV-1a over the 64 bit words of every 1 MB block, and again over the
+// block sums. (bytes is a multiple of 64, see PlaceCheckpointArray( ))
+static uint64_t CheckpointChecksum(const char *data, const size_t bytes)
+{
+	const size_t blockBytes = 1 << 20;
+	const int blocks = (int)((bytes + blockBytes - 1) / blockBytes);
+	std::vector<uint64_t> sums(blocks);
+
+	#pragma omp parallel for
+	for (int b = 0; b < blocks; b++)
+	{
+		const uint64_t *words = (const uint64_t *)(data + b * blockBytes);
+		const size_t numWords = glm::min(blockBytes, bytes - b * blockBytes) / sizeof(uint64_t);
+		uint64_t h = 14695981039346656037ULL;
+		for (size_t w = 0; w < numWords; w++)
+			h = (h ^ words[w]) * 1099511628211ULL;
+		sums[b] = h;
+	}
+
+	uint64_t h = 14695981039346656037ULL;
+	for (int b = 0; b < blocks; b++)
+		h = (h ^ sums[b]) * 1099511628211ULL;
+	return h;
+}
+
+// --------------------------------------------------------------------
+// Copy all the particles into the arrays of a.
+static void StoreParticles(const CheckpointArrays &a)
+{
+	const size_t count = particles.size();
+	#pragma omp parallel for
+	for (int i = 0; i < (int)count; i++)
+	{
+		const Particle &p = particles[i];
+		a.pos[i] = p.pos;
+		a.pos_old[i] = p.pos_old;
+		a.vel[i] = p.vel;
+		a.force[i] = p.force;
+		a.mass[i] = p.mass;
+		a.rho[i] = p.rho;
+		a.rho_near[i] = p.rho_near;
+		a.press[i] = p.press;
+		a.press_near[i] = p.press_near;
+		a.sigma[i] = p.sigma;
+		a.beta[i] = p.beta;
+		a.r_density[i] = p.r_density;
+		a.dt[i] = p.dt;
+		a.level[i] = p.level;
+		a.calmSteps[i] = p.calmSteps;
+		a.asleep[i] = p.asleep;
+	}
+}
+
+// Replace the particles with the count in the arrays of a.
+static void RestoreParticles(const CheckpointArrays &a, const size_t count)
+{
+	particles.resize(count);
+
+	int sleepers = 0;
+	#pragma omp parallel for reduction(+:sleepers)
+	for (int i = 0; i < (int)count; i++)
+	{
+		Particle &p = particles[i];
+		p.pos = a.pos[i];
+		p.pos_old = a.pos_old[i];
+		p.vel = a.vel[i];
+		p.force = a.force[i];
+		p.mass = a.mass[i];
+		p.rho = a.rho[i];
+		p.rho_near = a.rho_near[i];
+		p.press = a.press[i];
+		p.press_near = a.press_near[i];
+		p.sigma = a.sigma[i];
+		p.beta = a.beta[i];
+		p.r_density = a.r_density[i];
+		p.dt = a.dt[i];
+		p.level = a.level[i];
+		p.calmSteps = a.calmSteps[i];
+		p.asleep = a.asleep[i];
+		p.wakeUp = 0;
+		p.neighbors.clear();
+		p.wallNeighbors.clear();
+		SetParticleColor(p);
+		sleepers += p.asleep ? 1 : 0;
+	}
+
+	// the sleepers are back, but not in sleepIndex yet
+	numSleeping = sleepers;
+	sleepIndexDirty = true;
+}
+
+// --------------------------------------------------------------------
+bool SaveCheckpoint(const char *file)
+{
+	const size_t count = particles.size();
+	CheckpointArrays a;
+	const size_t bytes = LayOutCheckpoint(NULL, count, a);
+
+	// the header and arrays are filled in right where the stream will
+	// write them from (an io_uring buffer, if that is on)
+	OutputStream out;
+	if (!out.Open(file, CHECKPOINT_HEADER_BYTES + bytes, 1))
+		return false;
+	char *header = (char *)out.Reserve(CHECKPOINT_HEADER_BYTES + bytes);
+	char *payload = header + CHECKPOINT_HEADER_BYTES;
+
+	// zeroed, so the padding between the arrays is the same every time
+	memset(header, 0, CHECKPOINT_HEADER_BYTES + bytes);
+	LayOutCheckpoint(payload, count, a);
+	StoreParticles(a);
+
+	CheckpointHeader h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, CHECKPOINT_MAGIC, sizeof(h.magic));
+	h.version = CHECKPOINT_VERSION;
+	h.headerBytes = CHECKPOINT_HEADER_BYTES;
+	h.count = count;
+	h.checksum = CheckpointChecksum(payload, bytes);
+	h.G = ::G;
+	h.rest_density = rest_density;
+	h.dT = dT;
+	h.mass = mass;
+	h.frameDT = frameDT;
+	h.whichSolver = whichSolver;
+	h.useGravity = useGravity;
+	h.externalForce = externalForce;
+	h.shrinkWorld = shrinkWorld;
+	h.useOpening = useOpening;
+	h.useFusedPass = useFusedPass;
+	h.useAdaptiveDT = useAdaptiveDT;
+	h.useLocalDT = useLocalDT;
+	h.useSleeping = useSleeping;
+	h.useBoundaryParticles = useBoundaryParticles;
+	memcpy(header, &h, sizeof(h));
+
+	out.Commit(CHECKPOINT_HEADER_BYTES + bytes);
+	if (!out.Close())
+	{
+		fprintf(stderr, "Cannot write checkpoint '%s'\n", file);
+		return false;
+	}
+
+	if (DebugOn != 0)
+		fprintf(stderr, "Checkpoint '%s': %zu particles, %zu bytes\n", file, count, CHECKPOINT_HEADER_BYTES + bytes);
+	return true;
+}
+
+// --------------------------------------------------------------------
+// Replace the particles and parameters with those of a checkpoint. On any
+// error the simulation is left as it was.
+bool LoadCheckpoint(const char *file)
+{
+	const int fd = open(file, O_RDONLY);
+	if (fd < 0)
+	{
+		fprintf(stderr, "Cannot open checkpoint '%s'\n", file);
+		return false;
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0 || (size_t)st.st_size < CHECKPOINT_HEADER_BYTES)
+	{
+		fprintf(stderr, "Checkpoint '%s' is too short\n", file);
+		close(fd);
+		return false;
+	}
+	const size_t fileBytes = (size_t)st.st_size;
+	char *data = (char *)mmap(NULL, fileBytes, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == (char *)MAP_FAILED)
+	{
+		fprintf(stderr, "Cannot map checkpoint '%s'\n", file);
+		return false;
+	}
+
+	CheckpointHeader h;
+	memcpy(&h, data, sizeof(h));
+	const char *problem = NULL;
+	CheckpointArrays a;
+	if (memcmp(h.magic, CHECKPOINT_MAGIC, sizeof(h.magic)) != 0)
+		problem = "is not a checkpoint";
+	else if (h.version != CHECKPOINT_VERSION || h.headerBytes != CHECKPOINT_HEADER_BYTES)
+		problem = "has an unknown version";
+	else if (h.count > fileBytes || LayOutCheckpoint(NULL, h.count, a) != fileBytes - CHECKPOINT_HEADER_BYTES)
+		problem = "has the wrong size";
+	else if (CheckpointChecksum(data + CHECKPOINT_HEADER_BYTES, fileBytes - CHECKPOINT_HEADER_BYTES) != h.checksum)
+		problem = "is corrupt";
+	if (problem != NULL)
+	{
+		fprintf(stderr, "Checkpoint '%s' %s\n", file, problem);
+		munmap(data, fileBytes);
+		return false;
+	}
+
+	const size_t count = h.count;
+	LayOutCheckpoint(data + CHECKPOINT_HEADER_BYTES, count, a);
+
+	::G = h.G;
+	rest_density = h.rest_density;
+	dT = h.dT;
+	mass = h.mass;
+	frameDT = h.frameDT;
+	whichSolver = h.whichSolver;
+	useGravity = h.useGravity;
+	externalForce = h.externalForce;
+	shrinkWorld = h.shrinkWorld;
+	useOpening = h.useOpening;
+	useFusedPass = h.useFusedPass;
+	useAdaptiveDT = h.useAdaptiveDT;
+	useLocalDT = h.useLocalDT;
+	useSleeping = h.useSleeping;
+	useBoundaryParticles = h.useBoundaryParticles;
+
+	RestoreParticles(a, count);
+	munmap(data, fileBytes);
+	ForgetSnapshots();
+
+	if (DebugOn != 0)
+		fprintf(stderr, "Checkpoint '%s': %zu particles restored\n", file, count);
+	return true;
+}
@@ -0,0 +1,59 @@
+// --------------------------------------------------------------------
+// Deterministic mode
+//
+// With useDeterministic on, a run gives the same bytes whatever number of
+// OpenMP threads it runs on, and the same bytes again for the same
+// deterministicSeed:
+//	- dropped bodies take their spot from a counter-based generator keyed
+//	  by the seed and the number of the drop instead of rand( ), as new
+//	  particles always take their jitter (see particlegen.cpp),
+//	- the viscosity passes read the velocities of the neighbors from a
+//	  snapshot taken before the pass, instead of while other threads are
+//	  changing them,
+//	- and sums over all particles are done in index order.
+// The rest already was: the indices are filled serially, so the neighbor
+// lists come out in the same order for any thread count, every other pass
+// writes only to its own particle, and the max and int reductions are exact.
+
+unsigned int deterministicSeed = 1;
+
+// The SplitMix64 finalizer, every bit of x stirs every bit of the result.
+static inline unsigned long long MixBits(unsigned long long x)
+{
+	x += 0x9e3779b97f4a7c15ULL;
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+	return x ^ (x >> 31);
+}
+
+// The number 'which' of 'id', uniform in [0,1) and the same in any run
+// with the same deterministicSeed.
+static inline float CounterRandom01(const unsigned int id, const unsigned int which)
+{
+	const unsigned long long key = ((unsigned long long)deterministicSeed << 40) ^ ((unsigned long long)id << 8) ^ which;
+	return (float)(MixBits(key) >> 40) * (1.f / 16777216.f);
+}
+
+// numbers which .. which + 2 of id
+static inline glm::vec3 CounterRandom3(const unsigned int id, const unsigned int which)
+{
+	return glm::vec3(CounterRandom01(id, which), CounterRandom01(id, which + 1), CounterRandom01(id, which + 2));
+}
+
+// --------------------------------------------------------------------
+// The velocities of all particles as they are now, for a viscosity pass
+// to read the neighbors from, or NULL when not deterministic. They live
+// in the main thread's arena until the next ResetScratchArenas( ).
+// (call outside of any parallel region)
+const glm::vec3 *SnapshotVelocities()
+{
+	if (!useDeterministic || particles.empty())
+		return NULL;
+
+	const int n = (int)particles.size();
+	glm::vec3 *vel = (glm::vec3 *)ThreadArena().Allocate(n * sizeof(glm::vec3), alignof(glm::vec3));
+	#pragma omp parallel for
+	for (int i = 0; i < n; i++)
+		vel[i] = particles[i].vel;
+	return vel;
+}
@@ -0,0 +1,153 @@
+// --------------------------------------------------------------------
+// In-situ diagnostics
+//
+// With useDiagnostics on, the solvers measure the health of the run in
+// loops they run anyway, without a pass of their own over the particles:
+// the loop that finds the densities adds each particle's density error and
+// neighbor count, and the one that finishes the velocities adds its kinetic
+// energy and speed. Every thread sums into its own copy of stepSums (an
+// OpenMP reduction), and when the step is over StepMetricsScope turns the
+// sums into stepMetrics. With useDiagnostics off, each particle costs one
+// test that is always false.
+//
+// The density error is compression only: (rho - r_density) / r_density
+// where that is above 0, as IISPH measures it, since a free surface is
+// below the rest density without anything being wrong. Sleepers are left
+// out, because they neither move nor get new densities. Local time
+// stepping reports the particles as the last step left them, from the
+// loop that sorts them into bins.
+
+struct MetricsSum
+{
+	double kineticEnergy;
+	float maxSpeed2;
+	double densityError;
+	float maxDensityError;
+	int64_t neighbors;
+	int minNeighbors;
+	int maxNeighbors;
+	int moving;			// particles whose velocity was added
+	int dense;			// ... and whose density was
+	int nonFinite;		// velocities and densities that were NaN or infinite
+
+	MetricsSum() : kineticEnergy(0.), maxSpeed2(0.f), densityError(0.), maxDensityError(0.f), neighbors(0),
+		minNeighbors(INT_MAX), maxNeighbors(0), moving(0), dense(0), nonFinite(0) {}
+
+	void AddMotion(const float m, const float speed2)
+	{
+		// (a NaN fails every comparison)
+		if (!(speed2 <= FLT_MAX))
+		{
+			nonFinite++;
+			return;
+		}
+		kineticEnergy += 0.5 * m * speed2;
+		maxSpeed2 = glm::max(maxSpeed2, speed2);
+		moving++;
+	}
+
+	void AddDensity(const float rho, const float restDensity, const int numNeighbors)
+	{
+		if (!(rho <= FLT_MAX))
+		{
+			nonFinite++;
+			return;
+		}
+		const float error = glm::max(rho - restDensity, 0.f) / restDensity;
+		densityError += error;
+		maxDensityError = glm::max(maxDensityError, error);
+		neighbors += numNeighbors;
+		minNeighbors = glm::min(minNeighbors, numNeighbors);
+		maxNeighbors = glm::max(maxNeighbors, numNeighbors);
+		dense++;
+	}
+
+	void Merge(const MetricsSum &other)
+	{
+		kineticEnergy += other.kineticEnergy;
+		maxSpeed2 = glm::max(maxSpeed2, other.maxSpeed2);
+		densityError += other.densityError;
+		maxDensityError = glm::max(maxDensityError, other.maxDensityError);
+		neighbors += other.neighbors;
+		minNeighbors = glm::min(minNeighbors, other.minNeighbors);
+		maxNeighbors = glm::max(maxNeighbors, other.maxNeighbors);
+		moving += other.moving;
+		dense += other.dense;
+		nonFinite += other.nonFinite;
+	}
+};
+
+#pragma omp declare reduction(metrics : MetricsSum : omp_out.Merge(omp_in)) initializer(omp_priv = MetricsSum())
+
+// what the last step measured
+struct StepMetrics
+{
+	int step;					// steps measured so far
+	int particles;				// the averages are over
+	float kineticEnergy;
+	float maxSpeed;
+	float meanDensityError;
+	float maxDensityError;
+	float meanNeighbors;
+	int minNeighbors;
+	int maxNeighbors;
+	int nonFinite;				// NaN or infinite velocities and densities
+};
+
+MetricsSum stepSums;			// the sums of the step being taken
+StepMetrics stepMetrics;
+
+// Restarts stepSums for a step and publishes them when the step is over.
+// (one at the top of step( ) and DoubleDensitySolver<D>::Step( ))
+class StepMetricsScope
+{
+public:
+	StepMetricsScope() : mOn(useDiagnostics != 0)
+	{
+		if (mOn)
+			stepSums = MetricsSum();
+	}
+
+	~StepMetricsScope()
+	{
+		if (!mOn)
+			return;
+		const MetricsSum &s = stepSums;
+		StepMetrics &m = stepMetrics;
+		m.step++;
+		m.particles = glm::max(s.moving, s.dense);
+		m.kineticEnergy = (float)s.kineticEnergy;
+		m.maxSpeed = sqrtf(s.maxSpeed2);
+		m.meanDensityError = s.dense > 0 ? (float)(s.densityError / s.dense) : 0.f;
+		m.maxDensityError = s.maxDensityError;
+		m.meanNeighbors = s.dense > 0 ? (float)s.neighbors / (float)s.dense : 0.f;
+		m.minNeighbors = s.dense > 0 ? s.minNeighbors : 0;
+		m.maxNeighbors = s.maxNeighbors;
+		m.nonFinite = s.nonFinite;
+	}
+
+private:
+	bool mOn;
+};
+
+// --------------------------------------------------------------------
+// Put stepMetrics in the Diagnostics panel.
+// (call once per Display( ))
+void ShowStepMetrics()
+{
+	static int shown = -1;
+	if (!useDiagnostics || GluiFluid == NULL || stepMetrics.step == shown)
+		return;
+	shown = stepMetrics.step;
+
+	const StepMetrics &m = stepMetrics;
+	char line[128];
+	snprintf(line, sizeof(line), "Kinetic energy %.4g, max speed %.3g", m.kineticEnergy, m.maxSpeed);
+	MetricsText[0]->set_text(line);
+	snprintf(line, sizeof(line), "Density error %.2f%% mean, %.2f%% max", 100.f * m.meanDensityError, 100.f * m.maxDensityError);
+	MetricsText[1]->set_text(line);
+	snprintf(line, sizeof(line), "Neighbors %.1f mean, %d to %d", m.meanNeighbors, m.minNeighbors, m.maxNeighbors);
+	MetricsText[2]->set_text(line);
+	snprintf(line, sizeof(line), "%d particles, %d NaN or infinite values", m.particles, m.nonFinite);
+	MetricsText[3]->set_text(line);
+}
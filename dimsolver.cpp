@@ -0,0 +1,261 @@
+// --------------------------------------------------------------------
+// The double density step for any number of dimensions
+//
+// DoubleDensitySolver<D> keeps its own particles, index and kernels, all
+// in Dimension<D>: with D = 2 the positions are glm::vec2, the index looks
+// at 9 cells instead of 27 and the density sums are normalized by a disc
+// instead of a ball. That makes a 2D slice (use2D) a cheap way to try out
+// parameters: rest_density, k, k_near, G, dT and the viscosity mean the same
+// thing as in step( ), which it follows pass for pass.
+//
+// It is the plain solver only: the world walls and floor, gravity and the
+// external force, but none of the container, colliders, boundary samples,
+// bodies, sleeping or local time steps of the 3D path.
+
+template <int D>
+struct ParticleD;
+
+template <int D>
+struct NeighborD
+{
+	ParticleD<D> *j;
+	float q, q2;
+	typename Dimension<D>::Vec dir;		// unit vector from Particle i to Particle j
+};
+
+template <int D>
+struct ParticleD
+{
+	typedef typename Dimension<D>::Vec Vec;
+
+	Vec pos;
+	Vec pos_old;
+	Vec vel;
+	Vec force;
+	float rho;
+	float rho_near;
+	float press;
+	float press_near;
+	std::vector<NeighborD<D> > neighbors;
+};
+
+// --------------------------------------------------------------------
+template <int D>
+class DoubleDensitySolver
+{
+public:
+	typedef typename Dimension<D>::Vec Vec;
+	typedef ParticleD<D> Particle;
+	typedef NeighborD<D> Neighbor;
+	typedef SpatialIndex<Particle, D> Index;
+
+	DoubleDensitySolver() : mIndex(4093, r*2), mLastDT(dT) {}
+
+	// for a new r (the slice has to be seeded again as well)
+	void ResizeIndex()
+	{
+		mIndex.SetCellSize(r * 2);
+	}
+
+	// Stack n particles in layers above the floor, r/2 apart, in a column
+	// as wide as the one initParticles( ) makes.
+	void Seed(const int n)
+	{
+		const float gap = r * 0.5f;
+		const float half = i_girth * 0.2f;
+		const int across = (int)(2.f * half / gap) + 1;
+		int perLayer = 1;
+		for (int a = 0; a < D - 1; a++)
+			perLayer *= across;
+
+		mParticles.clear();
+		mParticles.resize(n);
+		for (int i = 0; i < n; i++)
+		{
+			Particle &p = mParticles[i];
+			const int layer = i / perLayer;
+			int cell = i % perLayer;
+
+			// every other layer is shifted, so the column does not stand on
+			// exactly stacked particles (and rand( ) is left alone)
+			const float stagger = (layer % 2) * 0.25f * gap;
+			for (int a = 0; a < D; a++)
+			{
+				if (a == 1)
+					continue;
+				p.pos[a] = -half + gap * (float)(cell % across) + stagger;
+				cell /= across;
+			}
+			p.pos[1] = bottom + 0.1f + gap * (float)layer;
+			p.pos_old = p.pos;
+			p.vel = p.force = Vec(0.f);
+			p.rho = p.rho_near = 0.f;
+			p.press = p.press_near = 0.f;
+		}
+		mLastDT = dT;
+	}
+
+	// --------------------------------------------------------------------
+	void Step(const float dt)
+	{
+		const int n = (int)mParticles.size();
+		const float h = mLastDT;
+		StepMetricsScope metricsScope;
+
+		// ADVANCE
+		#pragma omp parallel for
+		for (int i = 0; i < n; i++)
+		{
+			Particle &particle = mParticles[i];
+			particle.pos += (particle.force / mass) * (h * h);
+
+			particle.force = Vec(0.f);
+			if (useGravity)
+				particle.force[1] = -mass * ::G;
+
+			particle.vel = (particle.pos - particle.pos_old) / h;
+
+			// the same velocity limit as AdvanceParticle( )
+			const float max_vel = 2.0f;
+			if (glm::dot(particle.vel, particle.vel) > max_vel * max_vel)
+				particle.vel /= max_vel;
+
+			particle.pos_old = particle.pos;
+			particle.pos += particle.vel * dt;
+
+			// the springs of the world walls
+			if (useGravity)
+			{
+				const float bound = shrinkWorld ? SIM_W * 3.f : SIM_W;
+				for (int a = 0; a < D; a++)
+				{
+					const float limit = a == 0 ? bound : SIM_W;
+					if (a == 1)
+					{
+						if (particle.pos[a] < bottom)
+							particle.force[a] -= (particle.pos[a] - bottom) / 8.f;
+					}
+					else if (particle.pos[a] < -limit)
+						particle.force[a] -= (particle.pos[a] + limit) / 8.f;
+					else if (particle.pos[a] > limit)
+						particle.force[a] -= (particle.pos[a] - limit) / 8.f;
+				}
+			}
+
+			if (externalForce)
+				particle.force[0] += .002f * 0.025f;
+		}
+		mLastDT = dt;
+
+		mIndex.Clear();
+		for (auto &particle : mParticles)
+			mIndex.Insert(particle.pos, &particle);
+
+		// DENSITY AND PRESSURE
+		const float volume = Dimension<D>::KernelVolume();
+		#pragma omp parallel for reduction(metrics:stepSums)
+		for (int i = 0; i < n; i++)
+		{
+			Particle &particle = mParticles[i];
+			float d = 0.f, dn = 0.f;
+			FindNeighbors(particle, d, dn);
+
+			particle.rho = (d * mass) / volume;
+			particle.rho_near = (dn * mass) / volume;
+			particle.press = k * (particle.rho - rest_density);
+			particle.press_near = k_near * particle.rho_near;
+
+			if (useDiagnostics)
+				stepSums.AddDensity(particle.rho, rest_density, (int)particle.neighbors.size());
+		}
+
+		// PRESSURE FORCE + VISCOSITY
+		// (deterministic, the neighbors' velocities come from before the pass)
+		ScratchArena::Scope scratch(ThreadArena());
+		const ArenaAllocator<Vec> alloc(ThreadArena());
+		std::vector<Vec, ArenaAllocator<Vec> > velocities(alloc);
+		if (useDeterministic)
+		{
+			velocities.resize(n);
+			for (int i = 0; i < n; i++)
+				velocities[i] = mParticles[i].vel;
+		}
+
+		#pragma omp parallel for reduction(metrics:stepSums)
+		for (int i = 0; i < n; i++)
+		{
+			Particle &particle = mParticles[i];
+			Vec dX(0.f);
+			for (const Neighbor &nb : particle.neighbors)
+			{
+				const Particle &pj = *nb.j;
+				dX += nb.dir * (nb.q * (particle.press + pj.press) + nb.q2 * (particle.press_near + pj.press_near));
+
+				// viscosity, with the sigma = 3 and beta = 4 of every Particle
+				const Vec &velJ = useDeterministic ? velocities[nb.j - &mParticles[0]] : pj.vel;
+				const float u = glm::dot(particle.vel - velJ, nb.dir);
+				if (u > 0.f)
+					particle.vel -= (nb.q * (3.f * u + 4.f * u * u) * 0.5f * dT) * nb.dir;
+			}
+			particle.force -= dX;
+
+			if (useDiagnostics)
+				stepSums.AddMotion(mass, glm::dot(particle.vel, particle.vel));
+		}
+	}
+
+	int Size() const
+	{
+		return (int)mParticles.size();
+	}
+
+	const Particle &Get(const int i) const
+	{
+		return mParticles[i];
+	}
+
+	// where to draw Particle i
+	glm::vec3 Position(const int i) const
+	{
+		return Dimension<D>::ToVec3(mParticles[i].pos);
+	}
+
+private:
+	void FindNeighbors(Particle &particle, float &d, float &dn)
+	{
+		particle.neighbors.clear();
+
+		ScratchArena::Scope scratch(ThreadArena());
+		typename Index::NeighborList neigh = Index::MakeNeighborList();
+		mIndex.Neighbors(particle.pos, neigh);
+		for (int j = 0; j < (int)neigh.size(); j++)
+		{
+			if (neigh[j] == &particle)
+				continue;
+
+			const Vec rij = neigh[j]->pos - particle.pos;
+			const float len2 = glm::dot(rij, rij);
+			if (len2 >= rsq)
+				continue;
+
+			float len;
+			const float q = KernelQ(len2, len);
+			d += q * q;
+			dn += q * q * q;
+
+			Neighbor nb;
+			nb.j = neigh[j];
+			nb.q = q;
+			nb.q2 = q * q;
+			nb.dir = len > 0.f ? rij * (1.f / len) : Vec(0.f);
+			particle.neighbors.push_back(nb);
+		}
+	}
+
+	std::vector<Particle> mParticles;
+	Index mIndex;
+	float mLastDT;		// the step whose prediction is in pos
+};
+
+// the 2D slice run in place of step( ) when use2D is on
+DoubleDensitySolver<2> slice2D;
@@ -0,0 +1,600 @@
+// --------------------------------------------------------------------
+// Particle export
+//
+// With exportFrames on, every rendered frame is written to a file of its
+// own in exportDir, for ParaView or Houdini, as exportFormat:
+//	- EXPORT_VTK:  legacy VTK, binary POLYDATA (.vtk),
+//	- EXPORT_VTP:  XML VTK PolyData with raw appended data (.vtp),
+//	- EXPORT_PLY:  binary little endian PLY (.ply),
+//	- EXPORT_BGEO: classic (version 5) Houdini geometry (.bgeo).
+// Along with the positions go the attributes that are switched on:
+// exportRho, exportPress and exportVel (named rho, press and vel; v in a
+// bgeo, which is what Houdini calls the velocity). Each particle is a
+// vertex cell of its own, so ParaView draws the points as they are.
+//
+// As with the trajectory, the step loop only copies the particles into a
+// free snapshot, which is not changed again until it is written; it waits
+// only when all exportQueueSize snapshots are still queued. The exporter
+// thread lays the file out: in all four formats a particle takes the same
+// number of bytes in every array, so where each particle goes is known
+// before anything is written. exportThreads threads then convert chunks of
+// exportChunk particles in parallel, straight into the output buffer of an
+// OutputStream. (The byte order conversion assumes a little endian host.)
+
+enum ExportFormats
+{
+	EXPORT_VTK,
+	EXPORT_VTP,
+	EXPORT_PLY,
+	EXPORT_BGEO,
+};
+
+struct ExportSnapshot
+{
+	int frame;
+	bool hasRho, hasPress, hasVel;
+	std::vector<glm::vec3> pos;
+	std::vector<glm::vec3> vel;
+	std::vector<float> rho;
+	std::vector<float> press;
+};
+
+// what a field of a particle record is, in the order it is written
+enum ExportField
+{
+	FIELD_POS,				// 3 floats
+	FIELD_POS_W,			// 3 floats and 1.
+	FIELD_VEL,				// 3 floats
+	FIELD_RHO,				// float
+	FIELD_PRESS,			// float
+	FIELD_ONE,				// int 1 (the size of a legacy VTK vertex cell)
+	FIELD_INDEX,			// int index of the particle
+	FIELD_INDEX_PLUS_ONE,	// ... + 1 (the end of its XML VTK vertex cell)
+	FIELD_INDEX16,			// unsigned short index of the particle
+};
+
+// a run of bytes written as they are, followed by a record per particle
+struct ExportBlock
+{
+	std::string prefix;
+	std::vector<ExportField> fields;
+	size_t recordBytes;
+};
+
+struct ExportLayout
+{
+	std::vector<ExportBlock> blocks;
+	std::string suffix;		// after the last block
+	bool bigEndian;
+};
+
+// --------------------------------------------------------------------
+static inline size_t ExportFieldBytes(const ExportField field)
+{
+	switch (field)
+	{
+	case FIELD_POS:
+	case FIELD_VEL:
+		return 12;
+	case FIELD_POS_W:
+		return 16;
+	case FIELD_INDEX16:
+		return 2;
+	default:
+		return 4;
+	}
+}
+
+static inline void AddExportBlock(ExportLayout &layout, const std::string &prefix, const std::vector<ExportField> &fields)
+{
+	ExportBlock block;
+	block.prefix = prefix;
+	block.fields = fields;
+	block.recordBytes = 0;
+	for (ExportField field : fields)
+		block.recordBytes += ExportFieldBytes(field);
+	layout.blocks.push_back(block);
+}
+
+// binary values for the headers of the binary formats
+template <typename T>
+static inline void AppendExportValue(std::string &s, T v, const bool bigEndian)
+{
+	char bytes[sizeof(T)];
+	memcpy(bytes, &v, sizeof(T));
+	if (bigEndian)
+		std::reverse(bytes, bytes + sizeof(T));
+	s.append(bytes, sizeof(T));
+}
+
+// a Houdini string: its length as a short, then its characters
+static inline void AppendHoudiniString(std::string &s, const char *text)
+{
+	AppendExportValue(s, (uint16_t)strlen(text), true);
+	s.append(text);
+}
+
+static inline void PutExport32(uint8_t *&out, uint32_t v, const bool bigEndian)
+{
+	if (bigEndian)
+		v = __builtin_bswap32(v);
+	memcpy(out, &v, 4);
+	out += 4;
+}
+
+static inline void PutExportFloat(uint8_t *&out, const float f, const bool bigEndian)
+{
+	uint32_t v;
+	memcpy(&v, &f, 4);
+	PutExport32(out, v, bigEndian);
+}
+
+// --------------------------------------------------------------------
+static void LayOutVtk(const ExportSnapshot &snap, ExportLayout &layout)
+{
+	const std::string n = std::to_string(snap.pos.size());
+	layout.bigEndian = true;
+	AddExportBlock(layout,
+		"# vtk DataFile Version 3.0\nSPH particles, frame " + std::to_string(snap.frame) + "\n"
+		"BINARY\nDATASET POLYDATA\nPOINTS " + n + " float\n",
+		{FIELD_POS});
+	AddExportBlock(layout, "\nVERTICES " + n + " " + std::to_string(2 * snap.pos.size()) + "\n", {FIELD_ONE, FIELD_INDEX});
+
+	std::string pointData = "\nPOINT_DATA " + n + "\n";
+	if (snap.hasRho)
+	{
+		AddExportBlock(layout, pointData + "SCALARS rho float 1\nLOOKUP_TABLE default\n", {FIELD_RHO});
+		pointData = "\n";
+	}
+	if (snap.hasPress)
+	{
+		AddExportBlock(layout, pointData + "SCALARS press float 1\nLOOKUP_TABLE default\n", {FIELD_PRESS});
+		pointData = "\n";
+	}
+	if (snap.hasVel)
+		AddExportBlock(layout, pointData + "VECTORS vel float\n", {FIELD_VEL});
+	layout.suffix = "\n";
+}
+
+static void LayOutVtp(const ExportSnapshot &snap, ExportLayout &layout)
+{
+	const size_t count = snap.pos.size();
+	const std::string n = std::to_string(count);
+	layout.bigEndian = false;
+
+	// the arrays, in the order they are appended
+	struct Array { const char *xml; ExportField field; };
+	std::vector<Array> arrays;
+	arrays.push_back({"<DataArray type=\"Float32\" NumberOfComponents=\"3\"", FIELD_POS});
+	arrays.push_back({"<DataArray type=\"Int32\" Name=\"connectivity\"", FIELD_INDEX});
+	arrays.push_back({"<DataArray type=\"Int32\" Name=\"offsets\"", FIELD_INDEX_PLUS_ONE});
+	if (snap.hasRho)
+		arrays.push_back({"<DataArray type=\"Float32\" Name=\"rho\"", FIELD_RHO});
+	if (snap.hasPress)
+		arrays.push_back({"<DataArray type=\"Float32\" Name=\"press\"", FIELD_PRESS});
+	if (snap.hasVel)
+		arrays.push_back({"<DataArray type=\"Float32\" Name=\"vel\" NumberOfComponents=\"3\"", FIELD_VEL});
+
+	// each appended array is its size as a UInt64 and its data
+	std::vector<std::string> tags;
+	size_t offset = 0;
+	for (const Array &a : arrays)
+	{
+		tags.push_back(std::string("        ") + a.xml + " format=\"appended\" offset=\"" + std::to_string(offset) + "\"/>\n");
+		offset += sizeof(uint64_t) + count * ExportFieldBytes(a.field);
+	}
+
+	std::string xml =
+		"<?xml version=\"1.0\"?>\n"
+		"<VTKFile type=\"PolyData\" version=\"1.0\" byte_order=\"LittleEndian\" header_type=\"UInt64\">\n"
+		"  <PolyData>\n"
+		"    <Piece NumberOfPoints=\"" + n + "\" NumberOfVerts=\"" + n +
+		"\" NumberOfLines=\"0\" NumberOfStrips=\"0\" NumberOfPolys=\"0\">\n"
+		"      <Points>\n" + tags[0] + "      </Points>\n"
+		"      <Verts>\n" + tags[1] + tags[2] + "      </Verts>\n"
+		"      <PointData>\n";
+	for (size_t a = 3; a < tags.size(); a++)
+		xml += tags[a];
+	xml +=
+		"      </PointData>\n"
+		"    </Piece>\n"
+		"  </PolyData>\n"
+		"  <AppendedData encoding=\"raw\">\n   _";
+
+	for (size_t a = 0; a < arrays.size(); a++)
+	{
+		std::string prefix = a == 0 ? xml : std::string();
+		AppendExportValue(prefix, (uint64_t)(count * ExportFieldBytes(arrays[a].field)), false);
+		AddExportBlock(layout, prefix, {arrays[a].field});
+	}
+	layout.suffix = "\n  </AppendedData>\n</VTKFile>\n";
+}
+
+static void LayOutPly(const ExportSnapshot &snap, ExportLayout &layout)
+{
+	layout.bigEndian = false;
+	std::string header =
+		"ply\nformat binary_little_endian 1.0\ncomment SPH particles, frame " + std::to_string(snap.frame) + "\n"
+		"element vertex " + std::to_string(snap.pos.size()) + "\n"
+		"property float x\nproperty float y\nproperty float z\n";
+	std::vector<ExportField> fields = {FIELD_POS};
+	if (snap.hasVel)
+	{
+		header += "property float vx\nproperty float vy\nproperty float vz\n";
+		fields.push_back(FIELD_VEL);
+	}
+	if (snap.hasRho)
+	{
+		header += "property float rho\n";
+		fields.push_back(FIELD_RHO);
+	}
+	if (snap.hasPress)
+	{
+		header += "property float press\n";
+		fields.push_back(FIELD_PRESS);
+	}
+	header += "end_header\n";
+	AddExportBlock(layout, header, fields);
+}
+
+// The points with their attributes, then a single particle system
+// primitive that holds them all (the layout partio writes too).
+static void LayOutBgeo(const ExportSnapshot &snap, ExportLayout &layout)
+{
+	const int32_t count = (int32_t)snap.pos.size();
+	layout.bigEndian = true;
+
+	struct Attribute { const char *name; int16_t size; int32_t type; ExportField field; };
+	std::vector<Attribute> attributes;
+	if (snap.hasVel)
+		attributes.push_back({"v", 3, 5, FIELD_VEL});			// 5 is a vector
+	if (snap.hasRho)
+		attributes.push_back({"rho", 1, 0, FIELD_RHO});			// 0 is a float
+	if (snap.hasPress)
+		attributes.push_back({"press", 1, 0, FIELD_PRESS});
+
+	std::string header = "Bgeo";
+	header += 'V';
+	AppendExportValue(header, (int32_t)5, true);					// version
+	AppendExportValue(header, count, true);							// points
+	AppendExportValue(header, (int32_t)1, true);					// primitives
+	AppendExportValue(header, (int32_t)0, true);					// point groups
+	AppendExportValue(header, (int32_t)0, true);					// primitive groups
+	AppendExportValue(header, (int32_t)attributes.size(), true);	// point attributes
+	AppendExportValue(header, (int32_t)0, true);					// vertex attributes
+	AppendExportValue(header, (int32_t)1, true);					// primitive attributes
+	AppendExportValue(header, (int32_t)0, true);					// detail attributes
+	std::vector<ExportField> fields = {FIELD_POS_W};
+	for (const Attribute &a : attributes)
+	{
+		AppendHoudiniString(header, a.name);
+		AppendExportValue(header, a.size, true);
+		AppendExportValue(header, a.type, true);
+		for (int c = 0; c < a.size; c++)
+			AppendExportValue(header, (int32_t)0, true);			// the default
+		fields.push_back(a.field);
+	}
+	AddExportBlock(layout, header, fields);
+
+	// the primitive attribute (an index attribute naming the generator),
+	// and the primitive with the indices of its points
+	std::string primitive;
+	AppendHoudiniString(primitive, "generator");
+	AppendExportValue(primitive, (int16_t)1, true);
+	AppendExportValue(primitive, (int32_t)4, true);					// 4 is an index
+	AppendExportValue(primitive, (int32_t)1, true);
+	AppendHoudiniString(primitive, "papi");
+	AppendExportValue(primitive, (int32_t)0x8000, true);				// a particle system
+	AppendExportValue(primitive, count, true);
+	AddExportBlock(layout, primitive, {count > (1 << 16) ? FIELD_INDEX : FIELD_INDEX16});
+
+	AppendExportValue(layout.suffix, (int32_t)0, true);				// its generator
+	layout.suffix += '\0';											// no extra
+	layout.suffix += '\xff';											// the end
+}
+
+// the records of particles [first, last) of a block
+static void FillExportRecords(const ExportBlock &block, const ExportSnapshot &snap, const bool bigEndian,
+	const int first, const int last, uint8_t *out)
+{
+	for (int i = first; i < last; i++)
+	{
+		for (ExportField field : block.fields)
+		{
+			switch (field)
+			{
+			case FIELD_POS:
+			case FIELD_POS_W:
+				PutExportFloat(out, snap.pos[i].x, bigEndian);
+				PutExportFloat(out, snap.pos[i].y, bigEndian);
+				PutExportFloat(out, snap.pos[i].z, bigEndian);
+				if (field == FIELD_POS_W)
+					PutExportFloat(out, 1.f, bigEndian);
+				break;
+			case FIELD_VEL:
+				PutExportFloat(out, snap.vel[i].x, bigEndian);
+				PutExportFloat(out, snap.vel[i].y, bigEndian);
+				PutExportFloat(out, snap.vel[i].z, bigEndian);
+				break;
+			case FIELD_RHO:
+				PutExportFloat(out, snap.rho[i], bigEndian);
+				break;
+			case FIELD_PRESS:
+				PutExportFloat(out, snap.press[i], bigEndian);
+				break;
+			case FIELD_ONE:
+				PutExport32(out, 1, bigEndian);
+				break;
+			case FIELD_INDEX:
+				PutExport32(out, (uint32_t)i, bigEndian);
+				break;
+			case FIELD_INDEX_PLUS_ONE:
+				PutExport32(out, (uint32_t)i + 1, bigEndian);
+				break;
+			case FIELD_INDEX16:
+			{
+				const uint16_t v = bigEndian ? __builtin_bswap16((uint16_t)i) : (uint16_t)i;
+				memcpy(out, &v, 2);
+				out += 2;
+				break;
+			}
+			}
+		}
+	}
+}
+
+// --------------------------------------------------------------------
+class ParticleExporter
+{
+public:
+	ParticleExporter() : mRunning(false), mClosing(false), mFrame(0), mFiles(0), mStalls(0), mBytes(0) {}
+
+	~ParticleExporter()
+	{
+		Close();
+	}
+
+	void Open(const int queueSize)
+	{
+		Close();
+		mSnapshots.assign(glm::max(queueSize, 1), ExportSnapshot());
+		mFree.clear();
+		mFull.clear();
+		for (int s = 0; s < (int)mSnapshots.size(); s++)
+			mFree.push_back(s);
+		mClosing = false;
+		mFrame = 0;
+		mFiles = 0;
+		mStalls = 0;
+		mBytes = 0;
+		mRunning = true;
+		mThread = std::thread(&ParticleExporter::Run, this);
+	}
+
+	// Write everything still queued and stop the exporter thread.
+	void Close()
+	{
+		if (!mRunning)
+			return;
+		{
+			std::lock_guard<std::mutex> lock(mMutex);
+			mClosing = true;
+		}
+		mChanged.notify_all();
+		mThread.join();
+		mRunning = false;
+	}
+
+	bool IsOpen() const
+	{
+		return mRunning;
+	}
+
+	// Queue the particles as they are now, with the attributes that are
+	// on. Waits only if every snapshot is still waiting to be written.
+	// (call outside of any parallel region)
+	void Push()
+	{
+		int s;
+		{
+			std::unique_lock<std::mutex> lock(mMutex);
+			if (mFree.empty())
+			{
+				mStalls++;
+				mChanged.wait(lock, [this] { return !mFree.empty(); });
+			}
+			s = mFree.front();
+			mFree.pop_front();
+		}
+
+		ExportSnapshot &snap = mSnapshots[s];
+		const int n = (int)particles.size();
+		snap.frame = mFrame++;
+		snap.hasRho = exportRho != 0;
+		snap.hasPress = exportPress != 0;
+		snap.hasVel = exportVel != 0;
+		snap.pos.resize(n);
+		snap.vel.resize(snap.hasVel ? n : 0);
+		snap.rho.resize(snap.hasRho ? n : 0);
+		snap.press.resize(snap.hasPress ? n : 0);
+		#pragma omp parallel for
+		for (int i = 0; i < n; i++)
+		{
+			snap.pos[i] = particles[i].pos;
+			if (snap.hasVel)
+				snap.vel[i] = particles[i].vel;
+			if (snap.hasRho)
+				snap.rho[i] = particles[i].rho;
+			if (snap.hasPress)
+				snap.press[i] = particles[i].press;
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(mMutex);
+			mFull.push_back({s, exportFormat});
+		}
+		mChanged.notify_all();
+	}
+
+	// files written, times Push( ) had to wait and bytes written, only
+	// safe to read once closed
+	int Files() const
+	{
+		return mFiles;
+	}
+
+	int Stalls() const
+	{
+		return mStalls;
+	}
+
+	size_t Bytes() const
+	{
+		return mBytes;
+	}
+
+private:
+	struct Job
+	{
+		int snapshot;
+		int format;
+	};
+
+	// the exporter thread
+	void Run()
+	{
+		for (;;)
+		{
+			Job job;
+			{
+				std::unique_lock<std::mutex> lock(mMutex);
+				mChanged.wait(lock, [this] { return !mFull.empty() || mClosing; });
+				if (mFull.empty())
+					return;
+				job = mFull.front();
+				mFull.pop_front();
+			}
+
+			Write(mSnapshots[job.snapshot], job.format);
+
+			{
+				std::lock_guard<std::mutex> lock(mMutex);
+				mFree.push_back(job.snapshot);
+			}
+			mChanged.notify_all();
+		}
+	}
+
+	void Write(const ExportSnapshot &snap, const int format)
+	{
+		static const char *extensions[] = {"vtk", "vtp", "ply", "bgeo"};
+		ExportLayout layout;
+		switch (format)
+		{
+		case EXPORT_VTP:	LayOutVtp(snap, layout);	break;
+		case EXPORT_PLY:	LayOutPly(snap, layout);	break;
+		case EXPORT_BGEO:	LayOutBgeo(snap, layout);	break;
+		default:			LayOutVtk(snap, layout);	break;
+		}
+		const char *extension = extensions[(format >= 0 && format <= EXPORT_BGEO) ? format : EXPORT_VTK];
+
+		// where every block and its records go
+		const int count = (int)snap.pos.size();
+		std::vector<size_t> starts;
+		size_t bytes = 0;
+		for (const ExportBlock &block : layout.blocks)
+		{
+			bytes += block.prefix.size();
+			starts.push_back(bytes);
+			bytes += count * block.recordBytes;
+		}
+		bytes += layout.suffix.size();
+
+		char file[512];
+		snprintf(file, sizeof(file), "%s/frame-%05d.%s", exportDir, snap.frame, extension);
+		OutputStream out;
+		if (!out.Open(file, bytes, 1))
+			return;
+		uint8_t *base = out.Reserve(bytes);
+		for (size_t b = 0; b < layout.blocks.size(); b++)
+		{
+			const ExportBlock &block = layout.blocks[b];
+			memcpy(base + starts[b] - block.prefix.size(), block.prefix.data(), block.prefix.size());
+		}
+		memcpy(base + bytes - layout.suffix.size(), layout.suffix.data(), layout.suffix.size());
+
+		// the records, a chunk of one block at a time, on exportThreads
+		// threads (this one included)
+		const int chunk = glm::max(exportChunk, 1);
+		const int chunksPerBlock = (count + chunk - 1) / chunk;
+		const int numChunks = chunksPerBlock * (int)layout.blocks.size();
+		std::atomic<int> next(0);
+		auto work = [&]()
+		{
+			for (int c = next++; c < numChunks; c = next++)
+			{
+				const int b = c / chunksPerBlock;
+				const int first = (c % chunksPerBlock) * chunk;
+				const int last = glm::min(first + chunk, count);
+				const ExportBlock &block = layout.blocks[b];
+				FillExportRecords(block, snap, layout.bigEndian, first, last, base + starts[b] + first * block.recordBytes);
+			}
+		};
+		std::vector<std::thread> helpers;
+		for (int t = 1; t < glm::min(exportThreads, numChunks); t++)
+			helpers.push_back(std::thread(work));
+		work();
+		for (auto &helper : helpers)
+			helper.join();
+
+		out.Commit(bytes);
+		if (!out.Close())
+		{
+			fprintf(stderr, "Cannot write all of '%s'\n", file);
+			return;
+		}
+		mFiles++;
+		mBytes += bytes;
+	}
+
+	std::vector<ExportSnapshot> mSnapshots;
+	std::deque<int> mFree;		// snapshots the step loop may fill
+	std::deque<Job> mFull;		// ... and the ones waiting to be written, oldest first
+	std::mutex mMutex;
+	std::condition_variable mChanged;
+	std::thread mThread;
+	bool mRunning;
+	bool mClosing;
+	int mFrame;
+	int mFiles;
+	int mStalls;
+	size_t mBytes;
+};
+
+ParticleExporter particleExporter;
+
+// --------------------------------------------------------------------
+// Start or stop the exporter to follow exportFrames, and export the frame
+// just simulated if it is on.
+// (call after every AdvanceFrame( ))
+void ExportParticleFrame()
+{
+	if (!exportFrames)
+	{
+		if (particleExporter.IsOpen())
+		{
+			particleExporter.Close();
+			if (Verbose)
+				fprintf(stderr, "Exported %d frames to '%s', %zu bytes, the step loop waited %d times\n",
+					particleExporter.Files(), exportDir, particleExporter.Bytes(), particleExporter.Stalls());
+		}
+		return;
+	}
+
+	if (!particleExporter.IsOpen())
+	{
+		mkdir(exportDir, 0755);
+		particleExporter.Open(exportQueueSize);
+	}
+	particleExporter.Push();
+}
@@ -0,0 +1,292 @@
+// --------------------------------------------------------------------
+// Implicit Incompressible SPH
+// "Implicit Incompressible SPH", Ihmsen, Cornelis, Solenthaler, Horvath
+// and Teschner, IEEE TVCG 2014
+//
+// Instead of the equation of state (press = k * (rho - r_density)), the
+// pressures are solved for with relaxed Jacobi iterations so that the
+// density after the step comes out at rest density. The iterations stop
+// when the average predicted density error drops below iisphTolerance or
+// after iisphMaxIterations. They start from half of the previous step's
+// pressure and all work on the neighbor lists found once at the start of
+// the step.
+//
+// The kernel is the one the density pass of step( ) uses,
+//		W(rij) = (1 - |rij| / r)^2 / volume
+// so rest_density has the same meaning as for the other solvers, and its
+// gradient with respect to Particle i is (2 q / (volume r)) * n.dir.
+//
+// Viscosity (XSPH) and the near pressure of step( ) are applied as explicit
+// non-pressure forces before the solve.
+//
+// Clamping positions at the walls afterwards is not enough here: the solver
+// would happily resolve a compression by pushing particles into the floor.
+// So every wall closer than r shows up in the system as a mirrored copy of
+// the particle that never moves, which adds to the density and pushes back
+// with the particle's own pressure.
+
+// results of the last solve, for anyone who wants to show them:
+int iisphIterationsUsed = 0;
+float iisphDensityError = 0.f;
+
+struct IISPHState
+{
+	glm::vec3 vAdv;		// velocity after the non-pressure forces
+	glm::vec3 dii;		// displacement of i due to its own pressure
+	glm::vec3 sumDijPj;	// displacement of i due to its neighbors' pressures
+	float aii;			// diagonal of the pressure system
+	float rhoAdv;		// density after advection
+	float pNew;			// pressure of the current Jacobi iterate
+	float error;		// relative density error of the iterate, < 0 if inactive
+	float wallW;		// q^2 sum of the mirrored wall particles
+	glm::vec3 wallGrad;	// ... and of their gradients
+};
+
+// gradient of the step( ) kernel with respect to Particle i
+static inline glm::vec3 GradW(const Particle &particle, const Neighbor &n, const float gradScale)
+{
+	return (gradScale * n.q) * PairDirection(particle, n);
+}
+
+// The density in the pressure terms (p / rho^2). Near the free surface rho
+// drops far below rest, and dividing by it blows single pressures up into
+// huge displacements, so it is never taken below rest density.
+static inline float PressureDensity(const Particle &particle)
+{
+	return glm::max(particle.rho, particle.r_density);
+}
+
+// --------------------------------------------------------------------
+void stepIISPH()
+{
+	const float dt = iisphDT;
+	const float dt2 = dt * dt;
+	const int n = (int)particles.size();
+	if (n == 0)
+		return;
+
+	const float volume = Dimension<3>::KernelVolume();
+	const float gradScale = 2.f / (volume * r);
+
+	// per-step temporaries, they are gone with the next ResetScratchArenas( )
+	ScratchArena &arena = ThreadArena();
+	std::vector<IISPHState, ArenaAllocator<IISPHState> > state(n, IISPHState(), ArenaAllocator<IISPHState>(arena));
+	std::vector<glm::vec3, ArenaAllocator<glm::vec3> > scratch(n, glm::vec3(0.f), ArenaAllocator<glm::vec3>(arena));
+	Particle *base = &particles[0];
+
+	// NEIGHBORS AND DENSITY
+	RebuildIndex();
+
+	#pragma omp parallel for
+	for (int i = 0; i < n; i++)
+	{
+		Particle &particle = particles[i];
+		float d = 0, dn = 0;
+		FindNeighbors(particle, d, dn);
+
+		float rho = 0.f;
+		for (const Neighbor &nb : particle.neighbors)
+			rho += (*nb.j).mass * nb.q2;
+
+		IISPHState &s = state[i];
+		s.wallW = 0.f;
+		s.wallGrad = glm::vec3(0.f);
+
+		glm::vec3 normals[6];
+		float dists[6];
+		const int numWalls = NearbyContainerWalls(particle.pos, particle.pos, normals, dists);
+		for (int w = 0; w < numWalls; w++)
+		{
+			// the mirror image sits 2 * dist away, on the other side of the wall
+			const float q = 1.f - 2.f * dists[w] / r;
+			if (q <= 0.f)
+				continue;
+			s.wallW += q * q;
+			s.wallGrad -= (gradScale * q) * normals[w];
+		}
+		rho += particle.mass * s.wallW;
+
+		particle.rho = rho / volume;
+		particle.rho_near = (dn * particle.mass) / volume;
+		particle.press_near = k_near * particle.rho_near;
+	}
+
+	// ADVECTION
+	// Viscosity is one of the non-pressure forces, so it goes in before the
+	// pressure solve gets to see the velocities.
+	SmoothVelocitiesXSPH(pbfXSPH, &scratch[0]);
+
+	// Velocity from the non-pressure forces, and d_ii.
+	#pragma omp parallel for
+	for (int i = 0; i < n; i++)
+	{
+		Particle &particle = particles[i];
+		IISPHState &s = state[i];
+
+		particle.force = useGravity ? glm::vec3(0.f, -particle.mass * ::G, 0.f) : glm::vec3(0.f);
+		if (externalForce)
+			particle.force += glm::vec3(.002f * 0.025, 0.f, 0.f);
+
+		// The near pressure of the double density relaxation stays an explicit
+		// force. The solve only ever pushes (p >= 0) and cannot tell two
+		// particles on top of each other apart from a well spaced pair, so
+		// without it particles clump together; it is also what limits dt.
+		for (const Neighbor &nb : particle.neighbors)
+			particle.force -= PairDirection(particle, nb) * (nb.q2 * (particle.press_near + (*nb.j).press_near));
+		s.vAdv = particle.vel + (particle.force / particle.mass) * dt;
+
+		const float rhoD = PressureDensity(particle);
+		const float f = -dt2 / (rhoD * rhoD);
+		s.dii = f * particle.mass * s.wallGrad;
+		for (const Neighbor &nb : particle.neighbors)
+			s.dii += f * (*nb.j).mass * GradW(particle, nb, gradScale);
+	}
+
+	// Predicted density, a_ii and the warm start.
+	#pragma omp parallel for
+	for (int i = 0; i < n; i++)
+	{
+		Particle &particle = particles[i];
+		IISPHState &s = state[i];
+
+		float rhoAdv = particle.rho;
+		float aii = 0.f;
+		const float fji = dt2 * particle.mass / (PressureDensity(particle) * PressureDensity(particle));
+		for (const Neighbor &nb : particle.neighbors)
+		{
+			const int j = (int)(nb.j - base);
+			const glm::vec3 grad = GradW(particle, nb, gradScale);
+			rhoAdv += dt * (*nb.j).mass * glm::dot(s.vAdv - state[j].vAdv, grad);
+
+			// d_ji, the displacement of j due to the pressure of i
+			const glm::vec3 dji = fji * grad;
+			aii += (*nb.j).mass * glm::dot(s.dii - dji, grad);
+		}
+		rhoAdv += dt * particle.mass * glm::dot(s.vAdv, s.wallGrad);
+		aii += particle.mass * glm::dot(s.dii, s.wallGrad);
+
+		s.rhoAdv = rhoAdv;
+		s.aii = aii;
+		s.pNew = 0.5f * glm::max(particle.press, 0.f);
+	}
+
+	// PRESSURE SOLVE
+	int iter = 0;
+	float avgError = 0.f;
+	for (; iter < iisphMaxIterations; iter++)
+	{
+		#pragma omp parallel for
+		for (int i = 0; i < n; i++)
+		{
+			Particle &particle = particles[i];
+			glm::vec3 sum(0.f);
+			for (const Neighbor &nb : particle.neighbors)
+			{
+				const Particle &pj = *nb.j;
+				const int j = (int)(nb.j - base);
+				const float rhoD = PressureDensity(pj);
+				sum += (-dt2 * pj.mass / (rhoD * rhoD) * state[j].pNew) * GradW(particle, nb, gradScale);
+			}
+			state[i].sumDijPj = sum;
+		}
+
+		#pragma omp parallel for
+		for (int i = 0; i < n; i++)
+		{
+			Particle &particle = particles[i];
+			IISPHState &s = state[i];
+			const float fji = dt2 * particle.mass / (PressureDensity(particle) * PressureDensity(particle));
+
+			float sum = 0.f;
+			for (const Neighbor &nb : particle.neighbors)
+			{
+				const int j = (int)(nb.j - base);
+				const IISPHState &sj = state[j];
+				const glm::vec3 grad = GradW(particle, nb, gradScale);
+
+				// d_jk p_k over all k != i, i.e. without the part that comes from i
+				const glm::vec3 djkpk = sj.sumDijPj - (fji * grad) * s.pNew;
+				sum += (*nb.j).mass * glm::dot(s.sumDijPj - sj.dii * sj.pNew - djkpk, grad);
+			}
+			sum += particle.mass * glm::dot(s.sumDijPj, s.wallGrad);
+
+			// the density this iterate would produce
+			const float rhoPred = s.rhoAdv + s.aii * s.pNew + sum;
+			s.error = -1.f;
+			if (s.pNew > 0.f || rhoPred > particle.r_density)
+				s.error = glm::max(rhoPred - particle.r_density, 0.f) / particle.r_density;
+
+			float p = s.pNew;
+			if (fabs(s.aii) > 1.e-9f)
+				p = (1.f - iisphOmega) * s.pNew + (iisphOmega / s.aii) * (particle.r_density - s.rhoAdv - sum);
+			particle.press = glm::max(p, 0.f);
+		}
+
+		#pragma omp parallel for
+		for (int i = 0; i < n; i++)
+			state[i].pNew = particles[i].press;
+
+		// summed in index order, a parallel reduction would round differently
+		// for every number of threads (and so stop after different iterations)
+		float errorSum = 0.f;
+		int numActive = 0;
+		for (int i = 0; i < n; i++)
+		{
+			if (state[i].error >= 0.f)
+			{
+				errorSum += state[i].error;
+				numActive++;
+			}
+		}
+		avgError = numActive > 0 ? errorSum / (float)numActive : 0.f;
+		if (iter >= 1 && avgError < iisphTolerance)
+		{
+			iter++;
+			break;
+		}
+	}
+	iisphIterationsUsed = iter;
+	iisphDensityError = avgError;
+
+	// INTEGRATION
+	// Pressure acceleration first (into scratch, since the positions it
+	// reads are about to move), then move with the corrected velocity.
+	#pragma omp parallel for
+	for (int i = 0; i < n; i++)
+	{
+		Particle &particle = particles[i];
+		const float pi = particle.press / (PressureDensity(particle) * PressureDensity(particle));
+
+		glm::vec3 acc = -particle.mass * pi * state[i].wallGrad;
+		for (const Neighbor &nb : particle.neighbors)
+		{
+			const Particle &pj = *nb.j;
+			const float pjr = pj.press / (PressureDensity(pj) * PressureDensity(pj));
+			acc -= pj.mass * (pi + pjr) * GradW(particle, nb, gradScale);
+		}
+		scratch[i] = acc;
+	}
+
+	#pragma omp parallel for reduction(metrics:stepSums)
+	for (int i = 0; i < n; i++)
+	{
+		Particle &particle = particles[i];
+		particle.vel = state[i].vAdv + scratch[i] * dt;
+		particle.pos_old = particle.pos;
+		particle.pos += particle.vel * dt;
+		ProjectContainerBoundaries(particle.pos, particle.pos_old);
+		particle.vel = (particle.pos - particle.pos_old) / dt;
+
+		// leave pos_old where the Verlet integration of step( ) expects it
+		particle.pos_old = particle.pos - particle.vel * dT;
+		particle.dt = dT;
+		SetParticleColor(particle);
+
+		// (the densities are those before the pressure solve)
+		if (useDiagnostics)
+		{
+			stepSums.AddDensity(particle.rho, particle.r_density, (int)particle.neighbors.size());
+			stepSums.AddMotion(particle.mass, glm::dot(particle.vel, particle.vel));
+		}
+	}
+}
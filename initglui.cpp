@@ -5,6 +5,7 @@
 
 GLUI* GluiMain;
 GLUI* GluiFluid;
+GLUI_StaticText* MetricsText[4];	// the lines of the Diagnostics panel (see diagnostics.cpp)
 
 const int MSEC = 1;
 float BackgroundIntensity = 0.f;
@@ -29,6 +30,15 @@ void SetDT(int id) {}
 void SetMass(int id) {}
 void SetGravity(int id) {}
 void SetVisualization(int id) {}
+void SetSolver(int id) {}
+void SetFrameDT(int id) {}
+void SetLocalLevel(int id) {}
+void SetKernelTableSize(int id) {}
+void SetTrajectoryBits(int id) {}
+void SetPlaybackSpeed(int id) {}
+void SetPlaybackFrame(int id) {}
+void SetExportFormat(int id) {}
+void SetWatchdogInterval(int id) {}
 
 void
 GluiIdle(void)
@@ -68,6 +78,19 @@ void Buttons(int id)
 		addMoreParticles(500);
 		break;
 
+	case DROP_BODY:
+		DropRigidBody();
+		break;
+
+	case SAVE_CHECKPOINT:
+		SaveCheckpoint(checkpointFile);
+		break;
+
+	case LOAD_CHECKPOINT:
+		if (LoadCheckpoint(checkpointFile))
+			GLUI_Master.sync_live_all();
+		break;
+
 	default:
 		fprintf(stderr, "Don't know what to do with Button ID %d\n", id);
 	}
@@ -209,19 +232,79 @@ InitGluiFluid(void)
 	GluiFluid->add_checkbox_to_panel(panel, "External Force", &externalForce);
 	GluiFluid->add_checkbox_to_panel(panel, "Increase boundary", &shrinkWorld);
 	GluiFluid->add_checkbox_to_panel(panel, "Lighting", &useLighting);
-
-	// GLUI_Spinner* spinner = GluiFluid->add_spinner_to_panel(
-	// 	panel,
-	// 	"dT",
-	// 	GLUI_SPINNER_FLOAT,
-	// 	&dT,
-	// 	1,
-	// 	(GLUI_Update_CB)SetDT
-	// );
-	// // Set spinner limits
-	// spinner->set_float_limits(0.8f, 1.6f, GLUI_LIMIT_CLAMP);
+	GluiFluid->add_checkbox_to_panel(panel, "Fused Force Pass", &useFusedPass);
+	GluiFluid->add_checkbox_to_panel(panel, "Boundary Particles", &useBoundaryParticles);
+	GluiFluid->add_checkbox_to_panel(panel, "SDF Colliders", &useColliders);
+	GluiFluid->add_checkbox_to_panel(panel, "Mesh Colliders", &useMeshColliders);
+	GluiFluid->add_checkbox_to_panel(panel, "Rigid Bodies", &useRigidBodies);
+	GluiFluid->add_checkbox_to_panel(panel, "2D Slice", &use2D);
+	GluiFluid->add_checkbox_to_panel(panel, "Kernel Table", &useKernelTable);
+	GluiFluid->add_checkbox_to_panel(panel, "Deterministic", &useDeterministic);
+	GluiFluid->add_checkbox_to_panel(panel, "Settled Start", &useSettledStart);
+	GluiFluid->add_checkbox_to_panel(panel, "Record Trajectory", &recordTrajectory);
+	GluiFluid->add_checkbox_to_panel(panel, "io_uring Output", &useIoUring);
+	GluiFluid->add_checkbox_to_panel(panel, "Direct I/O", &useDirectIO);
+
+	GluiFluid->add_checkbox_to_panel(panel, "Adaptive dT", &useAdaptiveDT);
+	GluiFluid->add_checkbox_to_panel(panel, "Local dT", &useLocalDT);
+	GluiFluid->add_checkbox_to_panel(panel, "Sleeping Particles", &useSleeping);
 
 	GLUI_Spinner* spinner = GluiFluid->add_spinner_to_panel(
+		panel,
+		"dT",
+		GLUI_SPINNER_FLOAT,
+		&dT,
+		1,
+		(GLUI_Update_CB)SetDT
+	);
+	// Set spinner limits (low enough for the steps the watchdog cuts)
+	spinner->set_float_limits(0.05f, 1.6f, GLUI_LIMIT_CLAMP);
+
+	spinner = GluiFluid->add_spinner_to_panel(
+		panel,
+		"Frame dT",
+		GLUI_SPINNER_FLOAT,
+		&frameDT,
+		1,
+		(GLUI_Update_CB)SetFrameDT
+	);
+	// Set spinner limits
+	spinner->set_float_limits(0.3f, 10.0f, GLUI_LIMIT_CLAMP);
+
+	spinner = GluiFluid->add_spinner_to_panel(
+		panel,
+		"Max Local dT Level",
+		GLUI_SPINNER_INT,
+		&maxLocalLevel,
+		1,
+		(GLUI_Update_CB)SetLocalLevel
+	);
+	// Set spinner limits
+	spinner->set_int_limits(0, 6, GLUI_LIMIT_CLAMP);
+
+	spinner = GluiFluid->add_spinner_to_panel(
+		panel,
+		"Kernel Table Size",
+		GLUI_SPINNER_INT,
+		&kernelTableSize,
+		1,
+		(GLUI_Update_CB)SetKernelTableSize
+	);
+	// Set spinner limits
+	spinner->set_int_limits(64, 65536, GLUI_LIMIT_CLAMP);
+
+	spinner = GluiFluid->add_spinner_to_panel(
+		panel,
+		"Trajectory Bits",
+		GLUI_SPINNER_INT,
+		&trajectoryBits,
+		1,
+		(GLUI_Update_CB)SetTrajectoryBits
+	);
+	// Set spinner limits (takes effect with the next recording)
+	spinner->set_int_limits(4, 16, GLUI_LIMIT_CLAMP);
+
+	spinner = GluiFluid->add_spinner_to_panel(
 		panel,
 		"Gravity",
 		GLUI_SPINNER_FLOAT,
@@ -233,6 +316,68 @@ InitGluiFluid(void)
 	spinner->set_float_limits(0.0f, 0.0006f, GLUI_LIMIT_CLAMP);
 
 
+	panel = GluiFluid->add_panel("Solver", true);
+	GLUI_RadioGroup* solver = new GLUI_RadioGroup(panel, &whichSolver, -1, (GLUI_Update_CB)SetSolver);
+	new GLUI_RadioButton( solver, "Double Density" );
+	new GLUI_RadioButton( solver, "Position Based" );
+	new GLUI_RadioButton( solver, "Implicit (IISPH)" );
+
+	spinner = GluiFluid->add_spinner_to_panel(
+		panel,
+		"PBF Iterations",
+		GLUI_SPINNER_INT,
+		&pbfIterations,
+		1,
+		(GLUI_Update_CB)SetSolver
+	);
+	// Set spinner limits
+	spinner->set_int_limits(1, 20, GLUI_LIMIT_CLAMP);
+
+	spinner = GluiFluid->add_spinner_to_panel(
+		panel,
+		"PBF dT",
+		GLUI_SPINNER_FLOAT,
+		&pbfDT,
+		1,
+		(GLUI_Update_CB)SetSolver
+	);
+	// Set spinner limits (low enough for the steps the watchdog cuts)
+	spinner->set_float_limits(0.05f, 10.0f, GLUI_LIMIT_CLAMP);
+
+	spinner = GluiFluid->add_spinner_to_panel(
+		panel,
+		"IISPH Max Iterations",
+		GLUI_SPINNER_INT,
+		&iisphMaxIterations,
+		1,
+		(GLUI_Update_CB)SetSolver
+	);
+	// Set spinner limits
+	spinner->set_int_limits(2, 200, GLUI_LIMIT_CLAMP);
+
+	spinner = GluiFluid->add_spinner_to_panel(
+		panel,
+		"IISPH Tolerance",
+		GLUI_SPINNER_FLOAT,
+		&iisphTolerance,
+		1,
+		(GLUI_Update_CB)SetSolver
+	);
+	// Set spinner limits
+	spinner->set_float_limits(0.0001f, 0.1f, GLUI_LIMIT_CLAMP);
+
+	spinner = GluiFluid->add_spinner_to_panel(
+		panel,
+		"IISPH dT",
+		GLUI_SPINNER_FLOAT,
+		&iisphDT,
+		1,
+		(GLUI_Update_CB)SetSolver
+	);
+	// Set spinner limits (low enough for the steps the watchdog cuts)
+	spinner->set_float_limits(0.05f, 30.0f, GLUI_LIMIT_CLAMP);
+
+
 	panel = GluiFluid->add_panel("Visualization", true);
 	GLUI_RadioGroup* visualization = new GLUI_RadioGroup(panel, &whichVisualization, -1, (GLUI_Update_CB)SetVisualization);
 	new GLUI_RadioButton( visualization, "Visual 1" );
@@ -240,6 +385,58 @@ InitGluiFluid(void)
 	new GLUI_RadioButton( visualization, "Visual 3" );
 
 
+	panel = GluiFluid->add_panel("Diagnostics", true);
+	GluiFluid->add_checkbox_to_panel(panel, "Measure Every Step", &useDiagnostics);
+	for (int i = 0; i < 4; i++)
+		MetricsText[i] = GluiFluid->add_statictext_to_panel(panel, "");
+	GluiFluid->add_checkbox_to_panel(panel, "Watchdog", &useWatchdog);
+	spinner = GluiFluid->add_spinner_to_panel(
+		panel,
+		"Snapshot Every",
+		GLUI_SPINNER_INT,
+		&watchdogInterval,
+		1,
+		(GLUI_Update_CB)SetWatchdogInterval
+	);
+	// Set spinner limits (in frames)
+	spinner->set_int_limits(1, 1000, GLUI_LIMIT_CLAMP);
+
+	panel = GluiFluid->add_panel("Export", true);
+	GluiFluid->add_checkbox_to_panel(panel, "Export Frames", &exportFrames);
+	GLUI_RadioGroup* format = new GLUI_RadioGroup(panel, &exportFormat, -1, (GLUI_Update_CB)SetExportFormat);
+	new GLUI_RadioButton( format, "VTK" );
+	new GLUI_RadioButton( format, "VTK XML" );
+	new GLUI_RadioButton( format, "PLY" );
+	new GLUI_RadioButton( format, "BGEO" );
+	GluiFluid->add_checkbox_to_panel(panel, "Density", &exportRho);
+	GluiFluid->add_checkbox_to_panel(panel, "Pressure", &exportPress);
+	GluiFluid->add_checkbox_to_panel(panel, "Velocity", &exportVel);
+
+	panel = GluiFluid->add_panel("Playback", true);
+	GluiFluid->add_checkbox_to_panel(panel, "Play Trajectory", &usePlayback);
+	spinner = GluiFluid->add_spinner_to_panel(
+		panel,
+		"Speed",
+		GLUI_SPINNER_FLOAT,
+		&playbackSpeed,
+		1,
+		(GLUI_Update_CB)SetPlaybackSpeed
+	);
+	// Set spinner limits (0 pauses, negative plays backwards)
+	spinner->set_float_limits(-8.0f, 8.0f, GLUI_LIMIT_CLAMP);
+
+	spinner = GluiFluid->add_spinner_to_panel(
+		panel,
+		"Frame",
+		GLUI_SPINNER_INT,
+		&playbackFrame,
+		1,
+		(GLUI_Update_CB)SetPlaybackFrame
+	);
+	// Set spinner limits (AdvancePlayback( ) clamps it to the frames there are)
+	spinner->set_int_limits(0, 1 << 30, GLUI_LIMIT_CLAMP);
+
+
 	panel = GluiFluid->add_panel("Add more particles", true);
 	spinner = GluiFluid->add_spinner_to_panel(
 		panel,
@@ -264,5 +461,8 @@ InitGluiFluid(void)
 	spinner->set_float_limits(1.0f, 15.0f, GLUI_LIMIT_CLAMP);
 
 	GluiFluid->add_button_to_panel(panel, "Add", ADD, (GLUI_Update_CB)Buttons);
+	GluiFluid->add_button_to_panel(panel, "Drop Body", DROP_BODY, (GLUI_Update_CB)Buttons);
+	GluiFluid->add_button_to_panel(panel, "Save Checkpoint", SAVE_CHECKPOINT, (GLUI_Update_CB)Buttons);
+	GluiFluid->add_button_to_panel(panel, "Load Checkpoint", LOAD_CHECKPOINT, (GLUI_Update_CB)Buttons);
 	GluiFluid->add_checkbox_to_panel(panel, "Open Hole", &useOpening);
 }
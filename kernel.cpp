@@ -0,0 +1,136 @@
+// --------------------------------------------------------------------
+// Kernel constants and tabulated kernels
+//
+// Every solver works with the same kernel pieces of a pair closer than r,
+//		q = 1 - |rij| / r
+// with q^2 the 'far' and q^3 the 'near' density kernel, and the sums
+// normalized by the volume of a ball of radius 8 r. The normalizations are
+// computed once for each r (UpdateKernelVolumes( )), not per particle.
+//
+// With useKernelTable on, q is looked up by |rij|^2 in a table of
+// kernelTableSize entries instead, so finding a pair costs no sqrt. The
+// table is linear in |rij|^2 and q has an infinite slope at 0, so its error
+// is largest for the closest pairs: about 0.25 / sqrt(kernelTableSize) in
+// the first entry, and below 1.e-4 past |rij| = r / 8 with 1024 entries.
+
+// the normalizations of the density sums, in 3D and 2D:
+static inline float KernelVolume3D(const float radius)
+{
+	return (4.0f / 3.0f) * F_PI * ((double)radius*8.) * ((double)radius*8.) * ((double)radius*8.);
+}
+
+static inline float KernelVolume2D(const float radius)
+{
+	return F_PI * ((double)radius*8.) * ((double)radius*8.);
+}
+
+float kernelVolume3D = KernelVolume3D(r);		// ... of the current r
+float kernelVolume2D = KernelVolume2D(r);
+
+// (call whenever r changes)
+void UpdateKernelVolumes()
+{
+	kernelVolume3D = KernelVolume3D(r);
+	kernelVolume2D = KernelVolume2D(r);
+}
+
+// --------------------------------------------------------------------
+class KernelTable
+{
+public:
+	KernelTable() : mSize(0), mScale(0.f), mRadius(0.f) {}
+
+	// q at size + 1 evenly spaced |rij|^2 from 0 to r^2:
+	void Build(const int size)
+	{
+		mQ.resize(size + 2);
+		for (int i = 0; i <= size; i++)
+			mQ[i] = 1.f - sqrtf((float)i / (float)size);
+		mQ[size + 1] = 0.f;		// so |rij|^2 just below r^2 can read one ahead
+		mScale = (float)size / rsq;
+		mSize = size;
+		mRadius = r;
+	}
+
+	int Size() const
+	{
+		return mSize;
+	}
+
+	// the r it was built for
+	float Radius() const
+	{
+		return mRadius;
+	}
+
+	// q and |rij| for len2 = |rij|^2 < r^2. Over the first few entries sqrt
+	// is too curved to interpolate, so the closest pairs get the real thing.
+	inline float Q(const float len2, float &len) const
+	{
+		const float x = len2 * mScale;
+		// (a table built for a smaller r must not read past its end)
+		const int i = glm::min((int)x, mSize);
+		if (i < ExactEntries)
+		{
+			len = sqrtf(len2);
+			return 1.f - len / r;
+		}
+		const float t = x - (float)i;
+		const float q = mQ[i] + t * (mQ[i + 1] - mQ[i]);
+		len = r * (1.f - q);
+		return q;
+	}
+
+	// the largest relative error in |rij| (and so in the pair directions)
+	// and the largest error in q
+	void MaxErrors(float &lenError, float &qError) const
+	{
+		lenError = qError = 0.f;
+		const int samples = 64 * mSize;
+		for (int i = 1; i < samples; i++)
+		{
+			const float exact = r * (float)i / (float)samples;
+			float len;
+			const float q = Q(exact * exact, len);
+			lenError = glm::max(lenError, fabsf(len - exact) / exact);
+			qError = glm::max(qError, fabsf(q - (1.f - exact / r)));
+		}
+	}
+
+private:
+	static const int ExactEntries = 4;
+
+	std::vector<float> mQ;
+	int mSize;
+	float mScale;		// table entries per unit of |rij|^2
+	float mRadius;
+};
+
+KernelTable kernelTable;
+
+// build the table if it is on and its size or r has been changed:
+// (call outside of any parallel region)
+void UpdateKernelTable()
+{
+	if (useKernelTable && (kernelTable.Size() != kernelTableSize || kernelTable.Radius() != r))
+	{
+		kernelTable.Build(kernelTableSize);
+		if (DebugOn != 0)
+		{
+			float lenError, qError;
+			kernelTable.MaxErrors(lenError, qError);
+			fprintf(stderr, "Kernel table: %d entries, error %g in |rij| (relative), %g in q\n",
+				kernelTableSize, lenError, qError);
+		}
+	}
+}
+
+// --------------------------------------------------------------------
+// q and |rij| of a pair with |rij|^2 = len2 < r^2
+static inline float KernelQ(const float len2, float &len)
+{
+	if (useKernelTable)
+		return kernelTable.Q(len2, len);
+	len = sqrtf(len2);
+	return 1.f - len / r;
+}
@@ -3,7 +3,7 @@
 #include <stdlib.h>
 #include <math.h>
 #include <ctype.h>
-#include <GL/gl.h>
+#include <OpenGL/gl.h>
 
 #include <vector>
 
@@ -37,24 +37,66 @@ struct face
 };
 
 
+// an indexed triangle mesh, as read from the obj file.
+// every triangle has 3 corners, each indexing into the vertices, normals
+// and texture coords separately (0-based, -1 if the obj file had none):
+
+struct ObjMesh
+{
+	std::vector <struct Vertex> Vertices;
+	std::vector <struct Normal> Normals;
+	std::vector <struct TextureCoord> TextureCoords;
+	std::vector <struct face> Corners;		// 3 per triangle
+	std::vector <struct Normal> FaceNormals;	// 1 per triangle
+
+	int NumTriangles( ) const	{ return (int)FaceNormals.size( ); }
+};
+
+
 char *	ReadRestOfLine( FILE * );
 void	ReadObjVTN( char *, int *, int *, int * );
+int	ReadObjFile( char *, struct ObjMesh & );
+void	DrawObjMesh( const struct ObjMesh & );
 
 
 
+// read the obj file and draw it with immediate-mode triangles:
+// (meant to go between glNewList( ) and glEndList( ))
+
 int
 LoadObjFile( char *name )
+{
+	struct ObjMesh mesh;
+	if( ReadObjFile( name, mesh )  !=  0 )
+		return 1;
+
+	DrawObjMesh( mesh );
+	return 0;
+}
+
+
+
+// read the obj file into an indexed mesh:
+
+int
+ReadObjFile( char *name, struct ObjMesh &mesh )
 {
 	char *cmd;		// the command string
 	char *str;		// argument string
 
-	std::vector <struct Vertex> Vertices(10000);
-	std::vector <struct Normal> Normals(10000);
-	std::vector <struct TextureCoord> TextureCoords(10000);
+	std::vector <struct Vertex> &Vertices = mesh.Vertices;
+	std::vector <struct Normal> &Normals = mesh.Normals;
+	std::vector <struct TextureCoord> &TextureCoords = mesh.TextureCoords;
 
 	Vertices.clear();
 	Normals.clear();
 	TextureCoords.clear();
+	mesh.Corners.clear();
+	mesh.FaceNormals.clear();
+
+	Vertices.reserve( 10000 );
+	Normals.reserve( 10000 );
+	TextureCoords.reserve( 10000 );
 
 	struct Vertex sv;
 	struct Normal sn;
@@ -78,8 +120,6 @@ LoadObjFile( char *name )
 	float ymax = -ymin;
 	float zmax = -zmin;
 
-	glBegin( GL_TRIANGLES );
-
 	for( ; ; )
 	{
 		char *line = ReadRestOfLine( fp );
@@ -287,24 +327,20 @@ LoadObjFile( char *name )
 				v02[2] = v2->z - v0->z;
 				Cross( v01, v02, norm );
 				Unit( norm, norm );
-				glNormal3fv( norm );
+
+				struct Normal fn;
+				fn.nx = norm[0];
+				fn.ny = norm[1];
+				fn.nz = norm[2];
+				mesh.FaceNormals.push_back( fn );
 
 				for( int vtx = 0; vtx < 3 ; vtx++ )
 				{
-					if( vertices[ vv[vtx] ].t != 0 )
-					{
-						struct TextureCoord *tp = &TextureCoords[ vertices[ vv[vtx] ].t - 1 ];
-						glTexCoord2f( tp->s, tp->t );
-					}
-
-					if( vertices[ vv[vtx] ].n != 0 )
-					{
-						struct Normal *np = &Normals[ vertices[ vv[vtx] ].n - 1 ];
-						glNormal3f( np->nx, np->ny, np->nz );
-					}
-
-					struct Vertex *vp = &Vertices[ vertices[ vv[vtx] ].v - 1 ];
-					glVertex3f( vp->x, vp->y, vp->z );
+					struct face c;
+					c.v = vertices[ vv[vtx] ].v - 1;
+					c.n = vertices[ vv[vtx] ].n - 1;
+					c.t = vertices[ vv[vtx] ].t - 1;
+					mesh.Corners.push_back( c );
 				}
 			}
 			continue;
@@ -318,7 +354,6 @@ LoadObjFile( char *name )
 
 	}
 
-	glEnd();
 	fclose( fp );
 
 	fprintf( stderr, "Obj file range: [%8.3f,%8.3f,%8.3f] -> [%8.3f,%8.3f,%8.3f]\n",
@@ -333,6 +368,43 @@ LoadObjFile( char *name )
 
 
 
+// draw the mesh with immediate-mode triangles:
+
+void
+DrawObjMesh( const struct ObjMesh &mesh )
+{
+	glBegin( GL_TRIANGLES );
+
+	for( int it = 0; it < mesh.NumTriangles( ); it++ )
+	{
+		const struct Normal *fn = &mesh.FaceNormals[ it ];
+		glNormal3f( fn->nx, fn->ny, fn->nz );
+
+		for( int vtx = 0; vtx < 3 ; vtx++ )
+		{
+			const struct face *c = &mesh.Corners[ 3*it + vtx ];
+			if( c->t >= 0 )
+			{
+				const struct TextureCoord *tp = &mesh.TextureCoords[ c->t ];
+				glTexCoord2f( tp->s, tp->t );
+			}
+
+			if( c->n >= 0 )
+			{
+				const struct Normal *np = &mesh.Normals[ c->n ];
+				glNormal3f( np->nx, np->ny, np->nz );
+			}
+
+			const struct Vertex *vp = &mesh.Vertices[ c->v ];
+			glVertex3f( vp->x, vp->y, vp->z );
+		}
+	}
+
+	glEnd();
+}
+
+
+
 char *
 ReadRestOfLine( FILE *fp )
 {
@@ -366,7 +438,9 @@ ReadRestOfLine( FILE *fp )
 		}
 	}
 
-	return "";
+	// (not reached, the loop only ends with a return)
+	static char empty[1] = { '\0' };
+	return empty;
 }
 
 
@@ -0,0 +1,171 @@
+// --------------------------------------------------------------------
+// Multi-rate (local) time stepping for the double density solver
+//
+// Every step( ) of dT, each particle is put in a power-of-two bin by its
+// own CFL and force limits: a particle of level L takes 2^L steps of
+// dT / 2^L. The step is cut into 2^maxLevel ticks, and at every tick only
+// the particles whose bin is due move and get new densities and forces.
+// A bin is due whenever all finer bins are as well, so at every boundary
+// of a bin the forces of that bin and all finer ones are found together.
+// Particles that are not due are seen by the others where they last were.
+//
+// Level 0 particles only move in the first tick, so they stay in indexsp
+// for the whole step. The finer ones go into fineIndex, which is rebuilt
+// every tick but only holds the particles that actually move.
+
+IndexType fineIndex(4093, r*2);
+
+// the bin a particle's own CFL and force limits put it in:
+static inline int LocalLevel(const Particle &particle)
+{
+	const float vel2 = glm::dot(particle.vel, particle.vel);
+	const glm::vec3 acc = particle.force / particle.mass;
+	const float acc2 = glm::dot(acc, acc);
+
+	float dt = dT;
+	if (vel2 > 0.f)
+		dt = glm::min(dt, cflNumber * r / sqrtf(vel2));
+	if (acc2 > 0.f)
+		dt = glm::min(dt, forceNumber * sqrtf(r / sqrtf(acc2)));
+
+	int level = 0;
+	while (level < maxLocalLevel && dT / (float)(1 << level) > dt)
+		level++;
+	return level;
+}
+
+// --------------------------------------------------------------------
+void stepLocal()
+{
+	const int n = (int)particles.size();
+	if (n == 0)
+		return;
+
+	const float volume = Dimension<3>::KernelVolume();
+
+	// per-step temporaries, they are gone with the next ResetScratchArenas( )
+	ScratchArena &arena = ThreadArena();
+	std::vector<int, ArenaAllocator<int> > levels(n, 0, ArenaAllocator<int>(arena));
+	std::vector<int, ArenaAllocator<int> > order(n, 0, ArenaAllocator<int>(arena));
+
+	// BINS
+	// A particle is never more than one level coarser than the finest of its
+	// neighbors (from the last step), so fast particles do not run into
+	// ones that only look at them every few ticks.
+	// (this is also where the diagnostics see the particles, as the last
+	// step left them)
+	int maxLevel = 0;
+	#pragma omp parallel for reduction(max:maxLevel) reduction(metrics:stepSums)
+	for (int i = 0; i < n; i++)
+	{
+		Particle &particle = particles[i];
+		int level = LocalLevel(particle);
+		for (const Neighbor &nb : particle.neighbors)
+			level = glm::max(level, LocalLevel(*nb.j) - 1);
+		levels[i] = level;
+		maxLevel = glm::max(maxLevel, level);
+
+		if (useDiagnostics)
+		{
+			stepSums.AddDensity(particle.rho, particle.r_density, (int)particle.neighbors.size());
+			stepSums.AddMotion(particle.mass, glm::dot(particle.vel, particle.vel));
+		}
+	}
+
+	// sort the particles by level (counting sort), so the bins that are due
+	// at a tick are always one range at the end of order:
+	int binStart[32 + 1] = { 0 };
+	for (int i = 0; i < n; i++)
+	{
+		particles[i].level = levels[i];
+		binStart[levels[i] + 1]++;
+	}
+	for (int l = 0; l < maxLevel; l++)
+		binStart[l + 1] += binStart[l];
+	{
+		int fill[32];
+		memcpy(fill, binStart, sizeof(fill));
+		for (int i = 0; i < n; i++)
+			order[fill[levels[i]]++] = i;
+	}
+
+	const int numTicks = 1 << maxLevel;
+	localParticleSteps = 0;
+	for (int tick = 0; tick < numTicks; tick++)
+	{
+		// level L is due every numTicks / 2^L ticks, find the coarsest one
+		// that is due now:
+		int firstLevel = 0;
+		if (tick > 0)
+		{
+			firstLevel = maxLevel;
+			while (tick % (numTicks >> (firstLevel - 1)) == 0)
+				firstLevel--;
+		}
+		const int first = binStart[firstLevel];
+		const int firstFine = binStart[1];
+		localParticleSteps += n - first;
+
+		#pragma omp parallel for
+		for (int a = first; a < n; a++)
+		{
+			Particle &particle = particles[order[a]];
+			AdvanceParticle(particle, dT / (float)(1 << particle.level));
+			if (useColliders && useGravity)
+				CollideWithScene(particle.pos);
+			else if (useMeshColliders)
+				CollideWithMeshes(particle.pos, particle.pos_old);
+			if (useRigidBodies)
+				CollideWithBodies(particle.pos);
+		}
+
+		// update spatial indices
+		if (tick == 0)
+		{
+			indexsp.Clear();
+			for (int a = 0; a < firstFine; a++)
+				indexsp.Insert(particles[order[a]].pos, &particles[order[a]]);
+		}
+		fineIndex.Clear();
+		for (int a = firstFine; a < n; a++)
+			fineIndex.Insert(particles[order[a]].pos, &particles[order[a]]);
+
+		// DENSITY AND PRESSURE
+		#pragma omp parallel for
+		for (int a = first; a < n; a++)
+		{
+			Particle &particle = particles[order[a]];
+			float d = 0, dn = 0;
+			FindNeighbors(particle, d, dn, &fineIndex);
+			if (UseWallSamples())
+				FindWallNeighbors(particle, d, dn);
+
+			particle.rho = (d * particle.mass) / volume;
+			particle.rho_near = (dn * particle.mass) / volume;
+			particle.press = k * (particle.rho - particle.r_density);
+			particle.press_near = k_near * particle.rho_near;
+		}
+
+		// PRESSURE FORCE + VISCOSITY
+		const glm::vec3 *velocities = SnapshotVelocities();
+		#pragma omp parallel for
+		for (int a = first; a < n; a++)
+		{
+			Particle &particle = particles[order[a]];
+			SetParticleColor(particle);
+
+			// (a particle of level L takes 2^L substeps of dT / 2^L)
+			const float h = dT / (float)(1 << particle.level);
+			glm::vec3 dX(0);
+			for (const Neighbor &nb : particle.neighbors)
+			{
+				const glm::vec3 rijn = PairDirection(particle, nb);
+				dX += rijn * PressureWeight(particle, nb);
+				particle.vel -= ViscosityImpulse(particle, nb, rijn, velocities, h);
+			}
+			if (UseWallSamples())
+				dX += WallPressureDisplacement(particle);
+			particle.force -= dX;
+		}
+	}
+}
@@ -1,12 +1,33 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <ctype.h>
+#include <limits.h>
+#include <float.h>
+#include <errno.h>
 #include <vector>
+#include <algorithm>
 #include <unordered_map>
 #include <string>
 #include <sstream>
 #include <iomanip> // for std::setprecision
 #include <omp.h>  // Include OpenMP header
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/inotify.h>
+#endif
 
 #define NUMT 4
 
@@ -26,6 +47,7 @@
 #define GLM_FORCE_RADIANS
 #include "glm/glm.hpp"
 #include "glm/gtc/matrix_transform.hpp"
+#include "glm/gtc/quaternion.hpp"
 #include "glm/gtc/type_ptr.hpp"
 
 #include "glui.h"
@@ -101,13 +123,25 @@ enum Projections
 	PERSP
 };
 
+// which solver step( ) runs:
+
+enum Solvers
+{
+	DOUBLE_DENSITY,
+	POSITION_BASED,
+	IMPLICIT_INCOMPRESSIBLE
+};
+
 // which button:
 
 enum ButtonVals
 {
 	RESET,
 	QUIT,
-	ADD
+	ADD,
+	DROP_BODY,
+	SAVE_CHECKPOINT,
+	LOAD_CHECKPOINT
 };
 
 // window background color (rgba):
@@ -170,6 +204,16 @@ const float WHITE[] = {1., 1., 1., 1.};
 
 const int MS_PER_CYCLE = 30000; // 10000 milliseconds = 10 seconds
 
+// --------------------------------------------------------------------
+// Define this to store the unit direction of every pair with its Neighbor
+// entry when the density pass finds it. The pressure force and viscosity
+// passes then take it from the list instead of re-reading the neighbor's
+// position and taking two more square roots. Comment it out to trade the
+// extra 12 bytes per pair for recomputing the direction in each pass.
+// (The distance itself is always recoverable from q: |rij| = r * (1 - q).)
+
+#define CACHE_PAIR_GEOMETRY
+
 // --------------------------------------------------------------------
 // A structure for holding two neighboring particles and their weighted distances
 struct Particle;
@@ -177,6 +221,9 @@ struct Neighbor
 {
 	Particle *j;
 	float q, q2;
+#ifdef CACHE_PAIR_GEOMETRY
+	glm::vec3 dir;		// unit vector from Particle i to Particle j
+#endif
 };
 
 // --------------------------------------------------------------------
@@ -197,7 +244,13 @@ struct Particle
 	float sigma;
 	float beta;
 	float r_density;
+	float dt;		// size of the step whose prediction is already in pos
+	int level;		// local time step bin, the particle steps with dT / 2^level
+	int calmSteps;	// steps in a row this particle has been calm
+	int asleep;		// != 0 means the particle is skipped by step( )
+	int wakeUp;		// set by a moving neighbor to wake a sleeper
 	std::vector<Neighbor> neighbors;
+	std::vector<Neighbor> wallNeighbors;	// boundary and body samples within r
 };
 
 // Our collection of particles
@@ -205,16 +258,17 @@ std::vector<Particle> particles;
 
 // --------------------------------------------------------------------
 // Some constants for the relevant simulation.
+// (a scene file can change any of them while the program runs, see scene.cpp)
 
 float G = .001f * .25;		   // Gravitational Constant for our simulation
-const float spacing = .07f;		   // Spacing of particles
-const float k = spacing / 1000.0f; // Far pressure weight
-const float k_near = k * 10.;	   // Near pressure weight
-const float r = spacing * 1.25f;   // Radius of Support
-const float rsq = r * r;		   // ... squared for performance stuff
-const float SIM_W = .8;		   // The size of the world
-const float bottom = 0;			   // The floor of the world
-const float i_girth = 1.f;		   // initial parameters
+float spacing = .07f;		   // Spacing of particles
+float k = spacing / 1000.0f; // Far pressure weight
+float k_near = k * 10.;	   // Near pressure weight
+float r = spacing * 1.25f;   // Radius of Support
+float rsq = r * r;		   // ... squared for performance stuff
+float SIM_W = .8;		   // The size of the world
+float bottom = 0;			   // The floor of the world
+float i_girth = 1.f;		   // initial parameters
 
 float p_size = 4;		   // particle size
 int N = 500;
@@ -222,6 +276,71 @@ float rest_density = 3.5;	   // Rest Density
 float dT = 1.2;			// delta time, for step iteration
 float mass = 1.;
 
+// Position Based Fluids parameters (see pbfsolver.cpp):
+int pbfIterations = 4;			// constraint iterations per step
+float pbfDT = 4.8f;				// step size, PBF stays stable well beyond dT
+float pbfRelaxation = 20.f;		// constraint force mixing, keeps lambda finite
+float pbfXSPH = 0.05f;			// XSPH viscosity
+
+// Implicit incompressible SPH parameters (see iisphsolver.cpp):
+float iisphDT = 3.f;			// step size
+int iisphMaxIterations = 50;	// cap on the pressure iterations per step
+float iisphTolerance = 0.01f;	// stop at this average density error (fraction of rest)
+float iisphOmega = 0.5f;		// relaxation of the Jacobi iterations
+
+// Adaptive time stepping parameters (see AdvanceFrame( )):
+float frameDT = 2.4f;			// simulated time covered by one rendered frame
+float minDT = 0.3f;				// bounds on the adaptive step
+float maxDT = 2.4f;
+float cflNumber = 0.4f;			// fraction of r a particle may travel per step
+float forceNumber = 0.25f;		// ... and the same criterion for the accelerations
+int maxSubsteps = 16;			// past this a frame covers less than frameDT
+int substepsUsed = 0;			// substeps the last frame took
+
+// Local time stepping parameters (see localdt.cpp):
+int maxLocalLevel = 3;			// finest bin steps with dT / 2^maxLocalLevel
+int localParticleSteps = 0;		// particle updates the last step took
+
+// Sleeping particle parameters (see sleeping.cpp):
+float sleepVelocity = 0.002f;	// below this speed a particle counts as calm
+float sleepDensityError = 0.05f;// ... as long as it is compressed less than this (fraction of rest)
+int sleepSteps = 30;			// calm steps before a particle falls asleep
+
+// SDF collider parameters (see sdfcollider.cpp):
+float colliderMargin = 0.005f;	// particles are kept this far from the surfaces
+
+// rigid bodies
+float rigidFriction = 0.4f;		// Coulomb friction of the contacts
+float rigidDamping = 0.002f;	// fraction of their velocity the bodies lose per step
+int rigidContactIterations = 4;	// passes over the contacts per step
+
+// trajectory output (see trajectory.cpp)
+const char *trajectoryFile = "trajectory.sphtraj";
+int trajectoryBits = 16;		// per quantized component
+int trajectoryKeyInterval = 60;	// frames between frames that are not delta encoded
+int trajectoryQueueSize = 4;	// snapshots the writer may fall behind before the step loop waits
+float trajectoryVelRange = 0.05f;	// velocities are quantized in [-range, range]
+size_t trajectoryBufferBytes = 4 << 20;	// io_uring output buffers, they grow to fit a frame
+
+// particle export (see exporter.cpp)
+const char *exportDir = "export";
+int exportFormat = 0;			// EXPORT_VTK, EXPORT_VTP, EXPORT_PLY or EXPORT_BGEO
+int exportQueueSize = 2;		// snapshots the exporter may fall behind before the step loop waits
+int exportThreads = 2;			// threads converting a snapshot
+int exportChunk = 65536;		// particles they convert at a time
+
+// trajectory playback (see playback.cpp)
+const char *playbackFile = "trajectory.sphtraj";
+int playbackReadAhead = 4;		// frames decoded ahead of the one shown
+
+// blow-up watchdog (see watchdog.cpp)
+int watchdogInterval = 50;		// frames between snapshots
+int watchdogSnapshots = 4;		// snapshots kept
+int watchdogRetries = 3;		// rollbacks to a snapshot before the one before it is tried
+float watchdogBackoff = 0.5f;	// the step is cut by this with every rollback
+float watchdogMaxTravel = 10.f;	// a particle moving more r than this in one step is a blow-up,
+float watchdogMaxDensityError = 0.5f;	// ... and so is a mean density error above this (fraction of rest)
+
 // #define DEMO_Z_FIGHTING
 // #define DEMO_DEPTH_BUFFER
 
@@ -258,6 +377,33 @@ int shrinkWorld;
 int useLighting;
 int whichVisualization;
 int useOpening;
+int useFusedPass;
+int whichSolver;
+int useAdaptiveDT;
+int useLocalDT;
+int useSleeping;
+int useBoundaryParticles;
+int useColliders;
+int useMeshColliders;
+int useRigidBodies;
+int use2D;
+int useKernelTable;
+int useDeterministic;			// != 0 means runs repeat bit for bit (see deterministic.cpp)
+int useDiagnostics;				// != 0 means the solvers measure stepMetrics as they go (see diagnostics.cpp)
+int useWatchdog;				// != 0 means blow-ups are rolled back to a snapshot (see watchdog.cpp)
+int useSettledStart;			// != 0 means Reset( ) starts from a settled pool (see settledcache.cpp)
+int recordTrajectory;			// != 0 means every frame goes to trajectoryFile
+int useIoUring;					// != 0 means trajectories and checkpoints are written through io_uring (see outputstream.cpp)
+int useDirectIO;				// ... and with O_DIRECT
+int usePlayback;				// != 0 means playbackFile is shown instead of the simulation
+int playbackFrame;				// the frame of it shown, set it to scrub
+float playbackSpeed = 1.f;		// recorded frames per displayed frame, 0 pauses, < 0 plays backwards
+int exportFrames;				// != 0 means every frame is exported to exportDir
+int exportRho = 1;				// ... with the densities,
+int exportPress = 1;			// ... the pressures
+int exportVel = 1;				// ... and the velocities
+int kernelTableSize = 1024;		// entries of the tabulated kernel (see kernel.cpp)
+const char *checkpointFile = "fluid.ckpt";	// where k saves and K loads (see checkpoint.cpp)
 int DisplayFrameRate = 0;
 int Verbose = 1;
 
@@ -278,6 +424,7 @@ void DoStrokeString(float, float, float, float, char *);
 float ElapsedSeconds();
 void InitGraphics();
 void InitLists();
+void InitGridLists();
 void InitMenus();
 void Keyboard(unsigned char, int, int);
 void MouseButton(int, int, int, int);
@@ -296,6 +443,10 @@ float Unit(float[3]);
 void initParticles(const unsigned int);
 void addMoreParticles(const unsigned int);
 void step();
+void DropRigidBody();
+bool SaveCheckpoint(const char *);
+bool LoadCheckpoint(const char *);
+void ForgetSnapshots();
 
 // utility to create an array from 3 separate values:
 
@@ -372,17 +523,102 @@ float randab(float a, float b)
 // #include "osucone.cpp"
 // #include "osutorus.cpp"
 // #include "bmptotexture.cpp"
-// #include "loadobjfile.cpp"
+#include "loadobjfile.cpp"
 // #include "keytime.cpp"
 // #include "glslprogram.cpp"'
 #include "initglui.cpp"
+#include "scratcharena.cpp"
+#include "kernel.cpp"
+#include "deterministic.cpp"
+#include "particlegen.cpp"
+
+// --------------------------------------------------------------------
+// What changes with the number of dimensions the simulation runs in.
+// The 3D path uses Dimension<3>, the 2D slices of dimsolver.cpp
+// Dimension<2>.
+template <int D>
+struct Dimension;
+
+template <>
+struct Dimension<3>
+{
+	typedef glm::vec3 Vec;
+	typedef glm::ivec3 IVec;
+
+	// "Optimized Spatial Hashing for Collision Detection of Deformable Objects"
+	// Teschner, Heidelberger, et al.
+	// returns a hash between 0 and 2^32-1
+	static std::size_t Hash(const IVec &pos)
+	{
+		const unsigned int p1 = 73856093;
+		const unsigned int p2 = 19349663;
+		const unsigned int p3 = 83492791;
+		return static_cast<std::size_t>((pos.x * p1) ^ (pos.y * p2) ^ (pos.z * p3));
+	}
+
+	// a cell and its 26 neighbors
+	static void Stencil(std::vector<IVec> &offsets)
+	{
+		for (int i = -1; i <= 1; i++)
+			for (int j = -1; j <= 1; j++)
+				for (int k = -1; k <= 1; k++)
+					offsets.push_back(IVec(i, j, k));
+	}
+
+	// what the density sums are normalized by: a ball of radius 8 r
+	static float KernelVolume()
+	{
+		return kernelVolume3D;
+	}
+
+	static glm::vec3 ToVec3(const Vec &v)
+	{
+		return v;
+	}
+};
+
+template <>
+struct Dimension<2>
+{
+	typedef glm::vec2 Vec;
+	typedef glm::ivec2 IVec;
+
+	static std::size_t Hash(const IVec &pos)
+	{
+		const unsigned int p1 = 73856093;
+		const unsigned int p2 = 19349663;
+		return static_cast<std::size_t>((pos.x * p1) ^ (pos.y * p2));
+	}
+
+	// a cell and its 8 neighbors
+	static void Stencil(std::vector<IVec> &offsets)
+	{
+		for (int i = -1; i <= 1; i++)
+			for (int j = -1; j <= 1; j++)
+				offsets.push_back(IVec(i, j));
+	}
+
+	// a disc of radius 8 r
+	static float KernelVolume()
+	{
+		return kernelVolume2D;
+	}
+
+	// the slice is drawn in the z = 0 plane
+	static glm::vec3 ToVec3(const Vec &v)
+	{
+		return glm::vec3(v.x, v.y, 0.f);
+	}
+};
 
 // --------------------------------------------------------------------
-template <typename T>
+template <typename T, int D = 3>
 class SpatialIndex
 {
 public:
-	typedef std::vector<T *> NeighborList;
+	typedef typename Dimension<D>::Vec Vec;
+	typedef typename Dimension<D>::IVec IVec;
+	typedef std::vector<T *, ArenaAllocator<T *> > NeighborList;
 
 	SpatialIndex(
 		const unsigned int numBuckets, // number of hash buckets
@@ -391,20 +627,30 @@ public:
 		: mHashMap(numBuckets), mInvCellSize(1.0f / cellSize)
 	{
 		// initialize neighbor offsets
-		for (int i = -1; i <= 1; i++)
-			for (int j = -1; j <= 1; j++)
-				for (int k = -1; k <= 1; k++)
-					mOffsets.push_back(glm::ivec3(i, j, k));
+		Dimension<D>::Stencil(mOffsets);
 	}
 
-	void Insert(const glm::vec3 &pos, T *thing)
+	// Empties the index, everything has to be inserted again.
+	void SetCellSize(const float cellSize)
+	{
+		mHashMap.clear();
+		mInvCellSize = 1.0f / cellSize;
+	}
+
+	void Insert(const Vec &pos, T *thing)
 	{
 		mHashMap[Discretize(pos, mInvCellSize)].push_back(thing);
 	}
 
-	void Neighbors(const glm::vec3 &pos, NeighborList &ret) const
+	// NeighborList storage comes from the calling thread's scratch arena:
+	static NeighborList MakeNeighborList()
 	{
-		const glm::ivec3 ipos = Discretize(pos, mInvCellSize);
+		return NeighborList(ArenaAllocator<T *>(ThreadArena()));
+	}
+
+	void Neighbors(const Vec &pos, NeighborList &ret) const
+	{
+		const IVec ipos = Discretize(pos, mInvCellSize);
 		for (const auto &offset : mOffsets)
 		{
 			typename HashMap::const_iterator it = mHashMap.find(offset + ipos);
@@ -415,138 +661,85 @@ public:
 		}
 	}
 
+	// Empties the cells but keeps their storage, so that rebuilding the index
+	// every step does not free and re-allocate every bucket. Cells that stayed
+	// empty for a whole step are dropped to keep the map from growing forever.
 	void Clear()
 	{
-		mHashMap.clear();
+		for (typename HashMap::iterator it = mHashMap.begin(); it != mHashMap.end();)
+		{
+			if (it->second.empty())
+			{
+				it = mHashMap.erase(it);
+			}
+			else
+			{
+				it->second.clear();
+				++it;
+			}
+		}
 	}
 
 private:
-	// "Optimized Spatial Hashing for Collision Detection of Deformable Objects"
-	// Teschner, Heidelberger, et al.
-	// returns a hash between 0 and 2^32-1
-	struct TeschnerHash {
-		std::size_t operator()(const glm::ivec3& pos) const {
-			const unsigned int p1 = 73856093;
-			const unsigned int p2 = 19349663;
-			const unsigned int p3 = 83492791;
-			return static_cast<std::size_t>((pos.x * p1) ^ (pos.y * p2) ^ (pos.z * p3));
+	struct CellHash {
+		std::size_t operator()(const IVec& pos) const {
+			return Dimension<D>::Hash(pos);
 		}
 	};
 
 	// returns the indexes of the cell pos is in, assuming a cellSize grid
 	// invCellSize is the inverse of the desired cell size
-	static inline glm::ivec3 Discretize(const glm::vec3 &pos, const float invCellSize)
+	static inline IVec Discretize(const Vec &pos, const float invCellSize)
 	{
-		return glm::ivec3(glm::floor(pos * invCellSize));
+		return IVec(glm::floor(pos * invCellSize));
 	}
 
-	typedef std::unordered_map<glm::ivec3, NeighborList, TeschnerHash> HashMap;
+	typedef std::vector<T *> Bucket;
+	typedef std::unordered_map<IVec, Bucket, CellHash> HashMap;
 	HashMap mHashMap;
 
-	std::vector<glm::ivec3> mOffsets;
+	std::vector<IVec> mOffsets;
 
-	const float mInvCellSize;
+	float mInvCellSize;
 };
 
-typedef SpatialIndex<Particle> IndexType;
+typedef SpatialIndex<Particle, 3> IndexType;
 IndexType indexsp(4093, r*2);
 
 // --------------------------------------------------------------------
 void initParticles(const unsigned int pN)
 {
 	float layer_radius = i_girth * 0.2;  // Radius of the cylindrical layer
-    float maxHeight = 5.0;               // Maximum height of the cylinder
-    float minDistance = r * 0.5f;        // Minimum distance between particles
+	float maxHeight = 5.0;               // Maximum height of the cylinder
+	float minDistance = r * 0.5f;        // Minimum distance between particles
 
-    for (float y = bottom + 0.1; y <= maxHeight; y += minDistance)
-    {
-        // Start from the center and place particles in concentric rings
-        for (float radius = 0; radius <= layer_radius; radius += minDistance)
-        {
-            // Number of particles around this radius (circumference / min distance)
-            int numParticles = (radius == 0) ? 1 : static_cast<int>((2 * M_PI * radius) / minDistance);
-
-            for (int i = 0; i < numParticles; ++i)
-            {
-                if (particles.size() >= pN)  // Stop if we reach the desired number of particles
-                {
-                    return;
-                }
-
-                // Angle for this particle in the current ring
-                float angle = i * (2 * M_PI / numParticles);
-
-                // Convert polar coordinates (radius, angle) to Cartesian (x, z)
-                float x = radius * cos(angle);
-                float z = radius * sin(angle);
-
-                Particle p;
-				p.mass = mass;
-                p.pos = glm::vec3(x, y, z) + 0.01f * glm::vec3(rand01(), rand01(), rand01());
-                p.pos_old = p.pos + 0.001f * glm::vec3(rand01(), rand01(), rand01());
-                p.vel = glm::vec3(0, 0, 0);
-                p.force = glm::vec3(0, 0, 0);
-                p.sigma = 3.f;
-                p.beta = 4.f;
-				p.r_density = rest_density;
-                particles.push_back(p);
-            }
-        }
-    }
+	if (particles.size() >= pN)
+		return;
+	if (!emitters.empty())
+		EmitParticles(pN);
+	else
+		AddParticles(ParticleColumn(bottom + 0.1, maxHeight, layer_radius, minDistance), 0, pN - particles.size());
 }
 
 void addMoreParticles(const unsigned int nP)
 {
-	// Number of particles already in the system
-    unsigned int currentParticleCount = particles.size();
-
 	float layer_radius = i_girth * 0.2;  // Radius of the cylindrical layer
-    float maxHeight = 5.0;               // Maximum height of the cylinder
-    float minDistance = r * 0.5f;        // Minimum distance between particles
+	float maxHeight = 5.0;               // Maximum height of the cylinder
+	float minDistance = r * 0.5f;        // Minimum distance between particles
 
-	for (float y = bottom + 1.8; y <= maxHeight; y += minDistance)
-    {
-        // Start from the center and place particles in concentric rings
-        for (float radius = 0; radius <= layer_radius; radius += minDistance)
-        {
-            // Number of particles around this radius (circumference / min distance)
-            int numParticles = (radius == 0) ? 1 : static_cast<int>((2 * M_PI * radius) / minDistance);
-
-            for (int i = 0; i < numParticles; ++i)
-            {
-				// Only add new particles up to the specified pN
-                if (particles.size() >= currentParticleCount + nP)
-                {
-                    break;
-                }
-
-				// Angle for this particle in the current ring
-                float angle = i * (2 * M_PI / numParticles);
-
-                // Convert polar coordinates (radius, angle) to Cartesian (x, z)
-                float x = radius * cos(angle);
-                float z = radius * sin(angle);
-
-                Particle p;
-				p.mass = mass;
-                p.pos = glm::vec3(x, y, z) + 0.01f * glm::vec3(rand01(), rand01(), rand01());
-                p.pos_old = p.pos + 0.001f * glm::vec3(rand01(), rand01(), rand01());
-                p.vel = glm::vec3(0, 0, 0);
-                p.force = glm::vec3(0, 0, 0);
-                p.sigma = 3.f;
-                p.beta = 4.f;
-				p.r_density = rest_density;
-                particles.push_back(p);
-			}
-		}
-	}
+	AddParticles(ParticleColumn(bottom + 1.8, maxHeight, layer_radius, minDistance), 0, nP);
+
+	// the neighbor lists point into particles, which may have moved
+	for (auto &particle : particles)
+		particle.neighbors.clear();
 }
 
 // Define container properties
-const float container_height = 1.5f;    // Height of the container bottom
-const float container_top = container_height + 2.0f; // Top boundary of the container
-const float container_width = SIM_W / 2;     // Width of the container in the x and z directions
-const float opening_width = 0.2f;       // Width of the opening at the container's bottom
+float container_height = 1.5f;    // Height of the container bottom
+float container_top = container_height + 2.0f; // Top boundary of the container
+float container_width = SIM_W / 2;     // Width of the container in the x and z directions
+float opening_width = 0.2f;       // Width of the opening at the container's bottom
+int worldVersion = 0;			// bumped when the world, the container, r or the meshes change
 
 void enforceContainerBoundaries(Particle &p) {
     // Left and right walls in x-direction (container boundaries)
@@ -580,257 +773,583 @@ void enforceContainerBoundaries(Particle &p) {
 }
 
 
+#include "meshcollider.cpp"
+#include "sdfcollider.cpp"
+
 // --------------------------------------------------------------------
-// Update particle positions
-void step()
+// Clamp a position into the world, for the solvers that work on positions
+// (PBF, IISPH). This is the positional counterpart of the spring forces in
+// step( ) and enforceContainerBoundaries( ): which set of walls applies is
+// decided by where the particle started the step.
+static inline void ProjectContainerBoundaries(glm::vec3 &pos, const glm::vec3 &start)
 {
-	// Simulation step
+	// (with the SDF on, the meshes are baked into it)
+	if (useMeshColliders && !useColliders)
+		CollideWithMeshes(pos, start);
 
-	#pragma omp parallel for
-	for (auto &particle : particles)
+	if (!useGravity)
+		return;
+
+	if (useColliders)
+	{
+		CollideWithScene(pos);
+		return;
+	}
+
+	if (start.y >= container_height - 0.05)
 	{
-		// Apply the currently accumulated forces and update position
-        glm::vec3 acceleration = particle.force / particle.mass;
-        particle.pos += (acceleration * dT * dT);
+		pos.x = glm::clamp(pos.x, -container_width, container_width);
+		pos.z = glm::clamp(pos.z, -container_width, container_width);
 
-		// Restart the forces with gravity only. We'll add the rest later.
-		if (useGravity)
+		// Bottom boundary of the container, excluding the opening
+		if (pos.y < container_height &&
+			(!useOpening || (fabs(pos.x) > opening_width / 2 || fabs(pos.z) > opening_width / 2)))
 		{
-			particle.force = glm::vec3(0.f, -particle.mass * ::G, 0.f);
+			pos.y = container_height;
 		}
-		else
+
+		if (pos.y > container_top)
+			pos.y = container_top;
+	}
+	else
+	{
+		float bound = shrinkWorld ? SIM_W * 3.f : SIM_W;
+		pos.x = glm::clamp(pos.x, -bound, bound);
+		pos.z = glm::clamp(pos.z, -SIM_W, SIM_W);
+		if (pos.y < bottom)
+			pos.y = bottom;
+	}
+}
+
+// --------------------------------------------------------------------
+// The walls within the radius of support of pos, as inward unit normals and
+// distances, using the same regions as ProjectContainerBoundaries( ).
+// Returns how many were written (never more than 6).
+static inline int NearbyContainerWalls(const glm::vec3 &pos, const glm::vec3 &start, glm::vec3 normals[6], float dists[6])
+{
+	if (!useGravity)
+		return 0;
+
+	int count = 0;
+	auto wall = [&](const float dist, const glm::vec3 &normal)
+	{
+		if (dist < r)
 		{
-			particle.force = glm::vec3(0.f, 0.f, 0.f);
+			normals[count] = normal;
+			dists[count] = glm::max(dist, 0.f);
+			count++;
 		}
+	};
 
-		// Calculate the velocity for later.
-		particle.vel = (particle.pos - particle.pos_old) / dT;
+	if (start.y >= container_height - 0.05)
+	{
+		wall(pos.x + container_width, glm::vec3(1.f, 0.f, 0.f));
+		wall(container_width - pos.x, glm::vec3(-1.f, 0.f, 0.f));
+		wall(pos.z + container_width, glm::vec3(0.f, 0.f, 1.f));
+		wall(container_width - pos.z, glm::vec3(0.f, 0.f, -1.f));
+		if (!useOpening || (fabs(pos.x) > opening_width / 2 || fabs(pos.z) > opening_width / 2))
+			wall(pos.y - container_height, glm::vec3(0.f, 1.f, 0.f));
+		wall(container_top - pos.y, glm::vec3(0.f, -1.f, 0.f));
+	}
+	else
+	{
+		float bound = shrinkWorld ? SIM_W * 3.f : SIM_W;
+		wall(pos.x + bound, glm::vec3(1.f, 0.f, 0.f));
+		wall(bound - pos.x, glm::vec3(-1.f, 0.f, 0.f));
+		wall(pos.z + SIM_W, glm::vec3(0.f, 0.f, 1.f));
+		wall(SIM_W - pos.z, glm::vec3(0.f, 0.f, -1.f));
+		wall(pos.y - bottom, glm::vec3(0.f, 1.f, 0.f));
+	}
+	return count;
+}
+
+// --------------------------------------------------------------------
+// Rebuild the spatial index from the current particle positions.
+void RebuildIndex()
+{
+	indexsp.Clear();
+	for (auto &particle : particles)
+	{
+		indexsp.Insert(glm::vec3(particle.pos), &particle);
+	}
+}
 
-		// A small hack
-		const float max_vel = 2.0f;
-		const float vel_mag = glm::dot(particle.vel, particle.vel);
-		// If the velocity is greater than the max velocity, then cut it in half.
-		if (vel_mag > max_vel * max_vel)
+// --------------------------------------------------------------------
+// Fill particle.neighbors with every Particle inside the radius of support
+// and add up the weighted 'far' (d) and 'near' (dn) distances on the way.
+// Particles in extra (if any) are candidates as well as those in indexsp.
+void FindNeighbors(Particle &particle, float &d, float &dn, const IndexType *extra = NULL)
+{
+	particle.neighbors.clear();
+
+	// The candidate list lives in this thread's arena and is popped
+	// again when the particle is done.
+	ScratchArena::Scope scratch(ThreadArena());
+	IndexType::NeighborList neigh = IndexType::MakeNeighborList();
+	neigh.reserve(64);		// 64 original
+	indexsp.Neighbors(glm::vec3(particle.pos), neigh);
+	if (extra != NULL)
+		extra->Neighbors(glm::vec3(particle.pos), neigh);
+	for (int j = 0; j < (int)neigh.size(); ++j)
+	{
+		if (neigh[j] == &particle)
 		{
-			particle.vel /= max_vel;
+			// do not calculate an interaction for a Particle with itself!
+			continue;
 		}
 
-		// Normal verlet stuff
-		particle.pos_old = particle.pos;
-		particle.pos += particle.vel * dT;
+		// The vector seperating the two particles
+		const glm::vec3 rij = neigh[j]->pos - particle.pos;
+
+		// Along with the squared distance between
+		const float rij_len2 = glm::dot(rij, rij);
 
-		// If the Particle is outside the bounds of the world, then
-		// Make a little spring force to push it back in.
-		if (useGravity)
+		// If they're within the radius of support ...
+		if (rij_len2 < rsq)
 		{
-			if (particle.pos.y >= container_height - 0.05)
-				enforceContainerBoundaries(particle);
-			else{
-				float bound = shrinkWorld ? SIM_W * 3.f : SIM_W;
-
-				// // Calculate the distance of the particle from the circle center in the xz-plane
-				// float dx = particle.pos.x - 0.f; // center_x = 0
-				// float dz = particle.pos.z - 0.f; // center_z = 0
-				// float distance_from_center = sqrt(dx * dx + dz * dz);
-
-				// // If the particle is outside the circular boundary
-				// if (distance_from_center > bound) {
-				// 	// Calculate the push-back force
-				// 	float excess_distance = distance_from_center - bound;
-
-				// 	// Normalize the direction vector (dx, dz)
-				// 	float nx = dx / distance_from_center;
-				// 	float nz = dz / distance_from_center;
-
-				// 	// Apply force to push the particle back within the circle
-				// 	particle.force.x -= nx * excess_distance / 8;
-				// 	particle.force.z -= nz * excess_distance / 8;
-				// }
-
-				if (particle.pos.x < -bound)
-					particle.force.x -= (particle.pos.x + bound) / 8.;
-				if (particle.pos.x > bound)
-					particle.force.x -= (particle.pos.x - bound) / 8.;
-
-				if (particle.pos.z < -SIM_W)
-					particle.force.z -= (particle.pos.z + SIM_W) / 8.;
-				if (particle.pos.z > SIM_W)
-					particle.force.z -= (particle.pos.z - SIM_W) / 8.;
-
-				// Limit particles in y-axis (for bottom boundary)
-				if (particle.pos.y < bottom) {
-					particle.force.y -= particle.pos.y / 8.;
-				}
-			}
+			// Get the actual distance and the weighted distance values
+			// (from the kernel table if that is on)
+			float rij_len;
+			const float q = KernelQ(rij_len2, rij_len);
+			const float q2 = q * q;
+			const float q3 = q2 * q;
+
+			d += q2;
+			dn += q3;
+
+			// Set up the Neighbor list for faster access later.
+			Neighbor n;
+			n.j = neigh[j];
+			n.q = q;
+			n.q2 = q2;
+#ifdef CACHE_PAIR_GEOMETRY
+			// (two particles pinned into the same wall corner have no direction)
+			n.dir = rij_len > 0.f ? rij * (1.f / rij_len) : glm::vec3(0.f);
+#endif
+			particle.neighbors.push_back(n);
 		}
+	}
+}
 
-		if (externalForce)
+// Weigh the wall samples [samples, samples + count) (see boundary.cpp and
+// rigidbody.cpp) by how much of a fluid particle each stands in for, from
+// the samples of index around it:
+//		psi_b = rest_density * volume / sum_k q_bk^2
+void WeighWallSamples(Particle *samples, const int count, const IndexType &index)
+{
+	const float volume = Dimension<3>::KernelVolume();
+	#pragma omp parallel for
+	for (int i = 0; i < count; i++)
+	{
+		Particle &b = samples[i];
+		float d = 0;
+		ScratchArena::Scope scratch(ThreadArena());
+		IndexType::NeighborList neigh = IndexType::MakeNeighborList();
+		index.Neighbors(b.pos, neigh);
+		for (int j = 0; j < (int)neigh.size(); j++)
 		{
-			particle.force += glm::vec3(.002f * 0.025, 0.f, 0.f);
+			const glm::vec3 rij = neigh[j]->pos - b.pos;
+			const float len2 = glm::dot(rij, rij);
+			if (len2 < rsq)
+			{
+				const float q = 1.f - sqrtf(len2) / r;
+				d += q * q;
+			}
 		}
+		b.mass = rest_density * volume / d;
+	}
+}
 
-		// Reset the nessecary items.
-		// particle.rho = 0;
-		// particle.rho_near = 0;
-		particle.neighbors.clear();
+// --------------------------------------------------------------------
+// Per-pair pieces shared by the separate and the fused force passes.
+
+// The direction from Particle i to Particle j
+static inline glm::vec3 PairDirection(const Particle &particle, const Neighbor &n)
+{
+#ifdef CACHE_PAIR_GEOMETRY
+	return n.dir;
+#else
+	const glm::vec3 rij = (*n.j).pos - particle.pos;
+	const float len = glm::length(rij);
+	return len > 0.f ? rij * (1.f / len) : glm::vec3(0.f);
+#endif
+}
+
+// calculate the force from the pressures calculated in step( )
+static inline float PressureWeight(const Particle &particle, const Neighbor &n)
+{
+	return n.q * (particle.press + (*n.j).press) + n.q2 * (particle.press_near + (*n.j).press_near);
+}
+
+// The velocity change viscosity applies to Particle i for one neighbor over
+// a step of h (with the velocity of j from velocities, if given, see
+// SnapshotVelocities( ))
+static inline glm::vec3 ViscosityImpulse(const Particle &particle, const Neighbor &n, const glm::vec3 &rijn,
+	const glm::vec3 *velocities = NULL, const float h = dT)
+{
+	const glm::vec3 &velJ = velocities != NULL ? velocities[n.j - &particles[0]] : (*n.j).vel;
+
+	// Get the projection of the velocities onto the vector between them.
+	const float u = glm::dot(particle.vel - velJ, rijn);
+	if (u > 0)
+	{
+		// Calculate the viscosity impulse between the two particles
+		// based on the quadratic function of projected length.
+		// ((1 - |rij| / r) is exactly the n.q of the density pass)
+		const glm::vec3 I = n.q * ((*n.j).sigma * u + (*n.j).beta * u * u) * rijn;
+
+		// Apply the impulses on the current particle
+		return I * 0.5f * h;
 	}
+	return glm::vec3(0.f);
+}
 
-	// update spatial index
-	indexsp.Clear();
+// We'll let the color be determined by
+// ... xz-velocity for the red component
+// ... y-velocity for the green-component
+// ... pressure for the blue component
+static inline void SetParticleColor(Particle &particle)
+{
+	switch (whichVisualization)
+	{
+		case 0:
+			particle.r = 0.3f + (80000.f * fabs(glm::dot(particle.vel.x, particle.vel.z)) );
+			particle.g = 0.3f + (60.f * fabs(particle.vel.y) );
+			particle.b = 0.3f + (.6f * particle.rho );
+			break;
+
+		case 1:
+			particle.r = 0.3f + (80000.f * fabs(glm::dot(4.f * glm::dot(particle.vel.x, particle.vel.z), particle.vel.y * 100.f)));
+			particle.g = 0.3f + (.4f * fabs(particle.mass));
+			particle.b = 0.3f + (10000.f * fabs(particle.press));
+			break;
+
+		case 2:
+			particle.r = 0.3f + (80000.f * fabs(glm::dot(4.f * glm::dot(particle.vel.x, particle.vel.z), particle.vel.y * 100.f)));
+			particle.g = particle.r;
+			particle.b = 0.3f + (10000.f * fabs(particle.press));
+			break;
+		
+		default:
+			break;
+	}
+}
+
+// --------------------------------------------------------------------
+// The first half of a double density relaxation step for one Particle:
+// finish the last step with the forces found in it, then predict the new
+// position with a step of dt and restart the forces.
+static inline void AdvanceParticle(Particle &particle, const float dt)
+{
+	// The position already holds the prediction pos_old + vel * h of the
+	// last step, the forces found along with it finish that step.
+	const float h = particle.dt;
+
+	// Apply the currently accumulated forces and update position
+	glm::vec3 acceleration = particle.force / particle.mass;
+	particle.pos += (acceleration * h * h);
+
+	// Restart the forces with gravity only. We'll add the rest later.
+	if (useGravity)
+	{
+		particle.force = glm::vec3(0.f, -particle.mass * ::G, 0.f);
+	}
+	else
+	{
+		particle.force = glm::vec3(0.f, 0.f, 0.f);
+	}
+
+	// Calculate the velocity for later.
+	particle.vel = (particle.pos - particle.pos_old) / h;
+
+	// A small hack
+	const float max_vel = 2.0f;
+	const float vel_mag = glm::dot(particle.vel, particle.vel);
+	// If the velocity is greater than the max velocity, then cut it in half.
+	if (vel_mag > max_vel * max_vel)
+	{
+		particle.vel /= max_vel;
+	}
+
+	// Normal verlet stuff
+	particle.pos_old = particle.pos;
+	particle.pos += particle.vel * dt;
+	particle.dt = dt;
+
+	// If the Particle is outside the bounds of the world, then
+	// Make a little spring force to push it back in.
+	// (the SDF colliders take care of that in a pass of their own)
+	if (useGravity && !useColliders)
+	{
+		if (particle.pos.y >= container_height - 0.05)
+			enforceContainerBoundaries(particle);
+		else{
+			float bound = shrinkWorld ? SIM_W * 3.f : SIM_W;
+
+			// // Calculate the distance of the particle from the circle center in the xz-plane
+			// float dx = particle.pos.x - 0.f; // center_x = 0
+			// float dz = particle.pos.z - 0.f; // center_z = 0
+			// float distance_from_center = sqrt(dx * dx + dz * dz);
+
+			// // If the particle is outside the circular boundary
+			// if (distance_from_center > bound) {
+			// 	// Calculate the push-back force
+			// 	float excess_distance = distance_from_center - bound;
+
+			// 	// Normalize the direction vector (dx, dz)
+			// 	float nx = dx / distance_from_center;
+			// 	float nz = dz / distance_from_center;
+
+			// 	// Apply force to push the particle back within the circle
+			// 	particle.force.x -= nx * excess_distance / 8;
+			// 	particle.force.z -= nz * excess_distance / 8;
+			// }
+
+			if (particle.pos.x < -bound)
+				particle.force.x -= (particle.pos.x + bound) / 8.;
+			if (particle.pos.x > bound)
+				particle.force.x -= (particle.pos.x - bound) / 8.;
+
+			if (particle.pos.z < -SIM_W)
+				particle.force.z -= (particle.pos.z + SIM_W) / 8.;
+			if (particle.pos.z > SIM_W)
+				particle.force.z -= (particle.pos.z - SIM_W) / 8.;
+
+			// Limit particles in y-axis (for bottom boundary)
+			if (particle.pos.y < bottom) {
+				particle.force.y -= particle.pos.y / 8.;
+			}
+		}
+	}
+
+	if (externalForce)
+	{
+		particle.force += glm::vec3(.002f * 0.025, 0.f, 0.f);
+	}
+
+	// Reset the nessecary items.
+	// particle.rho = 0;
+	// particle.rho_near = 0;
+	particle.neighbors.clear();
+}
+
+#include "diagnostics.cpp"
+#include "pbfsolver.cpp"
+#include "iisphsolver.cpp"
+#include "rigidbody.cpp"
+#include "boundary.cpp"
+#include "localdt.cpp"
+#include "sleeping.cpp"
+#include "dimsolver.cpp"
+#include "outputstream.cpp"
+#include "checkpoint.cpp"
+#include "settledcache.cpp"
+#include "trajectory.cpp"
+#include "watchdog.cpp"
+#include "playback.cpp"
+#include "exporter.cpp"
+#include "scene.cpp"
+
+// --------------------------------------------------------------------
+// Update particle positions
+void step()
+{
+	// Simulation step
+
+	// Everything allocated from the scratch arenas last step is dead by now.
+	ResetScratchArenas();
+
+	// stepMetrics is published when this returns
+	StepMetricsScope metricsScope;
+
+	// only the plain double density step knows about sleepers
+	const bool sleeping = useSleeping && whichSolver == DOUBLE_DENSITY && !useLocalDT;
+	if (sleeping)
+	{
+		CheckSleepersWorld();
+		WakeMarkedSleepers();
+	}
+	else if (numSleeping > 0)
+		WakeAllParticles();
+
+	if (useColliders)
+		UpdateColliders();
+
+	if (whichSolver == POSITION_BASED)
+	{
+		stepPBF();
+		return;
+	}
+
+	if (whichSolver == IMPLICIT_INCOMPRESSIBLE)
+	{
+		stepIISPH();
+		return;
+	}
+
+	if (useBoundaryParticles)
+		UpdateBoundaryParticles();
+
+	if (useRigidBodies)
+		AdvanceRigidBodies(dT);
+
+	if (useLocalDT)
+	{
+		stepLocal();
+		if (useRigidBodies)
+			GatherBodyForces(&fineIndex);
+		return;
+	}
+
+	#pragma omp parallel for
 	for (auto &particle : particles)
 	{
-		indexsp.Insert(glm::vec3(particle.pos), &particle);
+		if (particle.asleep)
+			continue;
+		AdvanceParticle(particle, dT);
 	}
 
+	if (useColliders)
+		ResolveColliders();
+	else if (useMeshColliders)
+		CollideParticlesWithMeshes();
+
+	if (useRigidBodies)
+		CollideParticlesWithBodies();
+
+	// update spatial index
+	if (sleeping)
+		RebuildAwakeIndex();
+	else
+		RebuildIndex();
+
 	// DENSITY
 	// Calculate the density by basically making a weighted sum
 	// of the distances of neighboring particles within the radius of support (r)
-	#pragma omp parallel for
+	#pragma omp parallel for reduction(metrics:stepSums)
 	for (auto &particle : particles)
 	{
+		// sleepers keep the density they fell asleep with
+		if (particle.asleep)
+			continue;
+
 		particle.rho = 0;
 		particle.rho_near = 0;
 
 		// We will sum up the 'near' and 'far' densities.
 		float d = 0;
 		float dn = 0;
-
-		IndexType::NeighborList neigh;
-		neigh.reserve(64);		// 64 original
-		indexsp.Neighbors(glm::vec3(particle.pos), neigh);
-		for (int j = 0; j < (int)neigh.size(); ++j)
-		{
-			if (neigh[j] == &particle)
-			{
-				// do not calculate an interaction for a Particle with itself!
-				continue;
-			}
-
-			// The vector seperating the two particles
-			const glm::vec3 rij = neigh[j]->pos - particle.pos;
-
-			// Along with the squared distance between
-			const float rij_len2 = glm::dot(rij, rij);
-
-			// If they're within the radius of support ...
-			if (rij_len2 < rsq)
-			{
-				// Get the actual distance from the squared distance.
-				float rij_len = sqrt(rij_len2);
-
-				// And calculated the weighted distance values
-				const float q = 1 - (rij_len / r);
-				const float q2 = q * q;
-				const float q3 = q2 * q;
-
-				d += q2;
-				dn += q3;
-
-				// Set up the Neighbor list for faster access later.
-				Neighbor n;
-				n.j = neigh[j];
-				n.q = q;
-				n.q2 = q2;
-				particle.neighbors.push_back(n);
-			}
-		}
+		FindNeighbors(particle, d, dn, sleeping ? &sleepIndex : NULL);
+		if (UseWallSamples())
+			FindWallNeighbors(particle, d, dn);
 
 		// Adjust density to use mass and volume approximation
-		float volume = (4.0f / 3.0f) * glm::pi<float>() * glm::pow(r*8., 3); // Volume of a sphere with radius r
+		float volume = Dimension<3>::KernelVolume(); // Volume of a sphere with radius 8 r
 		particle.rho += (d * particle.mass) / volume;
 		particle.rho_near += (dn * particle.mass) / volume;
+
+		if (useDiagnostics)
+			stepSums.AddDensity(particle.rho, particle.r_density, (int)particle.neighbors.size());
 	}
 
+	if (sleeping)
+		WakeTouchedSleepers();
+
 	// PRESSURE
 	// Make the simple pressure calculation from the equation of state.
 	#pragma omp parallel for
 	for (auto &particle : particles)
 	{
+		if (particle.asleep)
+			continue;
 		particle.press = k * (particle.rho - particle.r_density);
 		particle.press_near = k_near * particle.rho_near;
 	}
 
-	// PRESSURE FORCE
-	// We will force particles in or out from their neighbors
-	// based on their difference from the rest density.
-	#pragma omp parallel for
-	for (auto &particle : particles)
+	if (useRigidBodies)
+		GatherBodyForces(sleeping ? &sleepIndex : NULL);
+
+	if (useFusedPass)
 	{
-		// For each of the neighbors
-		glm::vec3 dX(0);
-		for (const Neighbor &n : particle.neighbors)
+		// PRESSURE FORCE + VISCOSITY
+		// One traversal of each neighbor list does the work of the two
+		// separate passes below, so every n.j is only fetched once.
+		const glm::vec3 *velocities = SnapshotVelocities();
+		#pragma omp parallel for reduction(metrics:stepSums)
+		for (auto &particle : particles)
 		{
-			// The vector from Particle i to Particle j
-			const glm::vec3 rij = (*n.j).pos - particle.pos;
-
-			// calculate the force from the pressures calculated above
-			const float dm = n.q * (particle.press + (*n.j).press) + n.q2 * (particle.press_near + (*n.j).press_near);
+			if (particle.asleep)
+				continue;
+			SetParticleColor(particle);
 
-			// Get the direction of the force
-			const glm::vec3 D = glm::normalize(rij) * dm;
-			dX += D;
-		}
+			glm::vec3 dX(0);
+			for (const Neighbor &n : particle.neighbors)
+			{
+				const glm::vec3 rijn = PairDirection(particle, n);
+				dX += rijn * PressureWeight(particle, n);
+				particle.vel -= ViscosityImpulse(particle, n, rijn, velocities);
+			}
+			if (UseWallSamples())
+				dX += WallPressureDisplacement(particle);
 
-		#pragma omp critical
-		{
+			// only this thread ever touches this particle's force
 			particle.force -= dX;
-		}		
-	}
 
-	// Viscosity
-	#pragma omp parallel for
-	for (auto &particle : particles)
+			if (useDiagnostics)
+				stepSums.AddMotion(particle.mass, glm::dot(particle.vel, particle.vel));
+		}
+	}
+	else
 	{
-		// We'll let the color be determined by
-		// ... xz-velocity for the red component
-		// ... y-velocity for the green-component
-		// ... pressure for the blue component
-		switch (whichVisualization)
+		// PRESSURE FORCE
+		// We will force particles in or out from their neighbors
+		// based on their difference from the rest density.
+		#pragma omp parallel for
+		for (auto &particle : particles)
 		{
-			case 0:
-				particle.r = 0.3f + (80000.f * fabs(glm::dot(particle.vel.x, particle.vel.z)) );
-				particle.g = 0.3f + (60.f * fabs(particle.vel.y) );
-				particle.b = 0.3f + (.6f * particle.rho );
-				break;
-
-			case 1:
-				particle.r = 0.3f + (80000.f * fabs(glm::dot(4.f * glm::dot(particle.vel.x, particle.vel.z), particle.vel.y * 100.f)));
-				particle.g = 0.3f + (.4f * fabs(particle.mass));
-				particle.b = 0.3f + (10000.f * fabs(particle.press));
-				break;
-
-			case 2:
-				particle.r = 0.3f + (80000.f * fabs(glm::dot(4.f * glm::dot(particle.vel.x, particle.vel.z), particle.vel.y * 100.f)));
-				particle.g = particle.r;
-				particle.b = 0.3f + (10000.f * fabs(particle.press));
-				break;
-			
-			default:
-				break;
+			if (particle.asleep)
+				continue;
+
+			// For each of the neighbors
+			glm::vec3 dX(0);
+			for (const Neighbor &n : particle.neighbors)
+			{
+				// Get the direction of the force
+				const glm::vec3 D = PairDirection(particle, n) * PressureWeight(particle, n);
+				dX += D;
+			}
+			if (UseWallSamples())
+				dX += WallPressureDisplacement(particle);
+
+			#pragma omp critical
+			{
+				particle.force -= dX;
+			}		
 		}
 
-		// For each of that particles neighbors
-		for (const Neighbor &n : particle.neighbors)
+		// Viscosity
+		const glm::vec3 *velocities = SnapshotVelocities();
+		#pragma omp parallel for reduction(metrics:stepSums)
+		for (auto &particle : particles)
 		{
-			const glm::vec3 rij = (*n.j).pos - particle.pos;
-			const float l = glm::length(rij);
-			const float q = l / r;
-
-			const glm::vec3 rijn = (rij / l);
-			// Get the projection of the velocities onto the vector between them.
-			const float u = glm::dot(particle.vel - (*n.j).vel, rijn);
-			if (u > 0)
-			{
-				// Calculate the viscosity impulse between the two particles
-				// based on the quadratic function of projected length.
-				const glm::vec3 I = (1 - q) * ((*n.j).sigma * u + (*n.j).beta * u * u) * rijn;
+			if (particle.asleep)
+				continue;
+			SetParticleColor(particle);
 
-				// Apply the impulses on the current particle
-				particle.vel -= I * 0.5f * dT;
+			// For each of that particles neighbors
+			for (const Neighbor &n : particle.neighbors)
+			{
+				particle.vel -= ViscosityImpulse(particle, n, PairDirection(particle, n), velocities);
 			}
+
+			if (useDiagnostics)
+				stepSums.AddMotion(particle.mass, glm::dot(particle.vel, particle.vel));
 		}
 	}
 
+	if (sleeping)
+		UpdateSleepState();
+
 	// #pragma omp parallel for
     // for (auto &particle : particles)
     // {
@@ -838,6 +1357,75 @@ void step()
     // }
 }
 
+// --------------------------------------------------------------------
+// The largest step the particles allow right now: nobody may travel more
+// than cflNumber * r, and the accelerations are held to the same distance.
+float ChooseTimeStep()
+{
+	float maxVel2 = 0.f;
+	float maxAcc2 = 0.f;
+	const int n = (int)particles.size();
+
+	#pragma omp parallel for reduction(max:maxVel2,maxAcc2)
+	for (int i = 0; i < n; i++)
+	{
+		const Particle &particle = particles[i];
+		const glm::vec3 acc = particle.force / particle.mass;
+		maxVel2 = glm::max(maxVel2, glm::dot(particle.vel, particle.vel));
+		maxAcc2 = glm::max(maxAcc2, glm::dot(acc, acc));
+	}
+
+	float dt = maxDT;
+	if (maxVel2 > 0.f)
+		dt = glm::min(dt, cflNumber * r / sqrtf(maxVel2));
+	if (maxAcc2 > 0.f)
+		dt = glm::min(dt, forceNumber * sqrtf(r / sqrtf(maxAcc2)));
+	return glm::clamp(dt, minDT, maxDT);
+}
+
+// --------------------------------------------------------------------
+// Advance the simulation by one rendered frame. With a fixed step that is
+// a single step( ) of dT; with useAdaptiveDT on, the double density solver
+// takes as many substeps as it needs to cover frameDT. With use2D on, the
+// frame is one step of the 2D slice instead.
+void AdvanceFrame()
+{
+	UpdateKernelTable();
+
+	if (use2D)
+	{
+		slice2D.Step(dT);
+		substepsUsed = 1;
+		return;
+	}
+
+	if (!useAdaptiveDT || whichSolver != DOUBLE_DENSITY)
+	{
+		step();
+		substepsUsed = 1;
+		return;
+	}
+
+	// dT is what the spinner shows, only borrow it for the substeps
+	const float fixedDT = dT;
+	float remaining = frameDT;
+	int substeps = 0;
+	while (remaining > 1.e-6f && substeps < maxSubsteps)
+	{
+		// spread what is left of the frame evenly over the steps it needs,
+		// so there is no sliver of a step at the end
+		const float limit = ChooseTimeStep();
+		const int needed = (int)ceilf(remaining / limit);
+		dT = remaining / (float)needed;
+
+		step();
+		remaining -= dT;
+		substeps++;
+	}
+	dT = fixedDT;
+	substepsUsed = substeps;
+}
+
 // main program:
 
 int main(int argc, char *argv[])
@@ -857,6 +1445,7 @@ int main(int argc, char *argv[])
 	// fprintf( stderr, "Number of cores present in the system: %d\n", numprocs );
 
 	omp_set_num_threads( numprocs );
+	ResizeScratchArenas();
 
 	glutInit(&argc, argv);
 
@@ -878,9 +1467,97 @@ int main(int argc, char *argv[])
 	InitGluiMain();
 	InitGluiFluid();
 
+	// -deterministic [seed] makes every run the same (see deterministic.cpp),
+	// from the jitter of the first particles on, -settled starts from a
+	// settled pool (see settledcache.cpp), -scene file.json takes the
+	// parameters from a scene file and watches it (see scene.cpp),
+	// -watchdog rolls blow-ups back (see watchdog.cpp):
+	for (int i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "-deterministic") == 0)
+		{
+			useDeterministic = true;
+			if (i + 1 < argc && isdigit(argv[i + 1][0]))
+				deterministicSeed = (unsigned int)strtoul(argv[++i], NULL, 10);
+			particles.clear();
+		}
+		else if (strcmp(argv[i], "-settled") == 0)
+			useSettledStart = true;
+		else if (strcmp(argv[i], "-scene") == 0 && i + 1 < argc)
+			OpenScene(argv[++i]);
+		else if (strcmp(argv[i], "-watchdog") == 0)
+			useWatchdog = true;
+	}
+
 	// Initialize initial number of particles
 	initParticles(N);
 
+	// any obj files on the command line are mesh colliders,
+	// the ones after -hull are rigid body shapes,
+	// -restart file.ckpt starts from a checkpoint,
+	// -record file.sphtraj records the trajectory,
+	// -play file.sphtraj shows a recorded one,
+	// -export vtk|vtp|ply|bgeo exports every frame:
+	bool restarted = false;
+	for (int i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "-restart") == 0 && i + 1 < argc)
+		{
+			i++;
+			checkpointFile = argv[i];
+			restarted = LoadCheckpoint(checkpointFile);
+			continue;
+		}
+
+		if (strcmp(argv[i], "-record") == 0 && i + 1 < argc)
+		{
+			i++;
+			trajectoryFile = argv[i];
+			recordTrajectory = true;
+			continue;
+		}
+
+		if (strcmp(argv[i], "-export") == 0 && i + 1 < argc)
+		{
+			i++;
+			static const char *formats[] = {"vtk", "vtp", "ply", "bgeo"};
+			for (int f = 0; f <= EXPORT_BGEO; f++)
+				if (strcmp(argv[i], formats[f]) == 0)
+					exportFormat = f;
+			exportFrames = true;
+			continue;
+		}
+
+		if (strcmp(argv[i], "-play") == 0 && i + 1 < argc)
+		{
+			i++;
+			playbackFile = argv[i];
+			usePlayback = true;
+			continue;
+		}
+
+		if (strcmp(argv[i], "-hull") == 0 && i + 1 < argc)
+		{
+			i++;
+			if (LoadRigidHull(argv[i], 1.f) == NULL)
+				fprintf(stderr, "Cannot use '%s' as a rigid body\n", argv[i]);
+			continue;
+		}
+
+		const size_t len = strlen(argv[i]);
+		if (len > 4 && strcmp(argv[i] + len - 4, ".obj") == 0)
+		{
+			if (LoadMeshCollider(argv[i], glm::vec3(0.f), 1.f) == NULL)
+				fprintf(stderr, "Cannot use '%s' as a mesh collider\n", argv[i]);
+			else
+				useMeshColliders = true;
+		}
+	}
+
+	// the pool settles around the mesh colliders, so not before they are in
+	if (useSettledStart && !restarted)
+		StartSettled();
+
 	// setup all the user interface stuff:
 
 	InitMenus();
@@ -1028,34 +1705,64 @@ void Display()
 
 	glEnable(GL_NORMALIZE);
 
-	if (usePoints) {
+	// a scene file that has been saved again is applied here, between steps
+	UpdateScene();
+
+	// with playback on, a recorded frame is drawn in place of the particles
+	// (see playback.cpp)
+	const PlaybackFrame *playback = AdvancePlayback();
+	const size_t numDrawn = playback != NULL ? playback->pos.size() : particles.size();
+
+	if (use2D && playback == NULL)
+	{
+		// the slice, in the z = 0 plane
+		glPointSize(p_size);
+		glBegin(GL_POINTS);
+		for (int i = 0; i < slice2D.Size(); i++)
+		{
+			const float blue = useColorVisual ? 0.3f + .6f * slice2D.Get(i).rho : 1.f;
+			glColor3f(.2f, .9f, blue);
+			glVertex3fv(glm::value_ptr(slice2D.Position(i)));
+		}
+		glEnd();
+	}
+
+	else if (usePoints) {
 		glPointSize(p_size);
 
 		// Enable vertex arrays for positions
-		glVertexPointer(3, GL_FLOAT, sizeof(Particle), &particles[0].pos);
+		if (playback != NULL)
+			glVertexPointer(3, GL_FLOAT, sizeof(glm::vec3), playback->pos.data());
+		else
+			glVertexPointer(3, GL_FLOAT, sizeof(Particle), &particles[0].pos);
 		glEnableClientState(GL_VERTEX_ARRAY);
 
 		// Prepare and enable color arrays for particles
-		std::vector<float> particleColors;
-		particleColors.reserve(particles.size() * 3);  // r, g, b for each particle
+		// (the array only has to live until glDrawArrays( ) below)
+		ScratchArena::Scope scratch(ThreadArena());
+		std::vector<float, ArenaAllocator<float> > particleColors((ArenaAllocator<float>(ThreadArena())));
+		if (playback == NULL)
+		{
+			particleColors.reserve(particles.size() * 3);  // r, g, b for each particle
 
-		for (const auto& particle : particles) {
-			particleColors.push_back(particle.r); // red component
-			particleColors.push_back(particle.g); // green component
-			particleColors.push_back(particle.b); // blue component
+			for (const auto& particle : particles) {
+				particleColors.push_back(particle.r); // red component
+				particleColors.push_back(particle.g); // green component
+				particleColors.push_back(particle.b); // blue component
+			}
 		}
 
 		glColor3f(.5, .6, .9);
 
 		// Use the color array
-		glColorPointer(3, GL_FLOAT, 0, particleColors.data());
+		glColorPointer(3, GL_FLOAT, 0, playback != NULL ? playback->colors.data() : particleColors.data());
 		if (useColorVisual)
 		{
 			glEnableClientState(GL_COLOR_ARRAY);
 		}
 
 		// Draw particles
-		glDrawArrays(GL_POINTS, 0, static_cast<GLsizei>(particles.size()));
+		glDrawArrays(GL_POINTS, 0, static_cast<GLsizei>(numDrawn));
 
 		// Disable arrays after drawing
 		glDisableClientState(GL_VERTEX_ARRAY);
@@ -1072,11 +1779,15 @@ void Display()
 		}
 
 		// Iterate through your particles and draw spheres at their positions
-		for (const auto &particle : particles)
+		for (size_t i = 0; i < numDrawn; i++)
 		{
+			const glm::vec3 &pos = playback != NULL ? playback->pos[i] : particles[i].pos;
+			const float r = playback != NULL ? playback->colors[3 * i + 0] : particles[i].r;
+			const float g = playback != NULL ? playback->colors[3 * i + 1] : particles[i].g;
+			const float b = playback != NULL ? playback->colors[3 * i + 2] : particles[i].b;
 			if (useColorVisual)
 			{
-				glColor3f(particle.r, particle.g, particle.b);
+				glColor3f(r, g, b);
 			}
 			else
 			{
@@ -1084,10 +1795,10 @@ void Display()
 			}
 			if (useLighting)
 			{
-				SetMaterial(particle.r, particle.g, particle.b, 5.);
+				SetMaterial(r, g, b, 5.);
 			}
 			glPushMatrix();
-			glTranslatef(particle.pos.x, particle.pos.y, particle.pos.z); // Translate to the position of the particle
+			glTranslatef(pos.x, pos.y, pos.z); // Translate to the position of the particle
 			glCallList(ParticleList);									  // Draw low-poly sphere at the position
 			glPopMatrix();
 		}
@@ -1102,12 +1813,32 @@ void Display()
 		else
 			glCallList(GridDL1);
 	}
+
+	if (useMeshColliders)
+	{
+		glColor3f(.6, .6, .6);
+		for (const MeshCollider *collider : meshColliders)
+			glCallList(collider->list);
+	}
+
+	if (useRigidBodies)
+	{
+		glColor3f(.9, .6, .3);
+		if (useLighting)
+			SetMaterial(.9, .6, .3, 5.);
+		DrawRigidBodies();
+	}
 	
 	time1 = omp_get_wtime( );	// current clock time in seconds
 	
-	if (doSimulation){
+	if (doSimulation && !usePlayback){
 		
-		step();
+		WatchdogBeforeFrame();
+		AdvanceFrame();
+		WatchdogAfterFrame();
+		RecordTrajectoryFrame();
+		ExportParticleFrame();
+		ShowStepMetrics();
 		
 		// displayCnt++;
 		if (displayCnt < 50)
@@ -1124,6 +1855,24 @@ void Display()
 			float avg = timeSum / 50.;
 			timeSum = 0;
 			avg_frameRate = 1000000. / avg;
+
+			if (DebugOn != 0)
+			{
+				ScratchArena::Stats scratch = ScratchArenaTotals();
+				fprintf(stderr, "Scratch arenas: %lu allocations, %lu bytes last step, %lu bytes peak, %lu heap blocks\n",
+					(unsigned long)scratch.allocations, (unsigned long)scratch.bytes,
+					(unsigned long)scratch.peakBytes, (unsigned long)scratch.blockAllocations);
+				if (useSleeping)
+					fprintf(stderr, "Sleeping: %d of %lu particles\n", numSleeping, (unsigned long)particles.size());
+				if (useLocalDT)
+					fprintf(stderr, "Local dT: %d particle steps for %lu particles\n",
+						localParticleSteps, (unsigned long)particles.size());
+				if (useDiagnostics)
+					fprintf(stderr, "Step %d: kinetic energy %g, max speed %g, density error %g mean %g max, %.1f neighbors (%d to %d), %d NaN\n",
+						stepMetrics.step, stepMetrics.kineticEnergy, stepMetrics.maxSpeed, stepMetrics.meanDensityError,
+						stepMetrics.maxDensityError, stepMetrics.meanNeighbors, stepMetrics.minNeighbors,
+						stepMetrics.maxNeighbors, stepMetrics.nonFinite);
+			}
 			// printf("Particles: %lu \t Computation time: %.2f\n", particles.size(), timeSum / 50.);
 		}
 	}
@@ -1171,9 +1920,13 @@ void Display()
 	glLoadIdentity();
 	glColor3f(1.f, 1.f, 1.f);
 	// string to be displayed on screen
-	std::string textToDisplay1 = std::to_string(particles.size()) + " Particles";
+	std::string textToDisplay1 = std::to_string(numDrawn) + " Particles";
+	if (playback != NULL)
+		textToDisplay1 += ", frame " + std::to_string(playback->frame) + " of " + std::to_string(trajectoryPlayer.NumFrames());
 	std::string textToDisplay2 = "Rest density: " + std::to_string((int)rest_density);
 	std::string textToDisplay3 = "Frame Rate: " + std::to_string((int)avg_frameRate);
+	if (useAdaptiveDT)
+		textToDisplay3 += " (" + std::to_string(substepsUsed) + " substeps)";
 	char *textCharArray1 = &textToDisplay1[0u];
 	char *textCharArray2 = &textToDisplay2[0u];
 	char *textCharArray3 = &textToDisplay3[0u];
@@ -1497,6 +2250,23 @@ void InitLists()
 		OsuSphere(0.03, 8, 8);
 	glEndList();
 
+	InitGridLists();
+
+	// create the axes:
+
+	AxesList = glGenLists(1);
+	glNewList(AxesList, GL_COMPILE);
+	glLineWidth(AXES_WIDTH);
+	Axes(1.5);
+	glLineWidth(1.);
+	glEndList();
+}
+
+// the floor grids, which are as wide as the world:
+// (called again by a scene file that changes SIM_W)
+
+void InitGridLists()
+{
 #define YGRID	-0.07f
 
 #define XSIDE1	SIM_W*2			// length of the x side of the grid
@@ -1514,7 +2284,8 @@ void InitLists()
 	// float X0 = xside/2.f, Z0 = zside/2.f;
 	// float DX = xside/(float)NX, DZ = zside/(float)NZ;
 	// float YGRID = 0.f;
-	GridDL1 = glGenLists( 1 );
+	if (GridDL1 == 0)
+		GridDL1 = glGenLists( 1 );
 	glNewList( GridDL1, GL_COMPILE );
 		SetMaterial( 1.f, 1.f, .6f, 10.f );
 		glNormal3f( 0., 1., 0. );
@@ -1545,7 +2316,8 @@ void InitLists()
 	// float X0 = xside/2.f, Z0 = zside/2.f;
 	// float DX = xside/(float)NX, DZ = zside/(float)NZ;
 	// float YGRID = 0.f;
-	GridDL2 = glGenLists( 1 );
+	if (GridDL2 == 0)
+		GridDL2 = glGenLists( 1 );
 	glNewList( GridDL2, GL_COMPILE );
 		SetMaterial( 0.3f, .8f, 1.f, 10.f );
 		glNormal3f( 0., 1., 0. );
@@ -1560,15 +2332,6 @@ void InitLists()
 			glEnd( );
 		}
 	glEndList( );
-
-	// create the axes:
-
-	AxesList = glGenLists(1);
-	glNewList(AxesList, GL_COMPILE);
-	glLineWidth(AXES_WIDTH);
-	Axes(1.5);
-	glLineWidth(1.);
-	glEndList();
 }
 
 // the keyboard callback:
@@ -1676,6 +2439,28 @@ void Keyboard(unsigned char c, int x, int y)
 		shrinkWorld = !shrinkWorld;
 		break;
 
+	case 'b':
+	case 'B':
+		DropRigidBody();
+		break;
+
+	case 'k':
+		SaveCheckpoint(checkpointFile);
+		break;
+
+	case 'K':
+		if (LoadCheckpoint(checkpointFile))
+			GLUI_Master.sync_live_all();
+		break;
+
+	case ',':
+	case '.':
+		// one frame of the playback back or on, and pause it there
+		playbackSpeed = 0.f;
+		playbackFrame += c == '.' ? 1 : -1;
+		GLUI_Master.sync_live_all();
+		break;
+
 	default:
 		fprintf(stderr, "Don't know what to do with keyboard hit: '%c' (0x%0x)\n", c, c);
 	}
@@ -1807,6 +2592,21 @@ void Reset()
 	shrinkWorld = false;
 	useLighting = true;
 	useOpening = false;
+	useFusedPass = true;
+	whichSolver = DOUBLE_DENSITY;
+	useAdaptiveDT = false;
+	useLocalDT = false;
+	useSleeping = false;
+	useBoundaryParticles = false;
+	useColliders = false;
+	useMeshColliders = !meshColliders.empty();
+	useRigidBodies = false;
+	ClearRigidBodies();
+	use2D = false;
+	slice2D.Seed(N);
+	if (useSettledStart)
+		StartSettled();
+	ForgetSnapshots();
 }
 
 // called when user resizes the window:
@@ -0,0 +1,420 @@
+// --------------------------------------------------------------------
+// Triangle mesh colliders
+//
+// An obj file is read into an ObjMesh (see loadobjfile.cpp), which is both
+// drawn and put into a TriangleBVH for the collisions. The meshes never
+// move, so the BVH is built once with the surface area heuristic and never
+// refit. A mesh is treated as a thin shell: a particle stays on the side
+// of the surface it started the step on, at least colliderMargin away from
+// it, so open CAD vessels work as well as closed ones.
+//
+// CollideParticlesWithMeshes( ) runs the queries for all particles in
+// Morton order, so neighboring queries walk the same parts of the tree.
+
+// the position of one triangle corner of an ObjMesh:
+static inline glm::vec3 MeshVertex(const ObjMesh &mesh, const int corner)
+{
+	const struct Vertex &v = mesh.Vertices[mesh.Corners[corner].v];
+	return glm::vec3(v.x, v.y, v.z);
+}
+
+// --------------------------------------------------------------------
+class TriangleBVH
+{
+public:
+	struct Triangle
+	{
+		glm::vec3 a, b, c;
+		glm::vec3 normal;
+	};
+
+	TriangleBVH() {}
+
+	// put the triangles of mesh, scaled and then moved by offset, into the tree:
+	void Build(const ObjMesh &mesh, const glm::vec3 &offset, const float scale)
+	{
+		mTriangles.clear();
+		mNodes.clear();
+
+		const int numTriangles = mesh.NumTriangles();
+		mTriangles.reserve(numTriangles);
+		for (int t = 0; t < numTriangles; t++)
+		{
+			Triangle tri;
+			tri.a = MeshVertex(mesh, 3 * t + 0) * scale + offset;
+			tri.b = MeshVertex(mesh, 3 * t + 1) * scale + offset;
+			tri.c = MeshVertex(mesh, 3 * t + 2) * scale + offset;
+			const glm::vec3 n = glm::cross(tri.b - tri.a, tri.c - tri.a);
+			const float len = glm::length(n);
+			if (len <= 0.f)
+				continue;		// degenerate, it would never be the closest anyway
+			tri.normal = n / len;
+			mTriangles.push_back(tri);
+		}
+
+		if (mTriangles.empty())
+			return;
+
+		std::vector<int> order(mTriangles.size());
+		std::vector<glm::vec3> centroids(mTriangles.size());
+		for (int t = 0; t < (int)mTriangles.size(); t++)
+		{
+			order[t] = t;
+			centroids[t] = (mTriangles[t].a + mTriangles[t].b + mTriangles[t].c) * (1.f / 3.f);
+		}
+
+		mNodes.reserve(2 * mTriangles.size());
+		mNodes.push_back(Node());
+		Subdivide(0, 0, (int)mTriangles.size(), 0, order, centroids);
+
+		// leave the triangles in leaf order:
+		std::vector<Triangle> sorted(mTriangles.size());
+		for (int t = 0; t < (int)order.size(); t++)
+			sorted[t] = mTriangles[order[t]];
+		mTriangles.swap(sorted);
+	}
+
+	// The closest point of the mesh to p, if there is one within maxDist.
+	bool ClosestPoint(const glm::vec3 &p, const float maxDist, glm::vec3 &closest, glm::vec3 &normal) const
+	{
+		if (mNodes.empty())
+			return false;
+
+		float best2 = maxDist * maxDist;
+		bool found = false;
+
+		// (a sibling left for each level above, and the two children)
+		int stack[MaxDepth + 1];
+		int top = 0;
+		stack[top++] = 0;
+		while (top > 0)
+		{
+			const Node &node = mNodes[stack[--top]];
+			if (BoxDistance2(node, p) >= best2)
+				continue;
+
+			if (node.count > 0)
+			{
+				for (int t = node.first; t < node.first + node.count; t++)
+				{
+					const Triangle &tri = mTriangles[t];
+					const glm::vec3 q = ClosestOnTriangle(p, tri.a, tri.b, tri.c);
+					const glm::vec3 pq = p - q;
+					const float d2 = glm::dot(pq, pq);
+					if (d2 < best2)
+					{
+						best2 = d2;
+						closest = q;
+						normal = tri.normal;
+						found = true;
+					}
+				}
+			}
+			else
+			{
+				// visit the nearer child first (it goes on the stack last):
+				const int l = node.first, rt = node.first + 1;
+				const bool leftNear = BoxDistance2(mNodes[l], p) < BoxDistance2(mNodes[rt], p);
+				stack[top++] = leftNear ? rt : l;
+				stack[top++] = leftNear ? l : rt;
+			}
+		}
+		return found;
+	}
+
+	// unsigned distance to the mesh
+	float Distance(const glm::vec3 &p) const
+	{
+		glm::vec3 closest, normal;
+		if (!ClosestPoint(p, 1.e+18f, closest, normal))
+			return 1.e+18f;
+		return glm::length(p - closest);
+	}
+
+	glm::vec3 Lo() const { return mNodes.empty() ? glm::vec3(0.f) : mNodes[0].lo; }
+	glm::vec3 Hi() const { return mNodes.empty() ? glm::vec3(0.f) : mNodes[0].hi; }
+	int NumTriangles() const { return (int)mTriangles.size(); }
+	int NumNodes() const { return (int)mNodes.size(); }
+
+private:
+	struct Node
+	{
+		glm::vec3 lo, hi;
+		int first;		// first triangle of a leaf, or the left child of an inner node
+		int count;		// triangles in a leaf, 0 for an inner node
+	};
+
+	static const int NumBins = 16;
+	static const int MaxLeafSize = 4;
+	static const int MaxDepth = 63;		// of a leaf, for the stack of ClosestPoint( )
+
+	static float Area(const glm::vec3 &lo, const glm::vec3 &hi)
+	{
+		const glm::vec3 e = glm::max(hi - lo, glm::vec3(0.f));
+		return e.x * e.y + e.y * e.z + e.z * e.x;
+	}
+
+	static float BoxDistance2(const Node &node, const glm::vec3 &p)
+	{
+		const glm::vec3 d = glm::max(glm::max(node.lo - p, p - node.hi), glm::vec3(0.f));
+		return glm::dot(d, d);
+	}
+
+	void Grow(glm::vec3 &lo, glm::vec3 &hi, const Triangle &tri) const
+	{
+		lo = glm::min(lo, glm::min(tri.a, glm::min(tri.b, tri.c)));
+		hi = glm::max(hi, glm::max(tri.a, glm::max(tri.b, tri.c)));
+	}
+
+	// binned SAH split of order[begin, end) into node, depth levels down:
+	void Subdivide(const int nodeIndex, const int begin, const int end, const int depth,
+		std::vector<int> &order, const std::vector<glm::vec3> &centroids)
+	{
+		glm::vec3 lo(1.e+37f), hi(-1.e+37f), clo(1.e+37f), chi(-1.e+37f);
+		for (int i = begin; i < end; i++)
+		{
+			Grow(lo, hi, mTriangles[order[i]]);
+			clo = glm::min(clo, centroids[order[i]]);
+			chi = glm::max(chi, centroids[order[i]]);
+		}
+		mNodes[nodeIndex].lo = lo;
+		mNodes[nodeIndex].hi = hi;
+		mNodes[nodeIndex].first = begin;
+		mNodes[nodeIndex].count = end - begin;
+
+		const int count = end - begin;
+		if (count <= MaxLeafSize || depth >= MaxDepth)
+			return;
+
+		// find the cheapest split over the bins of all three axes:
+		int bestAxis = -1, bestSplit = 0;
+		float bestCost = Area(lo, hi) * count;
+		for (int axis = 0; axis < 3; axis++)
+		{
+			const float extent = chi[axis] - clo[axis];
+			if (extent <= 0.f)
+				continue;
+
+			int binCount[NumBins] = { 0 };
+			glm::vec3 binLo[NumBins], binHi[NumBins];
+			for (int b = 0; b < NumBins; b++)
+			{
+				binLo[b] = glm::vec3(1.e+37f);
+				binHi[b] = glm::vec3(-1.e+37f);
+			}
+			for (int i = begin; i < end; i++)
+			{
+				const int b = glm::min(NumBins - 1, (int)(NumBins * (centroids[order[i]][axis] - clo[axis]) / extent));
+				binCount[b]++;
+				Grow(binLo[b], binHi[b], mTriangles[order[i]]);
+			}
+
+			// sweep from the right, then from the left:
+			float rightArea[NumBins];
+			int rightCount[NumBins];
+			glm::vec3 rlo(1.e+37f), rhi(-1.e+37f);
+			int rc = 0;
+			for (int b = NumBins - 1; b > 0; b--)
+			{
+				rlo = glm::min(rlo, binLo[b]);
+				rhi = glm::max(rhi, binHi[b]);
+				rc += binCount[b];
+				rightArea[b] = Area(rlo, rhi);
+				rightCount[b] = rc;
+			}
+
+			glm::vec3 llo(1.e+37f), lhi(-1.e+37f);
+			int lc = 0;
+			for (int b = 0; b < NumBins - 1; b++)
+			{
+				llo = glm::min(llo, binLo[b]);
+				lhi = glm::max(lhi, binHi[b]);
+				lc += binCount[b];
+				if (lc == 0 || rightCount[b + 1] == 0)
+					continue;
+				const float cost = Area(llo, lhi) * lc + rightArea[b + 1] * rightCount[b + 1];
+				if (cost < bestCost)
+				{
+					bestCost = cost;
+					bestAxis = axis;
+					bestSplit = b + 1;
+				}
+			}
+		}
+
+		if (bestAxis < 0)
+			return;		// splitting would not pay off, stay a leaf
+
+		const float extent = chi[bestAxis] - clo[bestAxis];
+		int *mid = std::partition(&order[0] + begin, &order[0] + end, [&](const int t)
+		{
+			const int b = glm::min(NumBins - 1, (int)(NumBins * (centroids[t][bestAxis] - clo[bestAxis]) / extent));
+			return b < bestSplit;
+		});
+		const int split = (int)(mid - &order[0]);
+
+		const int left = (int)mNodes.size();
+		mNodes.push_back(Node());
+		mNodes.push_back(Node());
+		mNodes[nodeIndex].first = left;
+		mNodes[nodeIndex].count = 0;
+		Subdivide(left, begin, split, depth + 1, order, centroids);
+		Subdivide(left + 1, split, end, depth + 1, order, centroids);
+	}
+
+	// "Real-Time Collision Detection", Ericson, 5.1.5
+	static glm::vec3 ClosestOnTriangle(const glm::vec3 &p, const glm::vec3 &a, const glm::vec3 &b, const glm::vec3 &c)
+	{
+		const glm::vec3 ab = b - a, ac = c - a, ap = p - a;
+		const float d1 = glm::dot(ab, ap), d2 = glm::dot(ac, ap);
+		if (d1 <= 0.f && d2 <= 0.f)
+			return a;
+
+		const glm::vec3 bp = p - b;
+		const float d3 = glm::dot(ab, bp), d4 = glm::dot(ac, bp);
+		if (d3 >= 0.f && d4 <= d3)
+			return b;
+
+		const float vc = d1 * d4 - d3 * d2;
+		if (vc <= 0.f && d1 >= 0.f && d3 <= 0.f)
+			return a + ab * (d1 / (d1 - d3));
+
+		const glm::vec3 cp = p - c;
+		const float d5 = glm::dot(ab, cp), d6 = glm::dot(ac, cp);
+		if (d6 >= 0.f && d5 <= d6)
+			return c;
+
+		const float vb = d5 * d2 - d1 * d6;
+		if (vb <= 0.f && d2 >= 0.f && d6 <= 0.f)
+			return a + ac * (d2 / (d2 - d6));
+
+		const float va = d3 * d6 - d5 * d4;
+		if (va <= 0.f && (d4 - d3) >= 0.f && (d5 - d6) >= 0.f)
+			return b + (c - b) * ((d4 - d3) / ((d4 - d3) + (d5 - d6)));
+
+		const float denom = 1.f / (va + vb + vc);
+		return a + ab * (vb * denom) + ac * (vc * denom);
+	}
+
+	std::vector<Triangle> mTriangles;
+	std::vector<Node> mNodes;
+};
+
+// --------------------------------------------------------------------
+struct MeshCollider
+{
+	ObjMesh mesh;
+	TriangleBVH bvh;
+	GLuint list;		// display list that draws it
+	std::string file;	// ... and where it came from
+	glm::vec3 offset;
+	float scale;
+};
+
+std::vector<MeshCollider *> meshColliders;
+
+// Read an obj file and make it a collider, scaled and then moved by offset.
+// Returns NULL if the file cannot be read.
+MeshCollider *LoadMeshCollider(const char *file, const glm::vec3 &offset, const float scale)
+{
+	MeshCollider *collider = new MeshCollider();
+	if (ReadObjFile((char *)file, collider->mesh) != 0 || collider->mesh.NumTriangles() == 0)
+	{
+		delete collider;
+		return NULL;
+	}
+
+	collider->bvh.Build(collider->mesh, offset, scale);
+	collider->file = file;
+	collider->offset = offset;
+	collider->scale = scale;
+
+	collider->list = glGenLists(1);
+	glNewList(collider->list, GL_COMPILE);
+		glPushMatrix();
+		glTranslatef(offset.x, offset.y, offset.z);
+		glScalef(scale, scale, scale);
+		DrawObjMesh(collider->mesh);
+		glPopMatrix();
+	glEndList();
+
+	if (DebugOn != 0)
+		fprintf(stderr, "Mesh collider '%s': %d triangles, %d BVH nodes\n",
+			file, collider->bvh.NumTriangles(), collider->bvh.NumNodes());
+
+	meshColliders.push_back(collider);
+	return collider;
+}
+
+void ClearMeshColliders()
+{
+	for (MeshCollider *collider : meshColliders)
+	{
+		glDeleteLists(collider->list, 1);
+		delete collider;
+	}
+	meshColliders.clear();
+}
+
+// --------------------------------------------------------------------
+// Keep pos on the side of every mesh that start is on, and at least
+// colliderMargin away from the surface.
+static inline void CollideWithMeshes(glm::vec3 &pos, const glm::vec3 &start)
+{
+	for (const MeshCollider *collider : meshColliders)
+	{
+		// anything the particle could have passed through this step is
+		// closer than this:
+		const float reach = glm::length(pos - start) + colliderMargin;
+
+		glm::vec3 closest, normal;
+		if (!collider->bvh.ClosestPoint(pos, reach, closest, normal))
+			continue;
+
+		const float side = glm::dot(start - closest, normal) >= 0.f ? 1.f : -1.f;
+		const float dist = glm::dot(pos - closest, normal) * side;
+		if (dist < colliderMargin)
+			pos += normal * (side * (colliderMargin - dist));
+	}
+}
+
+// Spread the bits of a 10 bit number out to every third bit.
+static inline unsigned int SpreadBits(unsigned int x)
+{
+	x = (x | (x << 16)) & 0x030000FF;
+	x = (x | (x << 8)) & 0x0300F00F;
+	x = (x | (x << 4)) & 0x030C30C3;
+	x = (x | (x << 2)) & 0x09249249;
+	return x;
+}
+
+// --------------------------------------------------------------------
+// The batched query: all particles, in Morton order of their cells.
+void CollideParticlesWithMeshes()
+{
+	const int n = (int)particles.size();
+	if (meshColliders.empty() || n == 0)
+		return;
+
+	ScratchArena &arena = ThreadArena();
+	std::vector<std::pair<unsigned int, int>, ArenaAllocator<std::pair<unsigned int, int> > >
+		order(n, std::pair<unsigned int, int>(0, 0), ArenaAllocator<std::pair<unsigned int, int> >(arena));
+
+	// quantize to cells of the radius of support, 1024 to an axis
+	const float invCell = 1.f / r;
+	#pragma omp parallel for
+	for (int i = 0; i < n; i++)
+	{
+		const glm::ivec3 c = glm::ivec3(glm::floor(particles[i].pos * invCell)) & glm::ivec3(1023);
+		order[i].first = SpreadBits(c.x) | (SpreadBits(c.y) << 1) | (SpreadBits(c.z) << 2);
+		order[i].second = i;
+	}
+	std::sort(order.begin(), order.end());
+
+	#pragma omp parallel for schedule(static)
+	for (int k = 0; k < n; k++)
+	{
+		Particle &particle = particles[order[k].second];
+		CollideWithMeshes(particle.pos, particle.pos_old);
+	}
+}
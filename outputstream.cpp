@@ -0,0 +1,412 @@
+// --------------------------------------------------------------------
+// Output streams
+//
+// OutputStream appends to a file the way the trajectory writer and
+// SaveCheckpoint( ) produce their output: Reserve( ) hands out room at the
+// end of the stream to encode straight into, Commit( ) says how much of it
+// was used. By default that room is a heap buffer that Commit( ) hands to
+// fwrite( ).
+//
+// With useIoUring on (Linux only) the room is in one of a pool of buffers
+// registered with an io_uring. A full buffer is submitted as a fixed
+// buffer write and filling goes on in the next one while the kernel
+// writes; completions are reaped when a buffer is needed again, so the
+// caller only waits if all of them are still being written. With
+// useDirectIO on as well, the file is opened O_DIRECT: only whole 4 KB
+// blocks are submitted (the rest is carried over to the next buffer), and
+// Close( ) pads the last block and truncates the file back to its size.
+// If the ring cannot be set up (an old kernel, a sandbox, not Linux) the
+// stream says so and falls back to stdio.
+
+#ifdef __linux__
+static inline int IoUringSetup(const unsigned entries, struct io_uring_params *p)
+{
+	return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static inline int IoUringEnter(const int fd, const unsigned toSubmit, const unsigned minComplete, const unsigned flags)
+{
+	return (int)syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, NULL, 0);
+}
+
+static inline int IoUringRegister(const int fd, const unsigned opcode, const void *arg, const unsigned numArgs)
+{
+	return (int)syscall(__NR_io_uring_register, fd, opcode, arg, numArgs);
+}
+#endif
+
+const size_t DIRECT_IO_BLOCK = 4096;
+
+class OutputStream
+{
+public:
+	OutputStream() : mFile(NULL), mBytes(0), mFailed(false)
+#ifdef __linux__
+		, mRingFd(-1), mFd(-1), mRing(NULL), mRingBytes(0), mSqes(NULL), mSqesBytes(0)
+#endif
+	{}
+
+	~OutputStream()
+	{
+		Close();
+	}
+
+	// numBuffers of bufferBytes are only used by io_uring; the buffers grow
+	// if a Reserve( ) asks for more.
+	bool Open(const char *file, const size_t bufferBytes, const int numBuffers)
+	{
+		Close();
+		mBytes = 0;
+		mFailed = false;
+#ifdef __linux__
+		if (useIoUring)
+		{
+			if (OpenRing(file, bufferBytes, numBuffers))
+				return true;
+			fprintf(stderr, "Cannot use io_uring for '%s', writing it with stdio\n", file);
+		}
+#else
+		if (useIoUring)
+			fprintf(stderr, "io_uring is only there on Linux, writing '%s' with stdio\n", file);
+#endif
+		mFile = fopen(file, "wb");
+		if (mFile == NULL)
+		{
+			fprintf(stderr, "Cannot open '%s' for writing\n", file);
+			return false;
+		}
+		return true;
+	}
+
+	bool IsOpen() const
+	{
+#ifdef __linux__
+		if (mFd >= 0)
+			return true;
+#endif
+		return mFile != NULL;
+	}
+
+	// room for up to bytes at the end of the stream, valid until Commit( )
+	uint8_t *Reserve(const size_t bytes)
+	{
+#ifdef __linux__
+		if (mFd >= 0)
+		{
+			if (mUsed + bytes > mBufferBytes)
+			{
+				SubmitCurrent();
+				if (mUsed + bytes > mBufferBytes)
+					GrowBuffers(mUsed + bytes);
+			}
+			return mBuffers[mCurrent] + mUsed;
+		}
+#endif
+		if (mStaging.size() < bytes)
+			mStaging.resize(bytes);
+		return &mStaging[0];
+	}
+
+	// the first bytes of the last Reserve( ) are done
+	void Commit(const size_t bytes)
+	{
+		mBytes += bytes;
+#ifdef __linux__
+		if (mFd >= 0)
+		{
+			mUsed += bytes;
+			return;
+		}
+#endif
+		if (mFile != NULL && bytes > 0 && fwrite(&mStaging[0], bytes, 1, mFile) != 1)
+			mFailed = true;
+	}
+
+	void Write(const void *data, const size_t bytes)
+	{
+		memcpy(Reserve(bytes), data, bytes);
+		Commit(bytes);
+	}
+
+	// committed so far
+	size_t Bytes() const
+	{
+		return mBytes;
+	}
+
+	// Write out everything committed and close the file. False if any of
+	// it could not be written.
+	bool Close()
+	{
+#ifdef __linux__
+		if (mFd >= 0)
+			CloseRing();
+#endif
+		if (mFile != NULL)
+		{
+			if (fclose(mFile) != 0)
+				mFailed = true;
+			mFile = NULL;
+		}
+		return !mFailed;
+	}
+
+private:
+	FILE *mFile;
+	std::vector<uint8_t> mStaging;
+	size_t mBytes;
+	bool mFailed;
+
+#ifdef __linux__
+	bool OpenRing(const char *file, const size_t bufferBytes, const int numBuffers)
+	{
+		mDirect = useDirectIO != 0;
+		mFd = open(file, O_WRONLY | O_CREAT | O_TRUNC | (mDirect ? O_DIRECT : 0), 0644);
+		if (mFd < 0)
+			return false;
+
+		const unsigned entries = 2 * (unsigned)glm::max(numBuffers, 1);
+		struct io_uring_params p;
+		memset(&p, 0, sizeof(p));
+		mRingFd = IoUringSetup(entries, &p);
+		if (mRingFd < 0 || (p.features & IORING_FEAT_SINGLE_MMAP) == 0)
+		{
+			TearDownRing();
+			return false;
+		}
+
+		// one mapping for both rings, one for the submission entries
+		mRingBytes = glm::max(p.sq_off.array + p.sq_entries * sizeof(unsigned),
+			p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe));
+		mRing = (uint8_t *)mmap(NULL, mRingBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, mRingFd, IORING_OFF_SQ_RING);
+		mSqesBytes = p.sq_entries * sizeof(struct io_uring_sqe);
+		mSqes = (struct io_uring_sqe *)mmap(NULL, mSqesBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, mRingFd, IORING_OFF_SQES);
+		if (mRing == (uint8_t *)MAP_FAILED || mSqes == (struct io_uring_sqe *)MAP_FAILED)
+		{
+			TearDownRing();
+			return false;
+		}
+		mSqTail = (unsigned *)(mRing + p.sq_off.tail);
+		mSqMask = *(unsigned *)(mRing + p.sq_off.ring_mask);
+		mSqArray = (unsigned *)(mRing + p.sq_off.array);
+		mCqHead = (unsigned *)(mRing + p.cq_off.head);
+		mCqTail = (unsigned *)(mRing + p.cq_off.tail);
+		mCqMask = *(unsigned *)(mRing + p.cq_off.ring_mask);
+		mCqes = (struct io_uring_cqe *)(mRing + p.cq_off.cqes);
+
+		mBuffers.assign(glm::max(numBuffers, 1), (uint8_t *)NULL);
+		mBusy.assign(mBuffers.size(), 0);
+		mBufferBytes = 0;
+		mRegistered = false;
+		mInFlight = 0;
+		mCurrent = 0;
+		mUsed = 0;
+		mOffset = 0;
+		if (!AllocateBuffers(bufferBytes))
+		{
+			TearDownRing();
+			return false;
+		}
+		return true;
+	}
+
+	// (all buffers idle)
+	bool AllocateBuffers(const size_t bytes)
+	{
+		if (mRegistered)
+			IoUringRegister(mRingFd, IORING_UNREGISTER_BUFFERS, NULL, 0);
+		mRegistered = false;
+
+		mBufferBytes = (bytes + DIRECT_IO_BLOCK - 1) / DIRECT_IO_BLOCK * DIRECT_IO_BLOCK;
+		std::vector<struct iovec> iov(mBuffers.size());
+		for (size_t b = 0; b < mBuffers.size(); b++)
+		{
+			free(mBuffers[b]);
+			mBuffers[b] = NULL;
+			void *buffer;
+			if (posix_memalign(&buffer, DIRECT_IO_BLOCK, mBufferBytes) != 0)
+				return false;
+			mBuffers[b] = (uint8_t *)buffer;
+			iov[b].iov_base = buffer;
+			iov[b].iov_len = mBufferBytes;
+		}
+
+		// fixed buffers save the kernel mapping them for every write, but
+		// need locked memory; plain writes of the same buffers do without
+		mRegistered = IoUringRegister(mRingFd, IORING_REGISTER_BUFFERS, &iov[0], (unsigned)iov.size()) == 0;
+		return true;
+	}
+
+	// Make the buffers big enough for bytes, keeping what is in the
+	// current one.
+	void GrowBuffers(const size_t bytes)
+	{
+		WaitForAll();
+		std::vector<uint8_t> keep(mBuffers[mCurrent], mBuffers[mCurrent] + mUsed);
+		if (!AllocateBuffers(glm::max(bytes, 2 * mBufferBytes)))
+		{
+			fprintf(stderr, "Cannot allocate %zu byte output buffers\n", bytes);
+			abort();
+		}
+		mCurrent = 0;
+		if (!keep.empty())
+			memcpy(mBuffers[0], &keep[0], keep.size());
+	}
+
+	// Submit what is in the current buffer (whole blocks of it if direct)
+	// and move on to a free one. Once a write has failed nothing more is
+	// submitted (Close( ) says so), the buffer is only emptied.
+	void SubmitCurrent()
+	{
+		if (mFailed)
+		{
+			mUsed = 0;
+			return;
+		}
+
+		size_t submit = mUsed;
+		if (mDirect)
+			submit = mUsed / DIRECT_IO_BLOCK * DIRECT_IO_BLOCK;
+		if (submit == 0)
+			return;
+
+		uint8_t carry[DIRECT_IO_BLOCK];
+		const size_t carried = mUsed - submit;
+		memcpy(carry, mBuffers[mCurrent] + submit, carried);
+
+		const int index = mCurrent;
+		struct io_uring_sqe &sqe = mSqes[*mSqTail & mSqMask];
+		memset(&sqe, 0, sizeof(sqe));
+		sqe.opcode = mRegistered ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+		sqe.fd = mFd;
+		sqe.addr = (unsigned long long)mBuffers[index];
+		sqe.len = (unsigned)submit;
+		sqe.off = mOffset;
+		sqe.buf_index = (unsigned short)index;
+		sqe.user_data = ((unsigned long long)submit << 16) | (unsigned long long)index;
+		mSqArray[*mSqTail & mSqMask] = *mSqTail & mSqMask;
+		__atomic_store_n(mSqTail, *mSqTail + 1, __ATOMIC_RELEASE);
+		if (IoUringEnter(mRingFd, 1, 0, 0) < 0)
+		{
+			// the kernel did not take it, so no completion will come for it
+			fprintf(stderr, "io_uring submit failed: %s\n", strerror(errno));
+			__atomic_store_n(mSqTail, *mSqTail - 1, __ATOMIC_RELEASE);
+			mFailed = true;
+			mUsed = 0;
+			return;
+		}
+
+		mBusy[index] = 1;
+		mInFlight++;
+		mOffset += submit;
+
+		mCurrent = FreeBuffer();
+		memcpy(mBuffers[mCurrent], carry, carried);
+		mUsed = carried;
+	}
+
+	// a buffer that is not being written, waiting for one if need be
+	int FreeBuffer()
+	{
+		for (;;)
+		{
+			Reap(false);
+			for (int b = 0; b < (int)mBuffers.size(); b++)
+			{
+				if (!mBusy[b])
+					return b;
+			}
+			Reap(true);
+		}
+	}
+
+	// Take the completions off the ring, waiting for at least one if wait.
+	void Reap(const bool wait)
+	{
+		if (wait && mInFlight > 0 && __atomic_load_n(mCqTail, __ATOMIC_ACQUIRE) == *mCqHead)
+			IoUringEnter(mRingFd, 0, 1, IORING_ENTER_GETEVENTS);
+
+		unsigned head = *mCqHead;
+		while (head != __atomic_load_n(mCqTail, __ATOMIC_ACQUIRE))
+		{
+			const struct io_uring_cqe &cqe = mCqes[head & mCqMask];
+			const int index = (int)(cqe.user_data & 0xffff);
+			if (cqe.res < 0 || (unsigned long long)cqe.res != (cqe.user_data >> 16))
+			{
+				if (!mFailed)
+					fprintf(stderr, "io_uring write failed: %s\n", cqe.res < 0 ? strerror(-cqe.res) : "short write");
+				mFailed = true;
+			}
+			mBusy[index] = 0;
+			mInFlight--;
+			head++;
+		}
+		__atomic_store_n(mCqHead, head, __ATOMIC_RELEASE);
+	}
+
+	void WaitForAll()
+	{
+		while (mInFlight > 0)
+			Reap(true);
+	}
+
+	void CloseRing()
+	{
+		if (mDirect && mUsed % DIRECT_IO_BLOCK != 0)
+		{
+			const size_t padded = (mUsed + DIRECT_IO_BLOCK - 1) / DIRECT_IO_BLOCK * DIRECT_IO_BLOCK;
+			memset(mBuffers[mCurrent] + mUsed, 0, padded - mUsed);
+			mUsed = padded;
+		}
+		SubmitCurrent();
+		WaitForAll();
+		if (mDirect && ftruncate(mFd, (off_t)mBytes) != 0)
+			mFailed = true;
+		TearDownRing();
+	}
+
+	void TearDownRing()
+	{
+		if (mRingFd >= 0)
+		{
+			if (mRing != NULL && mRing != (uint8_t *)MAP_FAILED)
+				munmap(mRing, mRingBytes);
+			if (mSqes != NULL && mSqes != (struct io_uring_sqe *)MAP_FAILED)
+				munmap(mSqes, mSqesBytes);
+			close(mRingFd);
+		}
+		mRing = NULL;
+		mSqes = NULL;
+		mRingFd = -1;
+		for (size_t b = 0; b < mBuffers.size(); b++)
+			free(mBuffers[b]);
+		mBuffers.clear();
+		if (mFd >= 0)
+		{
+			if (close(mFd) != 0)
+				mFailed = true;
+		}
+		mFd = -1;
+	}
+
+	int mRingFd;
+	int mFd;
+	bool mDirect;
+	uint8_t *mRing;
+	size_t mRingBytes;
+	struct io_uring_sqe *mSqes;
+	size_t mSqesBytes;
+	unsigned *mSqTail, *mSqArray, mSqMask;
+	unsigned *mCqHead, *mCqTail, mCqMask;
+	struct io_uring_cqe *mCqes;
+
+	std::vector<uint8_t *> mBuffers;
+	std::vector<int> mBusy;		// != 0 while the kernel is writing the buffer
+	size_t mBufferBytes;
+	bool mRegistered;
+	int mInFlight;
+	int mCurrent;				// the buffer Reserve( ) hands out
+	size_t mUsed;				// ... and how much of it is committed
+	unsigned long long mOffset;	// where in the file the next submission goes
+#endif
+};
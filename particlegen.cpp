@@ -0,0 +1,177 @@
+// --------------------------------------------------------------------
+// Particle generation
+//
+// initParticles( ) and addMoreParticles( ) both pour a column of layers of
+// concentric rings, r/2 apart. ParticleColumn lays that out once (the
+// heights of the layers and the radii and counts of the rings), after which
+// the position of particle i of the column is a direct lookup, so the
+// particles can be made in parallel. Their jitter comes from the counter
+// based generator of deterministic.cpp, keyed by the index of the particle,
+// so it does not matter which thread makes which particle.
+//
+// A scene file (see scene.cpp) can replace the column of initParticles( )
+// with a list of emitters, columns and boxes (ParticleBox, a lattice), which
+// are filled in order.
+
+class ParticleColumn
+{
+public:
+	// layers from firstY up to maxHeight, rings out to radius, gap apart
+	ParticleColumn(const float firstY, const float maxHeight, const float radius, const float gap)
+	{
+		// (accumulated in float, to land on the same heights and radii the
+		// nested loops this replaces did)
+		for (float y = firstY; y <= maxHeight; y += gap)
+			mLayerY.push_back(y);
+
+		mRingStart.push_back(0);
+		for (float ringRadius = 0; ringRadius <= radius; ringRadius += gap)
+		{
+			// circumference / gap
+			const int count = (ringRadius == 0) ? 1 : static_cast<int>((2 * M_PI * ringRadius) / gap);
+			mRingRadius.push_back(ringRadius);
+			mRingStart.push_back(mRingStart.back() + count);
+		}
+	}
+
+	int PerLayer() const
+	{
+		return mRingStart.back();
+	}
+
+	int Size() const
+	{
+		return (int)mLayerY.size() * PerLayer();
+	}
+
+	// where particle i (< Size( )) of the column goes, before the jitter
+	glm::vec3 Position(const int i) const
+	{
+		const int layer = i / PerLayer();
+		const int slot = i % PerLayer();
+		const int ring = (int)(std::upper_bound(mRingStart.begin(), mRingStart.end(), slot) - mRingStart.begin()) - 1;
+		const int count = mRingStart[ring + 1] - mRingStart[ring];
+
+		const float angle = (slot - mRingStart[ring]) * (2 * M_PI / count);
+		return glm::vec3(mRingRadius[ring] * cos(angle), mLayerY[layer], mRingRadius[ring] * sin(angle));
+	}
+
+private:
+	std::vector<float> mLayerY;
+	std::vector<float> mRingRadius;
+	std::vector<int> mRingStart;	// first slot of every ring in a layer, and the end
+};
+
+// A block on a cubic lattice, gap apart, from lo towards hi, filled layer
+// by layer from the bottom like the column.
+class ParticleBox
+{
+public:
+	ParticleBox(const glm::vec3 &lo, const glm::vec3 &hi, const float gap) : mLo(lo), mGap(gap)
+	{
+		for (int a = 0; a < 3; a++)
+			mCounts[a] = hi[a] >= lo[a] ? (int)((hi[a] - lo[a]) / gap + 1e-3f) + 1 : 0;
+	}
+
+	int Size() const
+	{
+		return mCounts.x * mCounts.y * mCounts.z;
+	}
+
+	glm::vec3 Position(const int i) const
+	{
+		const int x = i % mCounts.x;
+		const int z = (i / mCounts.x) % mCounts.z;
+		const int y = i / (mCounts.x * mCounts.z);
+		return mLo + mGap * glm::vec3((float)x, (float)y, (float)z);
+	}
+
+private:
+	glm::vec3 mLo;
+	float mGap;
+	glm::ivec3 mCounts;
+};
+
+// --------------------------------------------------------------------
+// Append particles first to first + n - 1 of shape (a ParticleColumn or a
+// ParticleBox, fewer if it runs out), moved by offset, at rest with the
+// default material.
+template <typename Shape>
+void AddParticles(const Shape &shape, const unsigned int first, const unsigned int n, const glm::vec3 &offset = glm::vec3(0.f))
+{
+	const int start = (int)particles.size();
+	const int count = (int)glm::min(n, (unsigned int)glm::max(shape.Size() - (int)first, 0));
+	particles.resize(start + count);
+
+	#pragma omp parallel for
+	for (int i = 0; i < count; i++)
+	{
+		const unsigned int id = start + i;
+		Particle &p = particles[id];
+		p.mass = mass;
+		p.pos = shape.Position(first + i) + offset + 0.01f * CounterRandom3(id, 0);
+		p.pos_old = p.pos + 0.001f * CounterRandom3(id, 3);
+		p.vel = glm::vec3(0.f);
+		p.force = glm::vec3(0.f);
+		p.sigma = 3.f;
+		p.beta = 4.f;
+		p.rho = p.rho_near = 0.f;
+		p.press = p.press_near = 0.f;
+		p.r_density = rest_density;
+		p.dt = dT;
+		p.level = 0;
+		p.calmSteps = 0;
+		p.asleep = p.wakeUp = 0;
+	}
+}
+
+// --------------------------------------------------------------------
+enum EmitterShapes
+{
+	EMIT_COLUMN,
+	EMIT_BOX
+};
+
+struct ParticleEmitter
+{
+	int shape;				// EMIT_COLUMN or EMIT_BOX
+	glm::vec3 base;			// column: the center of its lowest layer
+	float radius;			// ... its radius
+	float top;				// ... and the height of its highest layer
+	glm::vec3 lo, hi;		// box: its corners
+	float gap;				// between the particles, 0 for r / 2
+	unsigned int count;		// particles it makes at most
+};
+
+std::vector<ParticleEmitter> emitters;	// empty for the column of initParticles( )
+
+// how many particles e makes
+int EmitterSize(const ParticleEmitter &e)
+{
+	const float gap = e.gap > 0.f ? e.gap : r * 0.5f;
+	const int size = e.shape == EMIT_BOX ? ParticleBox(e.lo, e.hi, gap).Size() : ParticleColumn(e.base.y, e.top, e.radius, gap).Size();
+	return (int)glm::min((unsigned int)size, e.count);
+}
+
+// Fill the emitters in order until there are n particles.
+void EmitParticles(const unsigned int n)
+{
+	unsigned int start = 0;		// of the particles of emitter e
+	for (const ParticleEmitter &e : emitters)
+	{
+		const unsigned int size = (unsigned int)EmitterSize(e);
+		if (particles.size() >= n)
+			return;
+		if (particles.size() < start + size)
+		{
+			const unsigned int first = (unsigned int)particles.size() - start;
+			const unsigned int count = glm::min(size - first, n - (unsigned int)particles.size());
+			const float gap = e.gap > 0.f ? e.gap : r * 0.5f;
+			if (e.shape == EMIT_BOX)
+				AddParticles(ParticleBox(e.lo, e.hi, gap), first, count);
+			else
+				AddParticles(ParticleColumn(e.base.y, e.top, e.radius, gap), first, count, glm::vec3(e.base.x, 0.f, e.base.z));
+		}
+		start += size;
+	}
+}
@@ -0,0 +1,194 @@
+// --------------------------------------------------------------------
+// Position Based Fluids
+// "Position Based Fluids", Macklin and Muller, SIGGRAPH 2013
+//
+// Instead of turning the density error into a pressure force, every particle
+// carries the constraint C_i = rho_i / rest - 1 and a few Jacobi iterations
+// move the predicted positions until the constraints are (nearly) satisfied.
+// It uses the same spatial index, neighbor lists and density estimate as
+// step( ), so rest_density means the same thing for both solvers.
+
+// The solver parameters (pbfIterations, pbfDT, ...) live with the other
+// simulation globals in main.cpp so the glui panel can reach them.
+
+// --------------------------------------------------------------------
+// XSPH viscosity: blend every velocity towards those of its neighbors.
+// The changes are gathered into scratch first, so every particle reads
+// the velocities from before the smoothing.
+void SmoothVelocitiesXSPH(const float c, glm::vec3 *scratch)
+{
+	const int n = (int)particles.size();
+
+	#pragma omp parallel for
+	for (int i = 0; i < n; i++)
+	{
+		Particle &particle = particles[i];
+		glm::vec3 dv(0.f);
+		for (const Neighbor &nb : particle.neighbors)
+		{
+			const glm::vec3 rij = (*nb.j).pos - particle.pos;
+			const float len2 = glm::dot(rij, rij);
+			if (len2 >= rsq)
+				continue;
+			float len;
+			const float q = KernelQ(len2, len);
+			dv += ((*nb.j).vel - particle.vel) * (q * q);
+		}
+		scratch[i] = c * dv;
+	}
+
+	#pragma omp parallel for
+	for (int i = 0; i < n; i++)
+	{
+		particles[i].vel += scratch[i];
+	}
+}
+
+// --------------------------------------------------------------------
+void stepPBF()
+{
+	const float dt = pbfDT;
+	const int n = (int)particles.size();
+	if (n == 0)
+		return;
+
+	// same normalization as the density pass of step( )
+	const float volume = Dimension<3>::KernelVolume();
+
+	// per-step temporaries, they are gone with the next ResetScratchArenas( )
+	ScratchArena &arena = ThreadArena();
+	std::vector<float, ArenaAllocator<float> > lambda(n, 0.f, ArenaAllocator<float>(arena));
+	std::vector<glm::vec3, ArenaAllocator<glm::vec3> > delta(n, glm::vec3(0.f), ArenaAllocator<glm::vec3>(arena));
+	Particle *base = &particles[0];
+
+	// PREDICT
+	// Apply the external forces and move to the predicted positions.
+	// pos_old keeps where the particle was at the start of the step.
+	#pragma omp parallel for
+	for (int i = 0; i < n; i++)
+	{
+		Particle &particle = particles[i];
+		particle.force = useGravity ? glm::vec3(0.f, -particle.mass * ::G, 0.f) : glm::vec3(0.f);
+		if (externalForce)
+			particle.force += glm::vec3(.002f * 0.025, 0.f, 0.f);
+
+		particle.vel += (particle.force / particle.mass) * dt;
+		particle.pos_old = particle.pos;
+		particle.pos += particle.vel * dt;
+		ProjectContainerBoundaries(particle.pos, particle.pos_old);
+	}
+
+	// The neighbor lists are found once on the predicted positions and
+	// kept fixed through the iterations, as in the paper.
+	RebuildIndex();
+
+	#pragma omp parallel for
+	for (int i = 0; i < n; i++)
+	{
+		float d = 0, dn = 0;
+		FindNeighbors(particles[i], d, dn);
+	}
+
+	for (int iter = 0; iter < pbfIterations; iter++)
+	{
+		// LAMBDA
+		// The scaling factor of each density constraint.
+		#pragma omp parallel for
+		for (int i = 0; i < n; i++)
+		{
+			Particle &particle = particles[i];
+			const float scale = 2.f * particle.mass / (volume * r * particle.r_density);
+
+			float d = 0;
+			float sumGrad2 = 0;
+			glm::vec3 gradI(0.f);
+			for (const Neighbor &nb : particle.neighbors)
+			{
+				const glm::vec3 rij = (*nb.j).pos - particle.pos;
+				const float len2 = glm::dot(rij, rij);
+				if (len2 >= rsq || len2 == 0.f)
+					continue;
+				float len;
+				const float q = KernelQ(len2, len);
+
+				d += q * q;
+
+				// gradient of C_i with respect to Particle j (and minus that for i)
+				const glm::vec3 grad = (scale * q / len) * rij;
+				gradI += grad;
+				sumGrad2 += glm::dot(grad, grad);
+			}
+			sumGrad2 += glm::dot(gradI, gradI);
+
+			particle.rho = (d * particle.mass) / volume;
+
+			// Only push particles apart; a density below rest means a free
+			// surface, not something to pull together.
+			const float C = glm::max(particle.rho / particle.r_density - 1.f, 0.f);
+			lambda[i] = -C / (sumGrad2 + pbfRelaxation);
+		}
+
+		// POSITION CORRECTION
+		#pragma omp parallel for
+		for (int i = 0; i < n; i++)
+		{
+			Particle &particle = particles[i];
+			const float scale = 2.f * particle.mass / (volume * r * particle.r_density);
+
+			glm::vec3 dX(0.f);
+			for (const Neighbor &nb : particle.neighbors)
+			{
+				const glm::vec3 rij = (*nb.j).pos - particle.pos;
+				const float len2 = glm::dot(rij, rij);
+				if (len2 >= rsq || len2 == 0.f)
+					continue;
+				float len;
+				const float q = KernelQ(len2, len);
+
+				const int j = (int)(nb.j - base);
+				dX += (lambda[i] + lambda[j]) * (scale * q / len) * rij;
+			}
+			delta[i] = dX;
+		}
+
+		#pragma omp parallel for
+		for (int i = 0; i < n; i++)
+		{
+			Particle &particle = particles[i];
+			particle.pos += delta[i];
+			ProjectContainerBoundaries(particle.pos, particle.pos_old);
+		}
+	}
+
+	// VELOCITY
+	#pragma omp parallel for
+	for (int i = 0; i < n; i++)
+	{
+		Particle &particle = particles[i];
+		particle.vel = (particle.pos - particle.pos_old) / dt;
+	}
+
+	SmoothVelocitiesXSPH(pbfXSPH, &delta[0]);
+
+	#pragma omp parallel for reduction(metrics:stepSums)
+	for (int i = 0; i < n; i++)
+	{
+		Particle &particle = particles[i];
+
+		// leave pos_old where the Verlet integration of step( ) expects it,
+		// so switching solvers mid-run does not kick the particles
+		particle.pos_old = particle.pos - particle.vel * dT;
+		particle.dt = dT;
+
+		// keep the equation-of-state pressure around for the color visuals
+		particle.press = k * (particle.rho - particle.r_density);
+		SetParticleColor(particle);
+
+		// (the densities are those of the last iteration)
+		if (useDiagnostics)
+		{
+			stepSums.AddDensity(particle.rho, particle.r_density, (int)particle.neighbors.size());
+			stepSums.AddMotion(particle.mass, glm::dot(particle.vel, particle.vel));
+		}
+	}
+}
@@ -0,0 +1,315 @@
+// --------------------------------------------------------------------
+// Trajectory playback
+//
+// With usePlayback on, Display( ) draws the frames of a recorded trajectory
+// (see trajectory.cpp) instead of the particles, and nothing is simulated.
+// TrajectoryPlayer maps the file, finds where every frame starts, and
+// decodes on a thread of its own: the playbackReadAhead frames from the
+// one asked for on are decoded before they are needed. A frame that is
+// not a key frame can only be decoded after the one before it, so a jump
+// (scrubbing with the Frame spinner, or playing backwards) starts again
+// from the key frame at or before it.
+//
+// playbackSpeed is in recorded frames per displayed frame: 0 pauses,
+// fractions play slow motion and negative speeds play backwards. The
+// playhead only moves on while the frame it is at is decoded, so a slow
+// decode slows playback down instead of skipping frames.
+
+struct PlaybackFrame
+{
+	int frame;					// number of the frame in the file, -1 while empty
+	std::vector<glm::vec3> pos;
+	std::vector<float> colors;	// r, g, b per particle
+};
+
+class TrajectoryPlayer
+{
+public:
+	TrajectoryPlayer() : mData(NULL), mBytes(0), mStop(false), mWanted(0), mShown(-1) {}
+
+	~TrajectoryPlayer()
+	{
+		Close();
+	}
+
+	bool Open(const char *file, const int readAhead)
+	{
+		Close();
+		const int fd = open(file, O_RDONLY);
+		if (fd < 0)
+		{
+			fprintf(stderr, "Cannot open trajectory '%s'\n", file);
+			return false;
+		}
+		struct stat st;
+		if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(TrajectoryHeader))
+		{
+			fprintf(stderr, "Trajectory '%s' is too short\n", file);
+			close(fd);
+			return false;
+		}
+		mBytes = (size_t)st.st_size;
+		mData = (const uint8_t *)mmap(NULL, mBytes, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (mData == (const uint8_t *)MAP_FAILED)
+		{
+			fprintf(stderr, "Cannot map trajectory '%s'\n", file);
+			mData = NULL;
+			return false;
+		}
+
+		memcpy(&mHeader, mData, sizeof(mHeader));
+		if (memcmp(mHeader.magic, TRAJECTORY_MAGIC, sizeof(mHeader.magic)) != 0 ||
+			mHeader.version != TRAJECTORY_VERSION || mHeader.bits < 1 || mHeader.bits > 16)
+		{
+			fprintf(stderr, "'%s' is not a trajectory this program can play\n", file);
+			Close();
+			return false;
+		}
+
+		// Where every frame starts, and the key frame it is decoded from.
+		// A frame cut short (the recording is still going) is left out.
+		mFrames.clear();
+		size_t at = sizeof(mHeader);
+		int key = -1;
+		while (at + sizeof(TrajectoryFrameHeader) <= mBytes)
+		{
+			TrajectoryFrameHeader fh;
+			memcpy(&fh, mData + at, sizeof(fh));
+			if (at + sizeof(fh) + fh.bytes > mBytes)
+				break;
+			if (fh.key)
+				key = (int)mFrames.size();
+			if (key >= 0)
+			{
+				FrameIndex f;
+				f.offset = at;
+				f.header = fh;
+				f.key = key;
+				mFrames.push_back(f);
+			}
+			at += sizeof(fh) + fh.bytes;
+		}
+		if (mFrames.empty())
+		{
+			fprintf(stderr, "Trajectory '%s' has no frames\n", file);
+			Close();
+			return false;
+		}
+
+		mSlots.assign(glm::max(readAhead, 1) + 1, PlaybackFrame());
+		for (auto &slot : mSlots)
+			slot.frame = -1;
+		mStop = false;
+		mWanted = 0;
+		mShown = -1;
+		mThread = std::thread(&TrajectoryPlayer::Run, this);
+		return true;
+	}
+
+	void Close()
+	{
+		if (mThread.joinable())
+		{
+			{
+				std::lock_guard<std::mutex> lock(mMutex);
+				mStop = true;
+			}
+			mChanged.notify_all();
+			mThread.join();
+		}
+		if (mData != NULL)
+			munmap((void *)mData, mBytes);
+		mData = NULL;
+		mFrames.clear();
+		mSlots.clear();
+	}
+
+	bool IsOpen() const
+	{
+		return mData != NULL;
+	}
+
+	int NumFrames() const
+	{
+		return (int)mFrames.size();
+	}
+
+	// Ask for frame and get it if it is decoded (ready is true then), or
+	// else the frame shown last (or NULL). The result stays valid until the
+	// next call.
+	const PlaybackFrame *Show(const int frame, bool &ready)
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		if (frame != mWanted)
+		{
+			mWanted = frame;
+			mChanged.notify_all();
+		}
+		ready = false;
+		for (int s = 0; s < (int)mSlots.size(); s++)
+		{
+			if (mSlots[s].frame == frame)
+			{
+				mShown = s;
+				ready = true;
+				break;
+			}
+		}
+		return mShown >= 0 && mSlots[mShown].frame >= 0 ? &mSlots[mShown] : NULL;
+	}
+
+private:
+	struct FrameIndex
+	{
+		size_t offset;					// of its TrajectoryFrameHeader in the file
+		TrajectoryFrameHeader header;
+		int key;						// the key frame it is decoded from
+	};
+
+	// The next frame of the read ahead window that is not decoded, and a
+	// slot to decode it into (neither in the window nor being shown).
+	// (call with mMutex held)
+	bool FindWork(int &frame, int &slot) const
+	{
+		const int end = glm::min(mWanted + (int)mSlots.size() - 1, NumFrames());
+		frame = -1;
+		for (int f = mWanted; f < end && frame < 0; f++)
+		{
+			bool decoded = false;
+			for (const auto &s : mSlots)
+				decoded = decoded || s.frame == f;
+			if (!decoded)
+				frame = f;
+		}
+		if (frame < 0)
+			return false;
+
+		for (int s = 0; s < (int)mSlots.size(); s++)
+		{
+			const int f = mSlots[s].frame;
+			if (s != mShown && (f < mWanted || f >= end))
+			{
+				slot = s;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	// the decoder thread
+	void Run()
+	{
+		std::vector<uint16_t> q, prev;
+		std::vector<glm::vec3> vel;
+		int prevCount = 0;
+		int decoded = -1;		// the frame in prev
+
+		for (;;)
+		{
+			int frame, slot;
+			{
+				std::unique_lock<std::mutex> lock(mMutex);
+				mChanged.wait(lock, [&] { return mStop || FindWork(frame, slot); });
+				if (mStop)
+					return;
+				mSlots[slot].frame = -1;
+			}
+
+			// on from the frame before if that is where the decoder is,
+			// from the key frame if not
+			const int key = mFrames[frame].key;
+			const int first = (decoded >= key && decoded < frame) ? decoded + 1 : key;
+			for (int f = first; f <= frame; f++)
+			{
+				const FrameIndex &fi = mFrames[f];
+				const uint8_t *in = mData + fi.offset + sizeof(TrajectoryFrameHeader);
+				if (!DecodeTrajectoryPlanes(in, in + fi.header.bytes, (int)fi.header.count, prev, prevCount, fi.header.key != 0, q))
+					fprintf(stderr, "Trajectory frame %d is corrupt\n", f);
+				q.swap(prev);
+				prevCount = (int)fi.header.count;
+				decoded = f;
+			}
+
+			PlaybackFrame &out = mSlots[slot];
+			DequantizeTrajectoryFrame(mHeader, prev, prevCount, out.pos, vel);
+			out.colors.resize(3 * prevCount);
+			for (int i = 0; i < prevCount; i++)
+			{
+				// the colors of SetParticleColor( ) case 0, but the trajectory
+				// has no densities for the blue
+				out.colors[3 * i + 0] = 0.3f + (80000.f * fabs(vel[i].x * vel[i].z));
+				out.colors[3 * i + 1] = 0.3f + (60.f * fabs(vel[i].y));
+				out.colors[3 * i + 2] = 0.9f;
+			}
+
+			{
+				std::lock_guard<std::mutex> lock(mMutex);
+				out.frame = frame;
+			}
+		}
+	}
+
+	TrajectoryHeader mHeader;
+	const uint8_t *mData;
+	size_t mBytes;
+	std::vector<FrameIndex> mFrames;
+	std::vector<PlaybackFrame> mSlots;
+	std::mutex mMutex;
+	std::condition_variable mChanged;
+	std::thread mThread;
+	bool mStop;
+	int mWanted;		// the frame Show( ) asked for last
+	int mShown;			// the slot it returned, the decoder leaves that one alone
+};
+
+TrajectoryPlayer trajectoryPlayer;
+
+// --------------------------------------------------------------------
+// Open or close the player to follow usePlayback and move the playhead
+// on by playbackSpeed. Returns the frame to draw, or NULL to draw the
+// particles.
+// (call once per Display( ))
+const PlaybackFrame *AdvancePlayback()
+{
+	static float playhead = 0.f;
+
+	if (!usePlayback)
+	{
+		if (trajectoryPlayer.IsOpen())
+			trajectoryPlayer.Close();
+		return NULL;
+	}
+	if (!trajectoryPlayer.IsOpen())
+	{
+		if (!trajectoryPlayer.Open(playbackFile, playbackReadAhead))
+		{
+			usePlayback = false;
+			return NULL;
+		}
+		playhead = 0.f;
+		playbackFrame = 0;
+	}
+
+	// the Frame spinner moved: scrub there
+	const int last = trajectoryPlayer.NumFrames() - 1;
+	playbackFrame = glm::clamp(playbackFrame, 0, last);
+	if (playbackFrame != (int)playhead)
+		playhead = (float)playbackFrame;
+
+	bool ready;
+	const PlaybackFrame *frame = trajectoryPlayer.Show(playbackFrame, ready);
+	if (ready && playbackSpeed != 0.f)
+	{
+		// wrap around at either end
+		playhead += playbackSpeed;
+		if (playhead >= (float)(last + 1))
+			playhead = 0.f;
+		else if (playhead < 0.f)
+			playhead = (float)last;
+		playbackFrame = (int)playhead;
+		if (GluiFluid != NULL)
+			GluiFluid->sync_live();
+	}
+	return frame;
+}
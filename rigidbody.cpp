@@ -0,0 +1,709 @@
+// --------------------------------------------------------------------
+// Two-way coupled rigid bodies
+// "Versatile Rigid-Fluid Coupling for Incompressible SPH", Akinci, Ihmsen,
+// Akinci, Solenthaler and Teschner, SIGGRAPH 2012
+//
+// Spheres, boxes and convex hulls read from obj files. The surface of every
+// body is sampled once, in its own frame, with the same kind of weighted
+// samples as the boundary particle walls (see boundary.cpp). Each step the
+// samples are moved with their body and put into bodyIndex, and from there
+// on the fluid sees them through FindWallNeighbors( ) like any other wall.
+// The push of the fluid on a body is the exact opposite of the push of its
+// samples on the fluid: every sample gathers it from the fluid particles
+// around it through indexsp, and the sums over the samples are the force
+// and torque the body is integrated with.
+//
+// Contacts between bodies and with the static scene are found through the
+// samples as well: bodyIndex for body against body, and
+// ProjectContainerBoundaries( ) for the walls, colliders and meshes. So
+// nothing in here ever loops over all particles for all bodies.
+//
+// Densities are given relative to FluidMassDensity( ). The near pressure of
+// the double density fluid pushes harder than a hydrostatic pressure would,
+// so the bodies float higher than Archimedes says: at 1 they still ride on
+// the surface, somewhere past 2 they sink.
+//
+// Only the double density step knows about bodies.
+
+enum RigidShapes
+{
+	RIGID_SPHERE,
+	RIGID_BOX,
+	RIGID_HULL
+};
+
+struct RigidBody
+{
+	int shape;
+	glm::vec3 half;					// RIGID_BOX half sizes, RIGID_SPHERE radius in x
+	std::vector<glm::vec4> planes;	// RIGID_HULL faces, dot(n, p) = w, n pointing out
+	GLuint list;					// RIGID_HULL display list
+
+	float mass;
+	glm::mat3 invInertia;			// in the body frame
+
+	glm::vec3 pos;					// center of mass
+	glm::quat rot;
+	glm::vec3 vel;
+	glm::vec3 omega;				// angular velocity, world frame
+
+	glm::vec3 force;				// what the fluid did to it last step
+	glm::vec3 torque;
+
+	int firstSample, numSamples;	// its part of bodySamples
+};
+
+// A convex hull read from an obj file, ready to be dropped any number of times:
+struct RigidHull
+{
+	std::vector<glm::vec4> planes;
+	std::vector<glm::vec3> samples;
+	float volume;
+	glm::mat3 inertia;				// about the centroid, for a density of 1
+	GLuint list;
+};
+
+std::vector<RigidBody> rigidBodies;
+std::vector<RigidHull *> rigidHulls;
+
+// the surface samples of all bodies, their owners and their body frame positions:
+std::vector<Particle> bodySamples;
+std::vector<int> bodySampleOwner;
+std::vector<glm::vec3> bodySampleLocal;
+IndexType bodyIndex(4093, r*2);
+
+static int nextBodyShape = 0;
+
+// --------------------------------------------------------------------
+// Mass per volume of the fluid at rest. The density of step( ) is the sum
+// of q^2 over the neighbors, which for particles spread evenly at n per unit
+// volume comes to n * 4 pi r^3 / 30.
+static inline float FluidMassDensity()
+{
+	const float volume = Dimension<3>::KernelVolume();
+	return rest_density * volume * 30.f / (4.f * glm::pi<float>() * r * r * r);
+}
+
+static inline float SampleGap()
+{
+	return r * 0.5f;
+}
+
+// --------------------------------------------------------------------
+static void SampleRectangle(std::vector<glm::vec3> &samples, const glm::vec3 &origin,
+	const glm::vec3 &u, const glm::vec3 &v, const float lenU, const float lenV)
+{
+	const int nu = glm::max((int)(lenU / SampleGap() + 0.5f), 1);
+	const int nv = glm::max((int)(lenV / SampleGap() + 0.5f), 1);
+	for (int i = 0; i <= nu; i++)
+		for (int j = 0; j <= nv; j++)
+			samples.push_back(origin + (lenU * i / (float)nu) * u + (lenV * j / (float)nv) * v);
+}
+
+static void SampleTriangle(std::vector<glm::vec3> &samples, const glm::vec3 &a, const glm::vec3 &b, const glm::vec3 &c)
+{
+	const float longest = glm::max(glm::length(b - a), glm::max(glm::length(c - b), glm::length(a - c)));
+	const int n = glm::max((int)ceilf(longest / SampleGap()), 1);
+	for (int i = 0; i <= n; i++)
+		for (int j = 0; i + j <= n; j++)
+			samples.push_back(a + (b - a) * (i / (float)n) + (c - a) * (j / (float)n));
+}
+
+// --------------------------------------------------------------------
+// The wallNeighbors of the particles point into bodySamples, so they go
+// whenever bodySamples is reallocated or emptied (the density pass finds
+// them again).
+static void ForgetBodyNeighbors()
+{
+	for (auto &particle : particles)
+		particle.wallNeighbors.clear();
+}
+
+static void IndexBodySamples()
+{
+	bodyIndex.Clear();
+	for (auto &sample : bodySamples)
+		bodyIndex.Insert(sample.pos, &sample);
+}
+
+// --------------------------------------------------------------------
+// Signed distance from a point in the body frame to the surface, and the
+// outward normal there.
+static inline float BodyDistance(const RigidBody &body, const glm::vec3 &p, glm::vec3 &normal)
+{
+	if (body.shape == RIGID_SPHERE)
+	{
+		const float len = glm::length(p);
+		normal = len > 0.f ? p / len : glm::vec3(0.f, 1.f, 0.f);
+		return len - body.half.x;
+	}
+
+	if (body.shape == RIGID_BOX)
+	{
+		const glm::vec3 q = glm::abs(p) - body.half;
+		const glm::vec3 s(p.x < 0.f ? -1.f : 1.f, p.y < 0.f ? -1.f : 1.f, p.z < 0.f ? -1.f : 1.f);
+		const glm::vec3 outside = glm::max(q, glm::vec3(0.f));
+		const float len = glm::length(outside);
+		if (len > 0.f)
+		{
+			normal = s * outside / len;
+			return len;
+		}
+
+		// inside: out through the nearest face
+		int axis = 0;
+		if (q.y > q[axis]) axis = 1;
+		if (q.z > q[axis]) axis = 2;
+		normal = glm::vec3(0.f);
+		normal[axis] = s[axis];
+		return q[axis];
+	}
+
+	// the hull: the farthest face plane (exact inside, a bit short at the
+	// edges and corners outside)
+	float dist = -1.e30f;
+	for (const glm::vec4 &plane : body.planes)
+	{
+		const float d = glm::dot(glm::vec3(plane), p) - plane.w;
+		if (d > dist)
+		{
+			dist = d;
+			normal = glm::vec3(plane);
+		}
+	}
+	return dist;
+}
+
+// --------------------------------------------------------------------
+// Add a body with the given body frame samples. relDensity is its density
+// relative to the fluid, volume and inertia are for a density of 1.
+static RigidBody *AddRigidBody(RigidBody body, const std::vector<glm::vec3> &samples,
+	const float volume, const glm::mat3 &inertia, const float relDensity)
+{
+	const float density = relDensity * FluidMassDensity();
+	body.mass = density * volume;
+	body.invInertia = glm::inverse(inertia * density);
+	body.rot = glm::quat(1.f, 0.f, 0.f, 0.f);
+	body.vel = body.omega = glm::vec3(0.f);
+	body.force = body.torque = glm::vec3(0.f);
+	body.firstSample = (int)bodySamples.size();
+	body.numSamples = (int)samples.size();
+
+	std::vector<Particle> added(samples.size());
+	for (int i = 0; i < (int)samples.size(); i++)
+	{
+		Particle &p = added[i];
+		p.pos = p.pos_old = body.pos + samples[i];
+		p.r = p.g = p.b = 0.f;
+		p.vel = glm::vec3(0.f);
+		p.force = glm::vec3(0.f);
+		p.mass = 1.f;
+		p.rho = p.rho_near = 0.f;
+		p.press = p.press_near = 0.f;
+		p.sigma = 3.f;
+		p.beta = 4.f;
+		p.r_density = rest_density;
+		p.dt = dT;
+		p.level = 0;
+		p.calmSteps = 0;
+		p.asleep = p.wakeUp = 0;
+	}
+
+	// psi of each sample, from the samples of its own body
+	IndexType local(1021, r*2);
+	for (auto &p : added)
+		local.Insert(p.pos, &p);
+	WeighWallSamples(&added[0], (int)added.size(), local);
+
+	bodySamples.insert(bodySamples.end(), added.begin(), added.end());
+	bodySampleLocal.insert(bodySampleLocal.end(), samples.begin(), samples.end());
+	bodySampleOwner.resize(bodySamples.size(), (int)rigidBodies.size());
+
+	rigidBodies.push_back(body);
+	IndexBodySamples();		// bodySamples may have moved
+	ForgetBodyNeighbors();
+	return &rigidBodies.back();
+}
+
+// --------------------------------------------------------------------
+RigidBody *AddRigidSphere(const glm::vec3 &center, const float radius, const float relDensity)
+{
+	const int n = glm::max((int)(4.f * glm::pi<float>() * radius * radius / (SampleGap() * SampleGap())), 12);
+	const float golden = glm::pi<float>() * (3.f - sqrtf(5.f));
+	std::vector<glm::vec3> samples;
+	for (int i = 0; i < n; i++)
+	{
+		const float y = 1.f - 2.f * (i + 0.5f) / (float)n;
+		const float ring = sqrtf(1.f - y * y);
+		samples.push_back(radius * glm::vec3(ring * cosf(golden * i), y, ring * sinf(golden * i)));
+	}
+
+	RigidBody body;
+	body.shape = RIGID_SPHERE;
+	body.half = glm::vec3(radius);
+	body.list = 0;
+	body.pos = center;
+	const float volume = (4.f / 3.f) * glm::pi<float>() * radius * radius * radius;
+	return AddRigidBody(body, samples, volume, glm::mat3(0.4f * volume * radius * radius), relDensity);
+}
+
+RigidBody *AddRigidBox(const glm::vec3 &center, const glm::vec3 &half, const float relDensity)
+{
+	const glm::vec3 X(1.f, 0.f, 0.f), Y(0.f, 1.f, 0.f), Z(0.f, 0.f, 1.f);
+	const glm::vec3 s = 2.f * half;
+	std::vector<glm::vec3> samples;
+	SampleRectangle(samples, -half, X, Z, s.x, s.z);
+	SampleRectangle(samples, glm::vec3(-half.x, half.y, -half.z), X, Z, s.x, s.z);
+	SampleRectangle(samples, -half, Y, Z, s.y, s.z);
+	SampleRectangle(samples, glm::vec3(half.x, -half.y, -half.z), Y, Z, s.y, s.z);
+	SampleRectangle(samples, -half, X, Y, s.x, s.y);
+	SampleRectangle(samples, glm::vec3(-half.x, -half.y, half.z), X, Y, s.x, s.y);
+
+	RigidBody body;
+	body.shape = RIGID_BOX;
+	body.half = half;
+	body.list = 0;
+	body.pos = center;
+	const float volume = s.x * s.y * s.z;
+	const glm::vec3 s2 = s * s;
+	glm::mat3 inertia(0.f);
+	inertia[0][0] = volume * (s2.y + s2.z) / 12.f;
+	inertia[1][1] = volume * (s2.x + s2.z) / 12.f;
+	inertia[2][2] = volume * (s2.x + s2.y) / 12.f;
+	return AddRigidBody(body, samples, volume, inertia, relDensity);
+}
+
+RigidBody *AddRigidHull(const RigidHull *hull, const glm::vec3 &center, const float relDensity)
+{
+	RigidBody body;
+	body.shape = RIGID_HULL;
+	body.half = glm::vec3(0.f);
+	body.planes = hull->planes;
+	body.list = hull->list;
+	body.pos = center;
+	return AddRigidBody(body, hull->samples, hull->volume, hull->inertia, relDensity);
+}
+
+// --------------------------------------------------------------------
+// Read a convex obj file, scaled, as a hull for the bodies. The faces are
+// taken to be the hull; a mesh that is not convex gets the intersection of
+// its face planes. The centroid is moved to the origin.
+// Returns NULL if the file cannot be read.
+RigidHull *LoadRigidHull(const char *file, const float scale)
+{
+	ObjMesh mesh;
+	if (ReadObjFile((char *)file, mesh) != 0 || mesh.NumTriangles() == 0)
+		return NULL;
+
+	// volume, centroid and second moments from the tetrahedra the faces
+	// make with the origin (the covariance method)
+	const glm::mat3 canonical = glm::mat3(2.f, 1.f, 1.f, 1.f, 2.f, 1.f, 1.f, 1.f, 2.f) * (1.f / 120.f);
+	float volume = 0.f;
+	glm::vec3 centroid(0.f);
+	glm::mat3 covariance(0.f);
+	for (int t = 0; t < mesh.NumTriangles(); t++)
+	{
+		const glm::vec3 a = MeshVertex(mesh, 3 * t + 0) * scale;
+		const glm::vec3 b = MeshVertex(mesh, 3 * t + 1) * scale;
+		const glm::vec3 c = MeshVertex(mesh, 3 * t + 2) * scale;
+		const float det = glm::dot(a, glm::cross(b, c));
+		const glm::mat3 A(a, b, c);
+		volume += det / 6.f;
+		centroid += (det / 24.f) * (a + b + c);
+		covariance += det * (A * canonical * glm::transpose(A));
+	}
+	if (fabs(volume) < 1.e-9f)
+		return NULL;
+
+	// faces wound the other way round
+	if (volume < 0.f)
+	{
+		volume = -volume;
+		centroid = -centroid;
+		covariance = -covariance;
+	}
+	centroid /= volume;
+	covariance -= volume * glm::outerProduct(centroid, centroid);
+
+	RigidHull *hull = new RigidHull();
+	hull->volume = volume;
+	hull->inertia = glm::mat3(covariance[0][0] + covariance[1][1] + covariance[2][2]) - covariance;
+
+	for (int t = 0; t < mesh.NumTriangles(); t++)
+	{
+		const glm::vec3 a = MeshVertex(mesh, 3 * t + 0) * scale - centroid;
+		const glm::vec3 b = MeshVertex(mesh, 3 * t + 1) * scale - centroid;
+		const glm::vec3 c = MeshVertex(mesh, 3 * t + 2) * scale - centroid;
+		SampleTriangle(hull->samples, a, b, c);
+
+		glm::vec3 n = glm::cross(b - a, c - a);
+		const float len = glm::length(n);
+		if (len <= 0.f)
+			continue;
+		n /= len;
+		if (glm::dot(n, a) < 0.f)
+			n = -n;		// the centroid is inside, so out is away from it
+
+		// coplanar triangles share one plane
+		bool known = false;
+		for (const glm::vec4 &plane : hull->planes)
+			known = known || (glm::dot(glm::vec3(plane), n) > 0.9999f && fabs(plane.w - glm::dot(n, a)) < 1.e-4f);
+		if (!known)
+			hull->planes.push_back(glm::vec4(n, glm::dot(n, a)));
+	}
+
+	hull->list = glGenLists(1);
+	glNewList(hull->list, GL_COMPILE);
+		glPushMatrix();
+		glScalef(scale, scale, scale);
+		glTranslatef(-centroid.x / scale, -centroid.y / scale, -centroid.z / scale);
+		DrawObjMesh(mesh);
+		glPopMatrix();
+	glEndList();
+
+	if (DebugOn != 0)
+		fprintf(stderr, "Rigid hull '%s': %d planes, %d samples, volume %.4f\n",
+			file, (int)hull->planes.size(), (int)hull->samples.size(), volume);
+
+	rigidHulls.push_back(hull);
+	return hull;
+}
+
+// --------------------------------------------------------------------
+// Drop the next kind of body (sphere, box, then each hull) above the pool.
+void DropRigidBody()
+{
+	const int kinds = 2 + (int)rigidHulls.size();
+	const int kind = nextBodyShape % kinds;
+
+	// (deterministic, the spot comes from the number of the drop)
+	const glm::vec3 u = useDeterministic ? CounterRandom3(nextBodyShape, 16) : glm::vec3(rand01(), 0.f, rand01());
+	const glm::vec3 at(SIM_W * (u.x - 0.5f), container_height - 0.3f, SIM_W * (u.z - 0.5f));
+	nextBodyShape++;
+	if (kind == 0)
+		AddRigidSphere(at, 0.12f, 0.5f);
+	else if (kind == 1)
+		AddRigidBox(at, glm::vec3(0.15f, 0.08f, 0.1f), 0.6f);
+	else
+		AddRigidHull(rigidHulls[kind - 2], at, 0.7f);
+	useRigidBodies = true;
+}
+
+void ClearRigidBodies()
+{
+	rigidBodies.clear();
+	bodySamples.clear();
+	bodySampleOwner.clear();
+	bodySampleLocal.clear();
+	bodyIndex.Clear();
+	nextBodyShape = 0;
+	ForgetBodyNeighbors();
+}
+
+// --------------------------------------------------------------------
+// The velocity of a point of body, r away from its center of mass:
+static inline glm::vec3 PointVelocity(const RigidBody &body, const glm::vec3 &r)
+{
+	return body.vel + glm::cross(body.omega, r);
+}
+
+// How much an impulse of 1 along n at r changes the velocity of that point along n:
+static inline float InverseMassAlong(const RigidBody &body, const glm::mat3 &invInertia, const glm::vec3 &r, const glm::vec3 &n)
+{
+	return 1.f / body.mass + glm::dot(n, glm::cross(invInertia * glm::cross(r, n), r));
+}
+
+static inline void ApplyImpulse(RigidBody &body, const glm::mat3 &invInertia, const glm::vec3 &r, const glm::vec3 &impulse)
+{
+	body.vel += impulse / body.mass;
+	body.omega += invInertia * glm::cross(r, impulse);
+}
+
+// Change the velocity of the point at r by dv along n (dv > 0), with
+// Coulomb friction against what is left of its sliding velocity vt.
+static inline void PushPoint(RigidBody &body, const glm::mat3 &invInertia, const glm::vec3 &r,
+	const glm::vec3 &n, const float dv, const glm::vec3 &vt)
+{
+	const float j = dv / InverseMassAlong(body, invInertia, r, n);
+	ApplyImpulse(body, invInertia, r, j * n);
+
+	const float slide = glm::length(vt);
+	if (slide > 1.e-9f)
+	{
+		const glm::vec3 t = vt / slide;
+		const float jt = glm::min(slide / InverseMassAlong(body, invInertia, r, t), rigidFriction * j);
+		ApplyImpulse(body, invInertia, r, -jt * t);
+	}
+}
+
+// --------------------------------------------------------------------
+// Keep the bodies out of the walls (and whatever else
+// ProjectContainerBoundaries( ) knows about) and out of each other, by
+// changing their velocities so that no sample ends this step in a wall or
+// closer than SampleGap( ) to a sample of another body.
+static void ResolveRigidContacts(const float dt, std::vector<glm::mat3> &invInertia)
+{
+	const float gap = SampleGap();
+	for (int iter = 0; iter < rigidContactIterations; iter++)
+	{
+		// walls
+		for (int b = 0; b < (int)rigidBodies.size(); b++)
+		{
+			RigidBody &body = rigidBodies[b];
+			for (int s = body.firstSample; s < body.firstSample + body.numSamples; s++)
+			{
+				const glm::vec3 arm = bodySamples[s].pos - body.pos;
+				const glm::vec3 v = PointVelocity(body, arm);
+				const glm::vec3 next = bodySamples[s].pos + v * dt;
+				glm::vec3 allowed = next;
+				ProjectContainerBoundaries(allowed, bodySamples[s].pos);
+
+				const glm::vec3 push = allowed - next;
+				const float depth = glm::length(push);
+				if (depth < 1.e-7f)
+					continue;
+				const glm::vec3 n = push / depth;
+				PushPoint(body, invInertia[b], arm, n, depth / dt, v - glm::dot(v, n) * n);
+			}
+		}
+
+		// each other: every pair of samples closer than the gap is seen by
+		// the body with the lower index
+		for (int b = 0; b < (int)rigidBodies.size() && rigidBodies.size() > 1; b++)
+		{
+			RigidBody &body = rigidBodies[b];
+			for (int s = body.firstSample; s < body.firstSample + body.numSamples; s++)
+			{
+				ScratchArena::Scope scratch(ThreadArena());
+				IndexType::NeighborList neigh = IndexType::MakeNeighborList();
+				bodyIndex.Neighbors(bodySamples[s].pos, neigh);
+				for (int j = 0; j < (int)neigh.size(); j++)
+				{
+					const int t = (int)(neigh[j] - &bodySamples[0]);
+					const int o = bodySampleOwner[t];
+					if (o <= b)
+						continue;
+					RigidBody &other = rigidBodies[o];
+
+					const glm::vec3 d = bodySamples[s].pos - bodySamples[t].pos;
+					const float len = glm::length(d);
+					if (len >= gap || len <= 0.f)
+						continue;
+					const glm::vec3 n = d / len;
+
+					const glm::vec3 armA = bodySamples[s].pos - body.pos;
+					const glm::vec3 armB = bodySamples[t].pos - other.pos;
+					const glm::vec3 vRel = PointVelocity(body, armA) - PointVelocity(other, armB);
+					const float dv = (gap - len) / dt - glm::dot(vRel, n);
+					if (dv <= 0.f)
+						continue;
+
+					const float k = InverseMassAlong(body, invInertia[b], armA, n) + InverseMassAlong(other, invInertia[o], armB, n);
+					const float jn = dv / k;
+					ApplyImpulse(body, invInertia[b], armA, jn * n);
+					ApplyImpulse(other, invInertia[o], armB, -jn * n);
+
+					const glm::vec3 vt = vRel - glm::dot(vRel, n) * n;
+					const float slide = glm::length(vt);
+					if (slide > 1.e-9f)
+					{
+						const glm::vec3 tdir = vt / slide;
+						const float kt = InverseMassAlong(body, invInertia[b], armA, tdir) + InverseMassAlong(other, invInertia[o], armB, tdir);
+						const float jt = glm::min(slide / kt, rigidFriction * jn);
+						ApplyImpulse(body, invInertia[b], armA, -jt * tdir);
+						ApplyImpulse(other, invInertia[o], armB, jt * tdir);
+					}
+				}
+			}
+		}
+	}
+}
+
+// --------------------------------------------------------------------
+// Move the samples with their bodies and put them into bodyIndex.
+static void UpdateBodySamples()
+{
+	for (int b = 0; b < (int)rigidBodies.size(); b++)
+	{
+		const RigidBody &body = rigidBodies[b];
+		const glm::mat3 R = glm::mat3_cast(body.rot);
+		for (int s = body.firstSample; s < body.firstSample + body.numSamples; s++)
+		{
+			Particle &sample = bodySamples[s];
+			const glm::vec3 arm = R * bodySampleLocal[s];
+			sample.pos_old = sample.pos;
+			sample.pos = body.pos + arm;
+			sample.vel = PointVelocity(body, arm);
+		}
+	}
+	IndexBodySamples();
+}
+
+// --------------------------------------------------------------------
+// Integrate the bodies over dt with the fluid forces of the last step and
+// gravity, resolve their contacts and move their samples.
+// (call once per step, outside of any parallel region)
+void AdvanceRigidBodies(const float dt)
+{
+	if (rigidBodies.empty())
+		return;
+
+	std::vector<glm::mat3> invInertia(rigidBodies.size());
+
+	for (int b = 0; b < (int)rigidBodies.size(); b++)
+	{
+		RigidBody &body = rigidBodies[b];
+		const glm::mat3 R = glm::mat3_cast(body.rot);
+		invInertia[b] = R * body.invInertia * glm::transpose(R);
+
+		glm::vec3 acc = body.force / body.mass;
+		if (useGravity)
+			acc.y -= ::G;
+		body.vel += acc * dt;
+
+		// Euler's equations, with the gyroscopic term
+		const glm::vec3 L = glm::inverse(invInertia[b]) * body.omega;
+		body.omega += invInertia[b] * (body.torque - glm::cross(body.omega, L)) * dt;
+
+		// the fluid viscosity does not reach the bodies, so this stands in for it
+		body.vel *= 1.f - rigidDamping;
+		body.omega *= 1.f - rigidDamping;
+	}
+
+	ResolveRigidContacts(dt, invInertia);
+
+	for (auto &body : rigidBodies)
+	{
+		body.pos += body.vel * dt;
+		const glm::quat spin(0.f, body.omega.x, body.omega.y, body.omega.z);
+		body.rot = glm::normalize(body.rot + (0.5f * dt) * (spin * body.rot));
+		body.force = body.torque = glm::vec3(0.f);
+	}
+
+	UpdateBodySamples();
+}
+
+// --------------------------------------------------------------------
+// Keep pos out of the bodies whose samples are around it, colliderMargin
+// away from their surfaces.
+static inline void CollideWithBodies(glm::vec3 &pos)
+{
+	ScratchArena::Scope scratch(ThreadArena());
+	IndexType::NeighborList neigh = IndexType::MakeNeighborList();
+	bodyIndex.Neighbors(pos, neigh);
+
+	int done[4] = {-1, -1, -1, -1};
+	for (int j = 0; j < (int)neigh.size(); j++)
+	{
+		const int o = bodySampleOwner[neigh[j] - &bodySamples[0]];
+		if (o == done[0] || o == done[1] || o == done[2] || o == done[3])
+			continue;
+		done[3] = done[2]; done[2] = done[1]; done[1] = done[0]; done[0] = o;
+
+		const RigidBody &body = rigidBodies[o];
+		const glm::quat inv = glm::conjugate(body.rot);
+		const glm::vec3 p = inv * (pos - body.pos);
+		glm::vec3 normal;
+		const float dist = BodyDistance(body, p, normal);
+		if (dist < colliderMargin)
+			pos = body.pos + body.rot * (p + (colliderMargin - dist) * normal);
+	}
+}
+
+void CollideParticlesWithBodies()
+{
+	if (rigidBodies.empty())
+		return;
+
+	#pragma omp parallel for
+	for (auto &particle : particles)
+	{
+		if (particle.asleep)
+			continue;
+		CollideWithBodies(particle.pos);
+	}
+}
+
+// --------------------------------------------------------------------
+// The push of the fluid on every sample, the mirror image of
+// WallPressureDisplacement( ), summed into the forces and torques of the
+// bodies. Sleepers in extra are woken by samples that move.
+// (call when the pressures of the step are done)
+void GatherBodyForces(const IndexType *extra)
+{
+	if (rigidBodies.empty())
+		return;
+
+	const float wakeVel2 = sleepVelocity * sleepVelocity;
+	const int n = (int)bodySamples.size();
+
+	#pragma omp parallel for
+	for (int s = 0; s < n; s++)
+	{
+		Particle &sample = bodySamples[s];
+		const bool moving = glm::dot(sample.vel, sample.vel) >= wakeVel2;
+
+		ScratchArena::Scope scratch(ThreadArena());
+		IndexType::NeighborList neigh = IndexType::MakeNeighborList();
+		indexsp.Neighbors(sample.pos, neigh);
+		if (extra != NULL)
+			extra->Neighbors(sample.pos, neigh);
+
+		glm::vec3 f(0.f);
+		for (int j = 0; j < (int)neigh.size(); j++)
+		{
+			Particle &fluid = *neigh[j];
+			const glm::vec3 rij = sample.pos - fluid.pos;
+			const float len2 = glm::dot(rij, rij);
+			if (len2 >= rsq || len2 <= 0.f)
+				continue;
+
+			if (fluid.asleep && moving)
+			{
+				#pragma omp atomic write
+				fluid.wakeUp = 1;
+			}
+
+			float len;
+			const float q = KernelQ(len2, len);
+			const float psi = sample.mass / fluid.mass;
+			const float press = glm::max(fluid.press, 0.f);
+			f += (rij / len) * (psi * (q * 2.f * press + q * q * 2.f * fluid.press_near));
+		}
+		sample.force = f;
+	}
+
+	for (auto &body : rigidBodies)
+	{
+		for (int s = body.firstSample; s < body.firstSample + body.numSamples; s++)
+		{
+			body.force += bodySamples[s].force;
+			body.torque += glm::cross(bodySamples[s].pos - body.pos, bodySamples[s].force);
+		}
+	}
+}
+
+// --------------------------------------------------------------------
+void DrawRigidBodies()
+{
+	for (const auto &body : rigidBodies)
+	{
+		glPushMatrix();
+		glTranslatef(body.pos.x, body.pos.y, body.pos.z);
+		glMultMatrixf(glm::value_ptr(glm::mat4_cast(body.rot)));
+		if (body.shape == RIGID_SPHERE)
+		{
+			OsuSphere(body.half.x, 24, 24);
+		}
+		else if (body.shape == RIGID_BOX)
+		{
+			glScalef(2.f * body.half.x, 2.f * body.half.y, 2.f * body.half.z);
+			glutSolidCube(1.);
+		}
+		else
+		{
+			glCallList(body.list);
+		}
+		glPopMatrix();
+	}
+}
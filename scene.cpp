@@ -0,0 +1,893 @@
+// --------------------------------------------------------------------
+// Scene files
+//
+// -scene file.json takes the parameters, emitters, colliders and output
+// settings from a JSON file, and keeps watching it (inotify on Linux, its
+// modification time elsewhere): when the file is saved again, UpdateScene( )
+// applies it at the next step boundary. Only what a change affects is
+// rebuilt:
+//	- a new r re-sizes the spatial indices and the kernel table and
+//	  re-seeds the 2D slice,
+//	- new world or container geometry (or r) bumps worldVersion, so the
+//	  boundary samples and the collider grid are rebuilt before they are
+//	  used next (and a new SIM_W redraws the floor grids),
+//	- new colliders are loaded in place of the old ones,
+//	- new emitters (or N) pour the particles again,
+//	- and everything else is just assigned.
+// A key left out keeps its value, except where the compiled defaults derive
+// one value from another (k, k_near and r from spacing, the top and width
+// of the container from its height and SIM_W): those follow along unless
+// the file gives them too. A file that does not parse, has a spacing, r
+// or SIM_W that is not positive, or a parameter outside the range of its
+// spinner (or of what makes sense, for the ones without), is reported and
+// not applied.
+//
+//	{
+//		"parameters": { "spacing": 0.07, "dT": 1.2, "rest_density": 3.5, "solver": "double_density",
+//		                "gravity": true, ... any name of sceneFloats[ ], sceneInts[ ] or sceneToggles[ ] },
+//		"container":  { "height": 1.5, "top": 3.5, "width": 0.4, "opening_width": 0.2 },
+//		"emitters":   [ { "shape": "column", "base": [0, 0.1, 0], "radius": 0.2, "top": 5, "count": 500 },
+//		                { "shape": "box", "lo": [-0.3, 2, -0.3], "hi": [0.3, 2.5, 0.3], "gap": 0.04 } ],
+//		"colliders":  [ { "type": "mesh", "file": "bowl.obj", "offset": [0, 0, 0], "scale": 1 },
+//		                { "type": "sphere", "center": [0, 0.6, 0], "radius": 0.1, "density": 0.5 },
+//		                { "type": "box", "center": [0.2, 0.6, 0], "half": [0.1, 0.05, 0.1], "density": 0.6 },
+//		                { "type": "hull", "file": "gem.obj", "center": [0, 0.8, 0], "scale": 1, "density": 0.7 } ],
+//		"output":     { "trajectory": "run.sphtraj", "record": true, "trajectory_bits": 12,
+//		                "export": "vtp", "export_dir": "export", "checkpoint": "run.ckpt" }
+//	}
+//
+// Without "N" the particle count is what the emitters make. The colliders
+// replace the meshes given on the command line only once the file has a
+// "colliders" section.
+
+const char *sceneFile = NULL;
+
+// --------------------------------------------------------------------
+// just enough JSON for scene files
+struct JsonValue
+{
+	enum Type { JSON_NULL, JSON_BOOL, JSON_NUMBER, JSON_STRING, JSON_ARRAY, JSON_OBJECT };
+
+	Type type;
+	double number;			// also 0 or 1 for a bool
+	std::string string;
+	std::vector<JsonValue> items;								// of an array
+	std::vector<std::pair<std::string, JsonValue> > members;	// of an object, in file order
+
+	JsonValue() : type(JSON_NULL), number(0.) {}
+
+	// the member called key of an object, or NULL
+	const JsonValue *Find(const char *key) const
+	{
+		for (const auto &member : members)
+			if (member.first == key)
+				return &member.second;
+		return NULL;
+	}
+
+	// back to (compact) text, to tell whether two values are the same
+	void Write(std::string &out) const
+	{
+		switch (type)
+		{
+		case JSON_NULL:		out += "null";	break;
+		case JSON_BOOL:		out += number != 0. ? "true" : "false";	break;
+		case JSON_NUMBER:
+		{
+			char text[32];
+			snprintf(text, sizeof(text), "%.17g", number);
+			out += text;
+			break;
+		}
+		case JSON_STRING:	out += '"' + string + '"';	break;
+		case JSON_ARRAY:
+			out += '[';
+			for (size_t i = 0; i < items.size(); i++)
+			{
+				if (i > 0)
+					out += ',';
+				items[i].Write(out);
+			}
+			out += ']';
+			break;
+		case JSON_OBJECT:
+			out += '{';
+			for (size_t i = 0; i < members.size(); i++)
+			{
+				if (i > 0)
+					out += ',';
+				out += '"' + members[i].first + "\":";
+				members[i].second.Write(out);
+			}
+			out += '}';
+			break;
+		}
+	}
+};
+
+class JsonParser
+{
+public:
+	JsonParser(const char *text) : mText(text), mAt(text), mError(NULL) {}
+
+	bool Parse(JsonValue &value)
+	{
+		if (!Value(value, 0))
+			return false;
+		SkipSpace();
+		return *mAt == '\0' || Fail("text after the end");
+	}
+
+	// what went wrong, and on which line
+	const char *Error() const
+	{
+		return mError != NULL ? mError : "";
+	}
+
+	int Line() const
+	{
+		return 1 + (int)std::count(mText, mAt, '\n');
+	}
+
+private:
+	bool Fail(const char *error)
+	{
+		mError = error;
+		return false;
+	}
+
+	void SkipSpace()
+	{
+		while (*mAt == ' ' || *mAt == '\t' || *mAt == '\n' || *mAt == '\r')
+			mAt++;
+	}
+
+	bool Literal(const char *word)
+	{
+		const size_t len = strlen(word);
+		if (strncmp(mAt, word, len) != 0)
+			return Fail("unknown word");
+		mAt += len;
+		return true;
+	}
+
+	bool String(std::string &out)
+	{
+		mAt++;		// the opening quote
+		out.clear();
+		while (*mAt != '"')
+		{
+			if (*mAt == '\0' || *mAt == '\n')
+				return Fail("string not closed");
+			if (*mAt != '\\')
+			{
+				out += *mAt++;
+				continue;
+			}
+			mAt++;
+			switch (*mAt)
+			{
+			case '"':	out += '"';		break;
+			case '\\':	out += '\\';	break;
+			case '/':	out += '/';		break;
+			case 'b':	out += '\b';	break;
+			case 'f':	out += '\f';	break;
+			case 'n':	out += '\n';	break;
+			case 'r':	out += '\r';	break;
+			case 't':	out += '\t';	break;
+			case 'u':
+			{
+				// (only ASCII is of any use in a scene file)
+				unsigned int code = 0;
+				for (int d = 1; d <= 4; d++)
+				{
+					if (!isxdigit(mAt[d]))
+						return Fail("bad \\u escape");
+					code = code * 16 + (isdigit(mAt[d]) ? mAt[d] - '0' : (tolower(mAt[d]) - 'a' + 10));
+				}
+				out += code < 128 ? (char)code : '?';
+				mAt += 4;
+				break;
+			}
+			default:
+				return Fail("bad escape");
+			}
+			mAt++;
+		}
+		mAt++;		// the closing quote
+		return true;
+	}
+
+	bool Value(JsonValue &value, const int depth)
+	{
+		if (depth > 64)
+			return Fail("nested too deeply");
+		SkipSpace();
+		value = JsonValue();
+		switch (*mAt)
+		{
+		case '{':
+			value.type = JsonValue::JSON_OBJECT;
+			mAt++;
+			SkipSpace();
+			if (*mAt == '}')
+			{
+				mAt++;
+				return true;
+			}
+			for (;;)
+			{
+				SkipSpace();
+				if (*mAt != '"')
+					return Fail("expected a key");
+				std::pair<std::string, JsonValue> member;
+				if (!String(member.first))
+					return false;
+				SkipSpace();
+				if (*mAt++ != ':')
+					return Fail("expected ':'");
+				if (!Value(member.second, depth + 1))
+					return false;
+				value.members.push_back(member);
+				SkipSpace();
+				if (*mAt == '}')
+				{
+					mAt++;
+					return true;
+				}
+				if (*mAt++ != ',')
+					return Fail("expected ',' or '}'");
+			}
+
+		case '[':
+			value.type = JsonValue::JSON_ARRAY;
+			mAt++;
+			SkipSpace();
+			if (*mAt == ']')
+			{
+				mAt++;
+				return true;
+			}
+			for (;;)
+			{
+				JsonValue item;
+				if (!Value(item, depth + 1))
+					return false;
+				value.items.push_back(item);
+				SkipSpace();
+				if (*mAt == ']')
+				{
+					mAt++;
+					return true;
+				}
+				if (*mAt++ != ',')
+					return Fail("expected ',' or ']'");
+			}
+
+		case '"':
+			value.type = JsonValue::JSON_STRING;
+			return String(value.string);
+
+		case 't':
+			value.type = JsonValue::JSON_BOOL;
+			value.number = 1.;
+			return Literal("true");
+
+		case 'f':
+			value.type = JsonValue::JSON_BOOL;
+			return Literal("false");
+
+		case 'n':
+			return Literal("null");
+
+		default:
+		{
+			char *end;
+			value.type = JsonValue::JSON_NUMBER;
+			value.number = strtod(mAt, &end);
+			if (end == mAt || !(*mAt == '-' || isdigit(*mAt)))
+				return Fail("expected a value");
+			mAt = end;
+			return true;
+		}
+		}
+	}
+
+	const char *mText;
+	const char *mAt;
+	const char *mError;
+};
+
+// --------------------------------------------------------------------
+// Read key of object (which may be NULL) into value. Return true only if
+// that changed value; a key that is not there, or not the right type,
+// leaves it alone.
+static bool SceneFloat(const JsonValue *object, const char *key, float &value)
+{
+	const JsonValue *v = object != NULL ? object->Find(key) : NULL;
+	if (v == NULL)
+		return false;
+	if (v->type != JsonValue::JSON_NUMBER)
+	{
+		fprintf(stderr, "Scene: '%s' should be a number\n", key);
+		return false;
+	}
+	const float f = (float)v->number;
+	if (f == value)
+		return false;
+	value = f;
+	return true;
+}
+
+// (ints take bools as well, for the toggles)
+static bool SceneInt(const JsonValue *object, const char *key, int &value)
+{
+	const JsonValue *v = object != NULL ? object->Find(key) : NULL;
+	if (v == NULL)
+		return false;
+	if (v->type != JsonValue::JSON_NUMBER && v->type != JsonValue::JSON_BOOL)
+	{
+		fprintf(stderr, "Scene: '%s' should be a number\n", key);
+		return false;
+	}
+	const int i = (int)v->number;
+	if (i == value)
+		return false;
+	value = i;
+	return true;
+}
+
+// False (after saying so) if key of object is a number outside [lo, hi].
+static bool SceneInRange(const JsonValue *object, const char *key, const double lo, const double hi)
+{
+	const JsonValue *v = object != NULL ? object->Find(key) : NULL;
+	// (a NaN fails every comparison)
+	if (v == NULL || v->type != JsonValue::JSON_NUMBER || (v->number >= lo && v->number <= hi))
+		return true;
+	if (hi >= INT_MAX)
+		fprintf(stderr, "Scene: '%s' should be at least %g\n", key, lo);
+	else
+		fprintf(stderr, "Scene: '%s' should be from %g to %g\n", key, lo, hi);
+	return false;
+}
+
+static bool SceneVec3(const JsonValue *object, const char *key, glm::vec3 &value)
+{
+	const JsonValue *v = object != NULL ? object->Find(key) : NULL;
+	if (v == NULL)
+		return false;
+	if (v->type != JsonValue::JSON_ARRAY || v->items.size() != 3 ||
+		v->items[0].type != JsonValue::JSON_NUMBER || v->items[1].type != JsonValue::JSON_NUMBER ||
+		v->items[2].type != JsonValue::JSON_NUMBER)
+	{
+		fprintf(stderr, "Scene: '%s' should be [x, y, z]\n", key);
+		return false;
+	}
+	const glm::vec3 f((float)v->items[0].number, (float)v->items[1].number, (float)v->items[2].number);
+	if (f == value)
+		return false;
+	value = f;
+	return true;
+}
+
+static bool SceneString(const JsonValue *object, const char *key, std::string &value)
+{
+	const JsonValue *v = object != NULL ? object->Find(key) : NULL;
+	if (v == NULL)
+		return false;
+	if (v->type != JsonValue::JSON_STRING)
+	{
+		fprintf(stderr, "Scene: '%s' should be a string\n", key);
+		return false;
+	}
+	if (v->string == value)
+		return false;
+	value = v->string;
+	return true;
+}
+
+// the parameters that need nothing rebuilt, and the values they may take
+// (the limits of their spinners, where they have one)
+static const float ABOVE_0 = FLT_MIN;
+
+static const struct { const char *name; float *value; float lo, hi; } sceneFloats[] =
+{
+	{"G", &::G, 0.f, 0.0006f}, {"rest_density", &rest_density, 1.f, 15.f}, {"dT", &dT, 0.05f, 1.6f},
+	{"mass", &mass, 0.1f, 5.f}, {"p_size", &p_size, ABOVE_0, FLT_MAX},
+	{"frameDT", &frameDT, 0.3f, 10.f}, {"minDT", &minDT, ABOVE_0, FLT_MAX}, {"maxDT", &maxDT, ABOVE_0, FLT_MAX},
+	{"cfl", &cflNumber, ABOVE_0, FLT_MAX}, {"force_number", &forceNumber, ABOVE_0, FLT_MAX},
+	{"pbfDT", &pbfDT, 0.05f, 10.f}, {"pbf_relaxation", &pbfRelaxation, ABOVE_0, FLT_MAX}, {"pbf_xsph", &pbfXSPH, 0.f, 1.f},
+	{"iisphDT", &iisphDT, 0.05f, 30.f}, {"iisph_tolerance", &iisphTolerance, 0.0001f, 0.1f},
+	{"iisph_omega", &iisphOmega, ABOVE_0, 1.f},
+	{"sleep_velocity", &sleepVelocity, 0.f, FLT_MAX}, {"sleep_density_error", &sleepDensityError, 0.f, FLT_MAX},
+	{"collider_margin", &colliderMargin, 0.f, FLT_MAX}, {"rigid_friction", &rigidFriction, 0.f, FLT_MAX},
+	{"rigid_damping", &rigidDamping, 0.f, 1.f},
+	{"watchdog_backoff", &watchdogBackoff, ABOVE_0, 1.f}, {"watchdog_max_travel", &watchdogMaxTravel, ABOVE_0, FLT_MAX},
+	{"watchdog_max_density_error", &watchdogMaxDensityError, ABOVE_0, FLT_MAX},
+};
+
+static const struct { const char *name; int *value; int lo, hi; } sceneInts[] =
+{
+	{"pbf_iterations", &pbfIterations, 1, 20}, {"iisph_max_iterations", &iisphMaxIterations, 2, 200},
+	{"max_substeps", &maxSubsteps, 1, INT_MAX}, {"max_local_level", &maxLocalLevel, 0, 6},
+	{"sleep_steps", &sleepSteps, 1, INT_MAX}, {"rigid_contact_iterations", &rigidContactIterations, 1, INT_MAX},
+	{"kernel_table_size", &kernelTableSize, 64, 65536},
+	{"watchdog_interval", &watchdogInterval, 1, 1000}, {"watchdog_snapshots", &watchdogSnapshots, 1, INT_MAX},
+	{"watchdog_retries", &watchdogRetries, 1, INT_MAX},
+};
+
+// the check boxes (the ones that change the geometry rebuild it themselves)
+static const struct { const char *name; int *value; } sceneToggles[] =
+{
+	{"gravity", &useGravity}, {"external_force", &externalForce}, {"shrink_world", &shrinkWorld},
+	{"opening", &useOpening}, {"fused_pass", &useFusedPass}, {"adaptive_dt", &useAdaptiveDT},
+	{"local_dt", &useLocalDT}, {"sleeping", &useSleeping}, {"boundary_particles", &useBoundaryParticles},
+	{"sdf_colliders", &useColliders}, {"kernel_table", &useKernelTable}, {"deterministic", &useDeterministic},
+	{"diagnostics", &useDiagnostics}, {"watchdog", &useWatchdog},
+};
+
+// --------------------------------------------------------------------
+// the emitters of the "emitters" section, false if one is not usable
+static bool ReadSceneEmitters(const JsonValue *section, std::vector<ParticleEmitter> &out)
+{
+	out.clear();
+	if (section == NULL)
+		return true;
+	if (section->type != JsonValue::JSON_ARRAY)
+	{
+		fprintf(stderr, "Scene: 'emitters' should be a list\n");
+		return false;
+	}
+	for (const JsonValue &item : section->items)
+	{
+		// the defaults are the column of initParticles( )
+		ParticleEmitter e = ParticleEmitter();
+		e.shape = EMIT_COLUMN;
+		e.base = glm::vec3(0.f, bottom + 0.1f, 0.f);
+		e.radius = i_girth * 0.2f;
+		e.top = 5.f;
+		e.count = (unsigned int)-1;
+
+		std::string shape = "column";
+		int count = -1;
+		SceneString(&item, "shape", shape);
+		SceneVec3(&item, "base", e.base);
+		SceneFloat(&item, "radius", e.radius);
+		SceneFloat(&item, "top", e.top);
+		SceneVec3(&item, "lo", e.lo);
+		SceneVec3(&item, "hi", e.hi);
+		SceneFloat(&item, "gap", e.gap);
+		SceneInt(&item, "count", count);
+		if (count >= 0)
+			e.count = (unsigned int)count;
+
+		if (shape == "box")
+			e.shape = EMIT_BOX;
+		else if (shape != "column")
+		{
+			fprintf(stderr, "Scene: an emitter is a \"column\" or a \"box\", not a \"%s\"\n", shape.c_str());
+			return false;
+		}
+		if (e.gap < 0.f)
+		{
+			fprintf(stderr, "Scene: an emitter has a negative gap\n");
+			return false;
+		}
+		out.push_back(e);
+	}
+	return true;
+}
+
+// Put the meshes and bodies of the "colliders" section in place of the
+// ones there are.
+static void LoadSceneColliders(const JsonValue *section)
+{
+	// the hulls stay loaded (DropRigidBody( ) takes turns with them), so a
+	// hull the scene had before is not read again
+	static std::unordered_map<std::string, RigidHull *> hulls;
+
+	ClearMeshColliders();
+	ClearRigidBodies();
+	if (section != NULL && section->type == JsonValue::JSON_ARRAY)
+	{
+		for (const JsonValue &item : section->items)
+		{
+			std::string type, file;
+			glm::vec3 at(0.f), half(0.1f);
+			float scale = 1.f, radius = 0.1f, density = 0.5f;
+			SceneString(&item, "type", type);
+			SceneString(&item, "file", file);
+			SceneVec3(&item, "offset", at);
+			SceneVec3(&item, "center", at);
+			SceneVec3(&item, "half", half);
+			SceneFloat(&item, "scale", scale);
+			SceneFloat(&item, "radius", radius);
+			SceneFloat(&item, "density", density);
+
+			if (type == "mesh")
+			{
+				if (LoadMeshCollider(file.c_str(), at, scale) == NULL)
+					fprintf(stderr, "Cannot use '%s' as a mesh collider\n", file.c_str());
+			}
+			else if (type == "sphere")
+				AddRigidSphere(at, radius, density);
+			else if (type == "box")
+				AddRigidBox(at, half, density);
+			else if (type == "hull")
+			{
+				const std::string key = file + "@" + std::to_string(scale);
+				if (hulls.find(key) == hulls.end())
+					hulls[key] = LoadRigidHull(file.c_str(), scale);
+				if (hulls[key] != NULL)
+					AddRigidHull(hulls[key], at, density);
+				else
+					fprintf(stderr, "Cannot use '%s' as a rigid body\n", file.c_str());
+			}
+			else
+				fprintf(stderr, "Scene: a collider is a \"mesh\", \"sphere\", \"box\" or \"hull\", not a \"%s\"\n", type.c_str());
+		}
+	}
+	else if (section != NULL)
+		fprintf(stderr, "Scene: 'colliders' should be a list\n");
+
+	useMeshColliders = !meshColliders.empty();
+	useRigidBodies = !rigidBodies.empty();
+}
+
+// the names the output settings point to
+static std::string sceneTrajectoryFile, sceneExportDir, sceneCheckpointFile;
+
+static void ApplySceneOutput(const JsonValue *output)
+{
+	if (output == NULL)
+		return;
+
+	if (SceneString(output, "trajectory", sceneTrajectoryFile))
+	{
+		// a recording goes on in the new file
+		const int recording = recordTrajectory;
+		recordTrajectory = false;
+		RecordTrajectoryFrame();
+		trajectoryFile = sceneTrajectoryFile.c_str();
+		recordTrajectory = recording;
+	}
+	SceneInt(output, "record", recordTrajectory);
+	SceneInt(output, "trajectory_bits", trajectoryBits);
+	SceneInt(output, "key_interval", trajectoryKeyInterval);
+
+	if (SceneString(output, "export_dir", sceneExportDir))
+	{
+		// the exporter thread reads exportDir, so it is stopped first
+		const int exporting = exportFrames;
+		exportFrames = false;
+		ExportParticleFrame();
+		exportDir = sceneExportDir.c_str();
+		exportFrames = exporting;
+	}
+	std::string format;
+	if (SceneString(output, "export", format))
+	{
+		static const char *formats[] = {"vtk", "vtp", "ply", "bgeo"};
+		exportFrames = false;
+		for (int f = 0; f <= EXPORT_BGEO; f++)
+		{
+			if (format == formats[f])
+			{
+				exportFormat = f;
+				exportFrames = true;
+			}
+		}
+	}
+	SceneInt(output, "export_rho", exportRho);
+	SceneInt(output, "export_press", exportPress);
+	SceneInt(output, "export_vel", exportVel);
+
+	if (SceneString(output, "checkpoint", sceneCheckpointFile))
+		checkpointFile = sceneCheckpointFile.c_str();
+	SceneInt(output, "io_uring", useIoUring);
+	SceneInt(output, "direct_io", useDirectIO);
+}
+
+// --------------------------------------------------------------------
+// Apply a parsed scene, rebuilding what it changes. False (and nothing
+// applied) if it is not usable.
+bool ApplyScene(const JsonValue &scene)
+{
+	if (scene.type != JsonValue::JSON_OBJECT)
+	{
+		fprintf(stderr, "Scene: the file should hold an object\n");
+		return false;
+	}
+	const JsonValue *params = scene.Find("parameters");
+	const JsonValue *container = scene.Find("container");
+
+	// the geometry, into locals first so a bad file changes nothing
+	float newSpacing = spacing, newSIM_W = SIM_W, newBottom = bottom, newGirth = i_girth;
+	SceneFloat(params, "spacing", newSpacing);
+	float newK = newSpacing / 1000.0f;
+	SceneFloat(params, "k", newK);
+	float newKNear = newK * 10.f;
+	SceneFloat(params, "k_near", newKNear);
+	float newR = newSpacing * 1.25f;
+	SceneFloat(params, "r", newR);
+	SceneFloat(params, "SIM_W", newSIM_W);
+	SceneFloat(params, "bottom", newBottom);
+	SceneFloat(params, "i_girth", newGirth);
+	if (!(newSpacing > 0.f) || !(newR > 0.f) || !(newSIM_W > 0.f))
+	{
+		fprintf(stderr, "Scene: spacing, r and SIM_W have to be positive\n");
+		return false;
+	}
+	bool inRange = SceneInRange(params, "N", 0, INT_MAX);
+	for (const auto &p : sceneFloats)
+		inRange = SceneInRange(params, p.name, p.lo, p.hi) && inRange;
+	for (const auto &p : sceneInts)
+		inRange = SceneInRange(params, p.name, p.lo, p.hi) && inRange;
+	const JsonValue *output = scene.Find("output");
+	inRange = SceneInRange(output, "trajectory_bits", 4, 16) && inRange;
+	inRange = SceneInRange(output, "key_interval", 1, INT_MAX) && inRange;
+	if (!inRange)
+		return false;
+
+	float newHeight = container_height, newOpening = opening_width;
+	SceneFloat(container, "height", newHeight);
+	float newTop = newHeight + 2.0f;
+	SceneFloat(container, "top", newTop);
+	float newWidth = newSIM_W / 2;
+	SceneFloat(container, "width", newWidth);
+	SceneFloat(container, "opening_width", newOpening);
+
+	// (with the new r and i_girth, which the default emitters use)
+	const float oldR = r, oldGirth = i_girth;
+	r = newR;
+	i_girth = newGirth;
+	std::vector<ParticleEmitter> newEmitters;
+	const bool emittersOk = ReadSceneEmitters(scene.Find("emitters"), newEmitters);
+	r = oldR;
+	i_girth = oldGirth;
+	if (!emittersOk)
+		return false;
+
+	// from here on the scene is applied
+	const bool radiusChanged = newR != r;
+	const bool gridChanged = newSIM_W != SIM_W;
+	const bool worldChanged = radiusChanged || gridChanged || newBottom != bottom || newHeight != container_height ||
+		newTop != container_top || newWidth != container_width || newOpening != opening_width;
+	const bool girthChanged = newGirth != i_girth;
+	spacing = newSpacing;
+	k = newK;
+	k_near = newKNear;
+	r = newR;
+	rsq = r * r;
+	SIM_W = newSIM_W;
+	bottom = newBottom;
+	i_girth = newGirth;
+	container_height = newHeight;
+	container_top = newTop;
+	container_width = newWidth;
+	opening_width = newOpening;
+
+	for (const auto &p : sceneFloats)
+		SceneFloat(params, p.name, *p.value);
+	for (const auto &p : sceneInts)
+		SceneInt(params, p.name, *p.value);
+	for (const auto &p : sceneToggles)
+		SceneInt(params, p.name, *p.value);
+	std::string solver;
+	if (SceneString(params, "solver", solver))
+	{
+		if (solver == "double_density")
+			whichSolver = DOUBLE_DENSITY;
+		else if (solver == "position_based")
+			whichSolver = POSITION_BASED;
+		else if (solver == "implicit_incompressible")
+			whichSolver = IMPLICIT_INCOMPRESSIBLE;
+		else
+			fprintf(stderr, "Scene: the solver is \"double_density\", \"position_based\" or \"implicit_incompressible\"\n");
+	}
+
+	// the particle count follows the emitters, unless the file gives it
+	int newN = N;
+	SceneInt(params, "N", newN);
+	if ((params == NULL || params->Find("N") == NULL) && !newEmitters.empty())
+	{
+		newN = 0;
+		for (const ParticleEmitter &e : newEmitters)
+			newN += EmitterSize(e);
+	}
+	const bool emittersChanged = newEmitters.size() != emitters.size() ||
+		(!emitters.empty() && memcmp(&newEmitters[0], &emitters[0], emitters.size() * sizeof(ParticleEmitter)) != 0);
+	const bool restart = newN != N || emittersChanged || (girthChanged && newEmitters.empty());
+	emitters = newEmitters;
+	N = newN;
+
+	// the colliders, if they are not what they were
+	static std::string lastColliders;
+	std::string colliders;
+	if (scene.Find("colliders") != NULL)
+		scene.Find("colliders")->Write(colliders);
+	const bool collidersChanged = colliders != lastColliders || (radiusChanged && !colliders.empty());
+	lastColliders = colliders;
+
+	ApplySceneOutput(scene.Find("output"));
+
+	// and now rebuild what depends on what changed
+	if (radiusChanged)
+	{
+		UpdateKernelVolumes();
+		indexsp.SetCellSize(r * 2);
+		fineIndex.SetCellSize(r * 2);
+		sleepIndex.SetCellSize(r * 2);
+		sleepIndexDirty = true;
+		bodyIndex.SetCellSize(r * 2);
+		slice2D.ResizeIndex();
+		slice2D.Seed(N);		// (laid out r / 2 apart)
+	}
+	// (for a new r, size or toggle, before StartSettled( ) below steps with it)
+	UpdateKernelTable();
+	if (collidersChanged)
+		LoadSceneColliders(scene.Find("colliders"));
+	if (worldChanged || collidersChanged)
+	{
+		worldVersion++;		// the boundary samples and the collider grid (see UpdateBoundaryParticles( ), UpdateColliders( ))
+		WakeAllParticles();	// (the sleepers rest on what was there before)
+	}
+	if (gridChanged && GridDL1 != 0)
+		InitGridLists();
+	if (restart)
+	{
+		particles.clear();
+		initParticles(N);
+		WakeAllParticles();
+		slice2D.Seed(N);
+		if (useSettledStart)
+			StartSettled();
+		ForgetSnapshots();
+	}
+
+	if (Verbose)
+		fprintf(stderr, "Scene applied%s%s%s%s\n", radiusChanged ? ", indices resized for the new r" : "",
+			worldChanged ? ", geometry rebuilt" : "", collidersChanged ? ", colliders loaded" : "",
+			restart ? ", particles poured again" : "");
+	return true;
+}
+
+// --------------------------------------------------------------------
+// Tells when a file has been written. inotify on Linux watches the
+// directory, since editors often save by writing a new file and renaming
+// it over the old one; elsewhere the modification time is polled.
+class SceneWatcher
+{
+public:
+	SceneWatcher() : mFd(-1), mTime(0), mSize(0) {}
+
+	~SceneWatcher()
+	{
+		Close();
+	}
+
+	void Open(const char *file)
+	{
+		Close();
+		mFile = file;
+		const size_t slash = mFile.rfind('/');
+		const std::string dir = slash == std::string::npos ? "." : mFile.substr(0, slash + 1);
+		mName = slash == std::string::npos ? mFile : mFile.substr(slash + 1);
+#ifdef __linux__
+		mFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if (mFd >= 0 && inotify_add_watch(mFd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) >= 0)
+			return;
+		if (mFd >= 0)
+			close(mFd);
+		mFd = -1;
+#endif
+		Stat(mTime, mSize);
+	}
+
+	void Close()
+	{
+		if (mFd >= 0)
+			close(mFd);
+		mFd = -1;
+	}
+
+	// has the file been written since the last call?
+	bool Changed()
+	{
+		if (mFd >= 0)
+		{
+#ifdef __linux__
+			bool changed = false;
+			char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+			ssize_t len;
+			while ((len = read(mFd, events, sizeof(events))) > 0)
+			{
+				for (char *at = events; at < events + len; )
+				{
+					const struct inotify_event *event = (const struct inotify_event *)at;
+					if (event->len > 0 && mName == event->name)
+						changed = true;
+					at += sizeof(struct inotify_event) + event->len;
+				}
+			}
+			return changed;
+#endif
+		}
+
+		long long time, size;
+		Stat(time, size);
+		if (time == mTime && size == mSize)
+			return false;
+		mTime = time;
+		mSize = size;
+		return true;
+	}
+
+private:
+	void Stat(long long &time, long long &size) const
+	{
+		struct stat st;
+		if (stat(mFile.c_str(), &st) != 0)
+		{
+			time = size = -1;
+			return;
+		}
+		time = (long long)st.st_mtime;
+		size = (long long)st.st_size;
+	}
+
+	std::string mFile;
+	std::string mName;		// without the directory
+	int mFd;				// the inotify instance
+	long long mTime, mSize;	// of the file when it was last looked at, without inotify
+};
+
+SceneWatcher sceneWatcher;
+
+// --------------------------------------------------------------------
+// Read and apply a scene file. False if it cannot be read or applied.
+bool LoadScene(const char *file)
+{
+	FILE *fp = fopen(file, "rb");
+	if (fp == NULL)
+	{
+		fprintf(stderr, "Cannot open scene '%s'\n", file);
+		return false;
+	}
+	std::string text;
+	char buffer[4096];
+	size_t n;
+	while ((n = fread(buffer, 1, sizeof(buffer), fp)) > 0)
+		text.append(buffer, n);
+	fclose(fp);
+
+	JsonValue scene;
+	JsonParser parser(text.c_str());
+	if (!parser.Parse(scene))
+	{
+		fprintf(stderr, "Scene '%s', line %d: %s\n", file, parser.Line(), parser.Error());
+		return false;
+	}
+	if (!ApplyScene(scene))
+		return false;
+
+	if (GluiFluid != NULL)
+		GLUI_Master.sync_live_all();
+	return true;
+}
+
+// Load a scene file and watch it from now on.
+bool OpenScene(const char *file)
+{
+	sceneFile = file;
+	sceneWatcher.Open(file);
+	return LoadScene(file);
+}
+
+// Apply the scene file again if it has been written since the last call.
+// (call between steps)
+void UpdateScene()
+{
+	if (sceneFile != NULL && sceneWatcher.Changed())
+		LoadScene(sceneFile);
+}
@@ -0,0 +1,260 @@
+// --------------------------------------------------------------------
+// Per-thread bump arenas for the temporaries of a simulation step.
+//
+// Every thread of the OpenMP team owns one ScratchArena. Allocation is a
+// pointer bump inside the current block, freeing the most recent allocation
+// pops it again, and everything is dropped at once by ResetScratchArenas( )
+// at the start of each step. When a step needs more memory than the arena
+// holds, another block is chained on; the next Reset( ) folds the blocks into
+// one that is big enough, so the steady state does not touch malloc at all.
+
+class ScratchArena
+{
+public:
+	struct Stats
+	{
+		size_t allocations;		 // calls to Allocate( ) since the last reset
+		size_t bytes;			 // bytes handed out since the last reset
+		size_t peakBytes;		 // largest footprint seen since construction
+		size_t blockAllocations; // times we had to go to the heap for a block
+		size_t resets;			 // number of Reset( ) calls
+	};
+
+	// a position in the arena that can be returned to with Rewind( ):
+	struct Marker
+	{
+		size_t block;
+		size_t offset;
+	};
+
+	// rewinds the arena to where it was when the scope was opened:
+	class Scope
+	{
+	public:
+		explicit Scope(ScratchArena &arena) : mArena(arena), mMarker(arena.Mark()) {}
+		~Scope() { mArena.Rewind(mMarker); }
+
+	private:
+		Scope(const Scope &);
+		Scope &operator=(const Scope &);
+
+		ScratchArena &mArena;
+		const Marker mMarker;
+	};
+
+	explicit ScratchArena(const size_t blockSize = 256 * 1024)
+		: mBlockSize(blockSize), mBlock(0), mOffset(0), mLastAlloc(NULL)
+	{
+		memset(&mStats, 0, sizeof(mStats));
+		AddBlock(blockSize);
+	}
+
+	~ScratchArena()
+	{
+		for (size_t b = 0; b < mBlocks.size(); b++)
+			free(mBlocks[b].data);
+	}
+
+	void *Allocate(const size_t bytes, const size_t align)
+	{
+		size_t offset = AlignUp(mOffset, align);
+		if (offset + bytes > mBlocks[mBlock].size)
+		{
+			// move on to the next block, chaining a new one if needed:
+			mBlock++;
+			if (mBlock == mBlocks.size() || mBlocks[mBlock].size < bytes + align)
+			{
+				const size_t size = bytes + align > mBlockSize ? bytes + align : mBlockSize;
+				mBlocks.insert(mBlocks.begin() + mBlock, Block());
+				mBlocks[mBlock].data = (char *)malloc(size);
+				mBlocks[mBlock].size = size;
+				mStats.blockAllocations++;
+			}
+			offset = AlignUp(0, align);
+		}
+
+		void *ptr = mBlocks[mBlock].data + offset;
+		mOffset = offset + bytes;
+		mLastAlloc = ptr;
+
+		mStats.allocations++;
+		mStats.bytes += bytes;
+		const size_t used = Footprint();
+		if (used > mStats.peakBytes)
+			mStats.peakBytes = used;
+		return ptr;
+	}
+
+	// only the most recent allocation can actually be given back:
+	void Deallocate(void *ptr, const size_t bytes)
+	{
+		if (ptr != NULL && ptr == mLastAlloc && (char *)ptr + bytes == mBlocks[mBlock].data + mOffset)
+		{
+			mOffset = (char *)ptr - mBlocks[mBlock].data;
+			mLastAlloc = NULL;
+		}
+	}
+
+	Marker Mark() const
+	{
+		Marker m;
+		m.block = mBlock;
+		m.offset = mOffset;
+		return m;
+	}
+
+	void Rewind(const Marker &m)
+	{
+		mBlock = m.block;
+		mOffset = m.offset;
+		mLastAlloc = NULL;
+	}
+
+	void Reset()
+	{
+		// fold a chain of blocks into a single one that holds the peak:
+		if (mBlocks.size() > 1)
+		{
+			size_t total = 0;
+			for (size_t b = 0; b < mBlocks.size(); b++)
+			{
+				total += mBlocks[b].size;
+				free(mBlocks[b].data);
+			}
+			mBlocks.clear();
+			mBlockSize = total;
+			AddBlock(total);
+		}
+
+		mBlock = 0;
+		mOffset = 0;
+		mLastAlloc = NULL;
+		mStats.allocations = 0;
+		mStats.bytes = 0;
+		mStats.resets++;
+	}
+
+	const Stats &GetStats() const
+	{
+		return mStats;
+	}
+
+private:
+	struct Block
+	{
+		char *data;
+		size_t size;
+	};
+
+	ScratchArena(const ScratchArena &);
+	ScratchArena &operator=(const ScratchArena &);
+
+	static inline size_t AlignUp(const size_t offset, const size_t align)
+	{
+		return (offset + align - 1) & ~(align - 1);
+	}
+
+	void AddBlock(const size_t size)
+	{
+		Block b;
+		b.data = (char *)malloc(size);
+		b.size = size;
+		mBlocks.push_back(b);
+		mStats.blockAllocations++;
+	}
+
+	size_t Footprint() const
+	{
+		size_t used = mOffset;
+		for (size_t b = 0; b < mBlock; b++)
+			used += mBlocks[b].size;
+		return used;
+	}
+
+	std::vector<Block> mBlocks;
+	size_t mBlockSize;
+	size_t mBlock;
+	size_t mOffset;
+	void *mLastAlloc;
+	Stats mStats;
+
+	// keep the counters of two threads off the same cache line:
+	char mPad[64];
+};
+
+// --------------------------------------------------------------------
+// A standard allocator that draws from a ScratchArena, so std::vector
+// can be used for step temporaries without going through malloc.
+template <typename T>
+class ArenaAllocator
+{
+public:
+	typedef T value_type;
+
+	explicit ArenaAllocator(ScratchArena &arena) : mArena(&arena) {}
+
+	template <typename U>
+	ArenaAllocator(const ArenaAllocator<U> &other) : mArena(other.mArena) {}
+
+	T *allocate(const size_t n)
+	{
+		return static_cast<T *>(mArena->Allocate(n * sizeof(T), alignof(T)));
+	}
+
+	void deallocate(T *ptr, const size_t n)
+	{
+		mArena->Deallocate(ptr, n * sizeof(T));
+	}
+
+	template <typename U>
+	bool operator==(const ArenaAllocator<U> &other) const { return mArena == other.mArena; }
+
+	template <typename U>
+	bool operator!=(const ArenaAllocator<U> &other) const { return mArena != other.mArena; }
+
+	ScratchArena *mArena;
+};
+
+// --------------------------------------------------------------------
+// One arena per OpenMP thread, indexed by omp_get_thread_num( ).
+std::vector<ScratchArena *> ScratchArenas;
+
+// make sure there is an arena for every thread that may run:
+void ResizeScratchArenas()
+{
+	const size_t numThreads = (size_t)omp_get_max_threads();
+	while (ScratchArenas.size() < numThreads)
+		ScratchArenas.push_back(new ScratchArena());
+}
+
+// the arena of the calling thread:
+inline ScratchArena &ThreadArena()
+{
+	return *ScratchArenas[omp_get_thread_num()];
+}
+
+// drop everything allocated during the previous step:
+// (call this outside of any parallel region)
+void ResetScratchArenas()
+{
+	ResizeScratchArenas();
+	for (size_t t = 0; t < ScratchArenas.size(); t++)
+		ScratchArenas[t]->Reset();
+}
+
+// sum of the counters of all threads:
+ScratchArena::Stats ScratchArenaTotals()
+{
+	ScratchArena::Stats total;
+	memset(&total, 0, sizeof(total));
+	for (size_t t = 0; t < ScratchArenas.size(); t++)
+	{
+		const ScratchArena::Stats &s = ScratchArenas[t]->GetStats();
+		total.allocations += s.allocations;
+		total.bytes += s.bytes;
+		total.peakBytes += s.peakBytes;
+		total.blockAllocations += s.blockAllocations;
+		total.resets += s.resets;
+	}
+	return total;
+}
@@ -0,0 +1,322 @@
+// --------------------------------------------------------------------
+// Signed distance field colliders
+//
+// The static geometry of the scene is a list of ColliderShapes (boxes,
+// cylinders and triangle meshes that are solid, carved out of the solids,
+// or that contain the fluid). At load time their signed distance (positive
+// in the free space, negative inside the solids) is baked into a sparse
+// grid, and during the simulation a particle collides with all of it at once: one trilinear
+// lookup, its gradient, and a push along the gradient out to colliderMargin.
+// There is no per-shape branching left in the per-particle loop.
+//
+// The grid is split into bricks of SDFGrid::B^3 cells. Only the bricks
+// near a surface are stored, all the others point at one of two shared
+// bricks holding +band (free space) or -band (deep inside a solid). Every
+// brick keeps one extra layer of samples, so the 8 corners of a cell are
+// always in the same brick.
+
+enum ColliderTypes
+{
+	COLLIDER_BOX,
+	COLLIDER_CYLINDER,		// around the y axis
+	COLLIDER_MESH			// a shell of the given thickness around a triangle mesh
+};
+
+enum ColliderOps
+{
+	COLLIDER_SOLID,			// the shape is solid
+	COLLIDER_CARVE,			// the shape is cut out of what came before
+	COLLIDER_CONTAINER		// everything outside of the shape is solid
+};
+
+struct ColliderShape
+{
+	int type;
+	int op;
+	glm::vec3 center;
+	glm::vec3 half;			// half extents, for a cylinder (radius, half height, -),
+							// for a mesh (half thickness, -, -)
+	const TriangleBVH *mesh;
+};
+
+// --------------------------------------------------------------------
+// exact signed distances of the primitives:
+static inline float BoxDistance(const glm::vec3 &p, const glm::vec3 &half)
+{
+	const glm::vec3 q = glm::abs(p) - half;
+	return glm::length(glm::max(q, glm::vec3(0.f))) + glm::min(glm::max(q.x, glm::max(q.y, q.z)), 0.f);
+}
+
+static inline float CylinderDistance(const glm::vec3 &p, const float radius, const float halfHeight)
+{
+	const glm::vec2 q = glm::abs(glm::vec2(glm::length(glm::vec2(p.x, p.z)), p.y)) - glm::vec2(radius, halfHeight);
+	return glm::length(glm::max(q, glm::vec2(0.f))) + glm::min(glm::max(q.x, q.y), 0.f);
+}
+
+static inline float ShapeDistance(const ColliderShape &shape, const glm::vec3 &p)
+{
+	if (shape.type == COLLIDER_CYLINDER)
+		return CylinderDistance(p - shape.center, shape.half.x, shape.half.y);
+	if (shape.type == COLLIDER_MESH)
+		return shape.mesh->Distance(p - shape.center) - shape.half.x;
+	return BoxDistance(p - shape.center, shape.half);
+}
+
+// distance to the solid part of a list of shapes, applied in order:
+float ColliderSceneDistance(const std::vector<ColliderShape> &shapes, const glm::vec3 &p)
+{
+	float d = 1.e+37f;
+	for (const ColliderShape &shape : shapes)
+	{
+		const float s = ShapeDistance(shape, p);
+		switch (shape.op)
+		{
+		case COLLIDER_SOLID:
+			d = glm::min(d, s);
+			break;
+		case COLLIDER_CARVE:
+			d = glm::max(d, -s);
+			break;
+		case COLLIDER_CONTAINER:
+			d = glm::min(d, -s);
+			break;
+		}
+	}
+	return d;
+}
+
+// --------------------------------------------------------------------
+class SDFGrid
+{
+public:
+	static const int B = 8;			// cells per brick side
+	static const int S = B + 1;		// samples per brick side
+
+	SDFGrid() : mInvVoxel(1.f), mBand(1.f), mCells(0), mBricks(0) {}
+
+	// Bake distance(p) over [lo, hi] with the given cell size. Values are
+	// only kept within band of a surface, farther ones are clamped to it.
+	template <typename F>
+	void Bake(const glm::vec3 &lo, const glm::vec3 &hi, const float voxel, const float band, F distance)
+	{
+		mOrigin = lo;
+		mInvVoxel = 1.f / voxel;
+		mBand = band;
+		mBricks = glm::ivec3(glm::ceil((hi - lo) * mInvVoxel / (float)B));
+		mBricks = glm::max(mBricks, glm::ivec3(1));
+		mCells = mBricks * B;
+
+		const int brickSize = S * S * S;
+		const int numBricks = mBricks.x * mBricks.y * mBricks.z;
+		mBrickIndex.assign(numBricks, 0);
+
+		// the two shared bricks:
+		mSamples.assign(2 * brickSize, band);
+		std::fill(mSamples.begin() + brickSize, mSamples.end(), -band);
+
+		// a brick farther than this from every surface holds nothing but +-band
+		const float reach = band + 0.5f * sqrtf(3.f) * B * voxel;
+
+		#pragma omp parallel for
+		for (int i = 0; i < numBricks; i++)
+		{
+			const glm::vec3 center = mOrigin + (glm::vec3(BrickCoords(i)) + 0.5f) * (B * voxel);
+			const float d = distance(center);
+			mBrickIndex[i] = d > reach ? 0 : (d < -reach ? brickSize : -1);
+		}
+
+		int next = 2 * brickSize;
+		for (int i = 0; i < numBricks; i++)
+		{
+			if (mBrickIndex[i] < 0)
+			{
+				mBrickIndex[i] = next;
+				next += brickSize;
+			}
+		}
+		mSamples.resize(next);
+
+		#pragma omp parallel for
+		for (int i = 0; i < numBricks; i++)
+		{
+			const int offset = mBrickIndex[i];
+			if (offset < 2 * brickSize)
+				continue;
+
+			const glm::ivec3 first = BrickCoords(i) * B;
+			for (int z = 0; z < S; z++)
+				for (int y = 0; y < S; y++)
+					for (int x = 0; x < S; x++)
+					{
+						const glm::vec3 p = mOrigin + glm::vec3(first + glm::ivec3(x, y, z)) * voxel;
+						mSamples[offset + (z * S + y) * S + x] = glm::clamp(distance(p), -band, band);
+					}
+		}
+	}
+
+	// trilinear distance at p and its gradient, branch-free:
+	// (points outside of the grid get the value at its border)
+	inline float Sample(const glm::vec3 &p, glm::vec3 &grad) const
+	{
+		const glm::vec3 g = glm::clamp((p - mOrigin) * mInvVoxel, glm::vec3(0.f), glm::vec3(mCells) - 0.001f);
+		const glm::ivec3 c = glm::ivec3(g);
+		const glm::vec3 f = g - glm::vec3(c);
+		const glm::ivec3 b = c / B;
+		const glm::ivec3 l = c - b * B;
+
+		const float *s = &mSamples[mBrickIndex[(b.z * mBricks.y + b.y) * mBricks.x + b.x] + (l.z * S + l.y) * S + l.x];
+		const float c000 = s[0],         c100 = s[1];
+		const float c010 = s[S],         c110 = s[S + 1];
+		const float c001 = s[S * S],     c101 = s[S * S + 1];
+		const float c011 = s[S * S + S], c111 = s[S * S + S + 1];
+
+		const float d00 = c000 + (c100 - c000) * f.x;
+		const float d10 = c010 + (c110 - c010) * f.x;
+		const float d01 = c001 + (c101 - c001) * f.x;
+		const float d11 = c011 + (c111 - c011) * f.x;
+		const float d0 = d00 + (d10 - d00) * f.y;
+		const float d1 = d01 + (d11 - d01) * f.y;
+
+		grad.x = ((c100 - c000) * (1.f - f.y) * (1.f - f.z) + (c110 - c010) * f.y * (1.f - f.z) +
+				  (c101 - c001) * (1.f - f.y) * f.z + (c111 - c011) * f.y * f.z) * mInvVoxel;
+		grad.y = ((d10 - d00) * (1.f - f.z) + (d11 - d01) * f.z) * mInvVoxel;
+		grad.z = (d1 - d0) * mInvVoxel;
+		return d0 + (d1 - d0) * f.z;
+	}
+
+	size_t StoredBricks() const
+	{
+		return mSamples.size() / (S * S * S) - 2;
+	}
+
+	size_t Bytes() const
+	{
+		return mSamples.size() * sizeof(float) + mBrickIndex.size() * sizeof(int);
+	}
+
+private:
+	glm::ivec3 BrickCoords(const int i) const
+	{
+		return glm::ivec3(i % mBricks.x, (i / mBricks.x) % mBricks.y, i / (mBricks.x * mBricks.y));
+	}
+
+	glm::vec3 mOrigin;
+	float mInvVoxel;
+	float mBand;
+	glm::ivec3 mCells;
+	glm::ivec3 mBricks;
+	std::vector<int> mBrickIndex;	// offset of each brick into mSamples
+	std::vector<float> mSamples;
+};
+
+// --------------------------------------------------------------------
+// The scene: the shapes, and the grid they are baked into.
+std::vector<ColliderShape> colliderShapes;
+SDFGrid colliderSDF;
+
+// the geometry the grid was baked for:
+static int colliderOpening = -1;
+static int colliderShrink = -1;
+static int colliderMeshes = -1;
+static int colliderWorld = -1;
+
+void AddColliderBox(const glm::vec3 &center, const glm::vec3 &half, const int op)
+{
+	ColliderShape shape = { COLLIDER_BOX, op, center, half, NULL };
+	colliderShapes.push_back(shape);
+}
+
+void AddColliderCylinder(const glm::vec3 &center, const float radius, const float halfHeight, const int op)
+{
+	ColliderShape shape = { COLLIDER_CYLINDER, op, center, glm::vec3(radius, halfHeight, 0.f), NULL };
+	colliderShapes.push_back(shape);
+}
+
+// (the distance to a mesh is a BVH query, so it is much slower to bake)
+void AddColliderMesh(const TriangleBVH *mesh, const float thickness, const int op)
+{
+	ColliderShape shape = { COLLIDER_MESH, op, glm::vec3(0.f), glm::vec3(0.5f * thickness, 0.f, 0.f), mesh };
+	colliderShapes.push_back(shape);
+}
+
+// --------------------------------------------------------------------
+// Put the world and the container into colliderShapes and bake the grid.
+// The walls of the container get a thickness of r, so nothing that moves
+// less than that per step tunnels through.
+void BuildContainerColliders()
+{
+	colliderShapes.clear();
+
+	const float bound = shrinkWorld ? SIM_W * 3.f : SIM_W;
+	const float top = container_top + 2.f;
+	AddColliderBox(glm::vec3(0.f, 0.5f * (bottom + top), 0.f), glm::vec3(bound, 0.5f * (top - bottom), SIM_W), COLLIDER_CONTAINER);
+
+	const float wall = r;
+	const float cy = 0.5f * (container_height + container_top);
+	const float chalf = 0.5f * (container_top - container_height);
+	AddColliderBox(glm::vec3(0.f, cy, 0.f), glm::vec3(container_width + wall, chalf + wall, container_width + wall), COLLIDER_SOLID);
+	AddColliderBox(glm::vec3(0.f, cy, 0.f), glm::vec3(container_width, chalf, container_width), COLLIDER_CARVE);
+	if (useOpening)
+		AddColliderBox(glm::vec3(0.f, container_height - 0.5f * wall, 0.f),
+			glm::vec3(opening_width / 2, wall, opening_width / 2), COLLIDER_CARVE);
+
+	glm::vec3 lo(-bound, bottom, -SIM_W), hi(bound, top, SIM_W);
+	if (useMeshColliders)
+	{
+		for (const MeshCollider *collider : meshColliders)
+		{
+			AddColliderMesh(&collider->bvh, wall, COLLIDER_SOLID);
+			lo = glm::min(lo, collider->bvh.Lo());
+			hi = glm::max(hi, collider->bvh.Hi());
+		}
+	}
+
+	const float band = 2.f * r;
+	const glm::vec3 pad(band + r);
+	colliderSDF.Bake(lo - pad, hi + pad,
+		0.5f * r, band, [](const glm::vec3 &p) { return ColliderSceneDistance(colliderShapes, p); });
+
+	colliderOpening = useOpening;
+	colliderShrink = shrinkWorld;
+	colliderMeshes = useMeshColliders ? (int)meshColliders.size() : 0;
+	colliderWorld = worldVersion;
+
+	if (DebugOn != 0)
+		fprintf(stderr, "SDF colliders: %lu bricks stored, %lu bytes\n",
+			(unsigned long)colliderSDF.StoredBricks(), (unsigned long)colliderSDF.Bytes());
+}
+
+// re-bake if the opening, the world size, the meshes or the geometry
+// (worldVersion) have changed:
+// (call outside of any parallel region)
+void UpdateColliders()
+{
+	const int meshes = useMeshColliders ? (int)meshColliders.size() : 0;
+	if (colliderOpening != useOpening || colliderShrink != shrinkWorld || colliderMeshes != meshes ||
+		colliderWorld != worldVersion)
+		BuildContainerColliders();
+}
+
+// --------------------------------------------------------------------
+// Push a position out of the solids, to colliderMargin from the surface.
+static inline void CollideWithScene(glm::vec3 &pos)
+{
+	glm::vec3 grad;
+	const float d = colliderSDF.Sample(pos, grad);
+	const glm::vec3 n = grad / glm::max(glm::length(grad), 1.e-6f);
+	pos += n * glm::max(colliderMargin - d, 0.f);
+}
+
+// the same for every particle:
+void ResolveColliders()
+{
+	if (!useGravity)
+		return;
+
+	const int n = (int)particles.size();
+	#pragma omp parallel for
+	for (int i = 0; i < n; i++)
+	{
+		CollideWithScene(particles[i].pos);
+	}
+}
@@ -0,0 +1,120 @@
+// --------------------------------------------------------------------
+// Settled initial states
+//
+// A fresh column from initParticles( ) spends its first several hundred
+// steps collapsing into a pool before anything interesting happens. With
+// useSettledStart on, Reset( ) (and -settled on the command line) starts
+// from that pool instead. The first time a scene is seen, the column is
+// stepped until it is at rest and saved as a checkpoint in settledCacheDir,
+// named by a hash of everything that decides what the pool looks like;
+// every later start of the same scene just loads it.
+
+const char *settledCacheDir = "settled";
+int settleMaxSteps = 3000;		// give up waiting for rest after this many steps
+int settleMinSteps = 100;		// ... and do not call it settled before this many
+float settleVelocity = 0.001f;	// rms speed below which the pool is at rest
+
+// --------------------------------------------------------------------
+static inline void HashBytes(uint64_t &h, const void *data, const size_t bytes)
+{
+	const unsigned char *b = (const unsigned char *)data;
+	for (size_t i = 0; i < bytes; i++)
+		h = (h ^ b[i]) * 1099511628211ULL;
+}
+
+// FNV-1a of the particle count, the kernel and material constants, the
+// world and container geometry, the emitters of a scene file, the solver
+// and its parameters, the toggles a checkpoint restores, and the mesh
+// colliders and rigid bodies the pool settles around.
+uint64_t SettledStateKey()
+{
+	const float constants[] =
+	{
+		(float)N, spacing, r, k, k_near, rest_density, mass, ::G, dT,
+		SIM_W, bottom, i_girth, container_height, container_top, container_width, opening_width,
+		pbfDT, pbfRelaxation, pbfXSPH, iisphDT, iisphTolerance, iisphOmega,
+		colliderMargin, sleepVelocity, sleepDensityError
+	};
+	const int toggles[] =
+	{
+		CHECKPOINT_VERSION, whichSolver, pbfIterations, iisphMaxIterations,
+		useGravity, externalForce, shrinkWorld, useOpening, useFusedPass,
+		useLocalDT, maxLocalLevel, useSleeping, sleepSteps, useBoundaryParticles,
+		useKernelTable, kernelTableSize, useDeterministic, (int)deterministicSeed,
+		useColliders, useMeshColliders, useRigidBodies
+	};
+
+	uint64_t h = 14695981039346656037ULL;
+	HashBytes(h, constants, sizeof(constants));
+	HashBytes(h, toggles, sizeof(toggles));
+	if (!emitters.empty())
+		HashBytes(h, &emitters[0], emitters.size() * sizeof(ParticleEmitter));
+
+	// (by file name, so a mesh edited under the same name needs the cache
+	// cleared)
+	if (useMeshColliders)
+	{
+		for (const MeshCollider *collider : meshColliders)
+		{
+			const int triangles = collider->bvh.NumTriangles();
+			HashBytes(h, collider->file.c_str(), collider->file.size() + 1);
+			HashBytes(h, &collider->offset, sizeof(glm::vec3));
+			HashBytes(h, &collider->scale, sizeof(float));
+			HashBytes(h, &triangles, sizeof(int));
+		}
+	}
+	if (useRigidBodies)
+	{
+		for (const RigidBody &body : rigidBodies)
+		{
+			HashBytes(h, &body.shape, sizeof(int));
+			HashBytes(h, &body.half, sizeof(glm::vec3));
+			HashBytes(h, &body.mass, sizeof(float));
+			HashBytes(h, &body.pos, sizeof(glm::vec3));
+			HashBytes(h, &body.rot, sizeof(glm::quat));
+			if (!body.planes.empty())
+				HashBytes(h, &body.planes[0], body.planes.size() * sizeof(glm::vec4));
+		}
+	}
+	return h;
+}
+
+// in index order, so the step the pool counts as settled on does not
+// depend on the number of threads
+static float RmsSpeed()
+{
+	if (particles.empty())
+		return 0.f;
+	double sum = 0.;
+	for (const auto &particle : particles)
+		sum += glm::dot(particle.vel, particle.vel);
+	return (float)sqrt(sum / (double)particles.size());
+}
+
+// --------------------------------------------------------------------
+// Replace the particles with the settled pool of the current scene,
+// settling and caching it first if there is none yet. Returns false if
+// the pool could not be cached (the particles are settled all the same).
+bool StartSettled()
+{
+	char file[512];
+	snprintf(file, sizeof(file), "%s/settled-%016llx.ckpt", settledCacheDir, (unsigned long long)SettledStateKey());
+	if (access(file, R_OK) == 0 && LoadCheckpoint(file))
+		return true;
+
+	particles.clear();
+	initParticles(N);
+	int steps = 0;
+	while (steps < settleMaxSteps)
+	{
+		step();
+		steps++;
+		if (steps >= settleMinSteps && RmsSpeed() < settleVelocity)
+			break;
+	}
+	if (Verbose)
+		fprintf(stderr, "Settled %d particles in %d steps, caching them in '%s'\n", (int)particles.size(), steps, file);
+
+	mkdir(settledCacheDir, 0755);
+	return SaveCheckpoint(file);
+}
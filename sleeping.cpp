@@ -0,0 +1,197 @@
+// --------------------------------------------------------------------
+// Sleeping particles for the double density solver
+//
+// A particle that stays slow (below sleepVelocity) and uncompressed (less
+// than sleepDensityError above its rest density) for sleepSteps steps in
+// a row falls asleep. It stops where it is and is skipped by every pass
+// of step( ), while the awake particles around it keep seeing it with the
+// density and pressure it had when it fell asleep. It wakes up again when
+// a moving particle comes into its radius of support, or when anything
+// that acts on all particles (the external force, gravity, the walls)
+// changes.
+//
+// A sleeper keeps no neighbor lists (the wall and body samples its
+// wallNeighbors point into can be rebuilt while it sleeps), and one that
+// is touched is only marked, and wakes at the start of the next step, so it
+// never takes part in the pressure and force passes before the density
+// pass has found its neighbors again.
+//
+// Sleepers live in their own sleepIndex, which is only rebuilt when one
+// falls asleep or wakes up, so a resting pool adds nothing to the per-step
+// rebuild of indexsp.
+
+IndexType sleepIndex(4093, r*2);
+bool sleepIndexDirty = true;
+int numSleeping = 0;
+
+// --------------------------------------------------------------------
+void WakeAllParticles()
+{
+	for (auto &particle : particles)
+	{
+		particle.asleep = 0;
+		particle.wakeUp = 0;
+		particle.calmSteps = 0;
+	}
+	numSleeping = 0;
+	sleepIndexDirty = true;
+}
+
+// --------------------------------------------------------------------
+// Wake everybody if something changed that pushes on the sleepers too.
+// (call at the start of each step that uses sleepers)
+void CheckSleepersWorld()
+{
+	static int lastGravity = -1;
+	static float lastG = -1.f;
+	static int lastShrink = -1;
+	static int lastOpening = -1;
+	static const Particle *lastBase = NULL;
+	static size_t lastCount = 0;
+
+	// particles were added or reset: sleepIndex points at the old ones
+	const Particle *base = particles.empty() ? NULL : &particles[0];
+	if (base != lastBase || particles.size() != lastCount)
+	{
+		numSleeping = 0;
+		for (auto &particle : particles)
+			numSleeping += particle.asleep ? 1 : 0;
+		sleepIndexDirty = true;
+		lastBase = base;
+		lastCount = particles.size();
+	}
+
+	// (nothing has changed on the first call, the sleepers can only have
+	// come from a checkpoint)
+	const bool first = lastGravity < 0;
+	if (externalForce || (!first && (useGravity != lastGravity || ::G != lastG ||
+		shrinkWorld != lastShrink || useOpening != lastOpening)))
+	{
+		if (numSleeping > 0)
+			WakeAllParticles();
+	}
+	lastGravity = useGravity;
+	lastG = ::G;
+	lastShrink = shrinkWorld;
+	lastOpening = useOpening;
+}
+
+// --------------------------------------------------------------------
+// indexsp gets the awake particles, sleepIndex the sleeping ones (only
+// when that set has changed).
+void RebuildAwakeIndex()
+{
+	indexsp.Clear();
+	for (auto &particle : particles)
+	{
+		if (!particle.asleep)
+			indexsp.Insert(glm::vec3(particle.pos), &particle);
+	}
+
+	if (sleepIndexDirty)
+	{
+		sleepIndex.Clear();
+		for (auto &particle : particles)
+		{
+			if (particle.asleep)
+				sleepIndex.Insert(glm::vec3(particle.pos), &particle);
+		}
+		sleepIndexDirty = false;
+	}
+}
+
+// --------------------------------------------------------------------
+// Moving particles mark the sleepers in their neighbor lists to wake up
+// (see WakeMarkedSleepers( )).
+// (call after the neighbor lists of the awake particles are found)
+void WakeTouchedSleepers()
+{
+	if (numSleeping == 0)
+		return;
+
+	const float wakeVel2 = sleepVelocity * sleepVelocity;
+
+	#pragma omp parallel for
+	for (auto &particle : particles)
+	{
+		if (particle.asleep || glm::dot(particle.vel, particle.vel) < wakeVel2)
+			continue;
+
+		for (const Neighbor &n : particle.neighbors)
+		{
+			if ((*n.j).asleep)
+			{
+				#pragma omp atomic write
+				(*n.j).wakeUp = 1;
+			}
+		}
+	}
+}
+
+// Wake the sleepers that were marked in the step before.
+// (call at the start of each step that uses sleepers, before they move)
+void WakeMarkedSleepers()
+{
+	if (numSleeping == 0)
+		return;
+
+	int woken = 0;
+	#pragma omp parallel for reduction(+:woken)
+	for (auto &particle : particles)
+	{
+		if (particle.wakeUp)
+		{
+			particle.asleep = 0;
+			particle.wakeUp = 0;
+			particle.calmSteps = 0;
+			woken++;
+		}
+	}
+
+	if (woken > 0)
+	{
+		numSleeping -= woken;
+		sleepIndexDirty = true;
+	}
+}
+
+// --------------------------------------------------------------------
+// Count the calm steps of the awake particles and put to sleep the ones
+// that have been calm long enough.
+// (call at the end of the step, when the forces are done)
+void UpdateSleepState()
+{
+	const float sleepVel2 = sleepVelocity * sleepVelocity;
+
+	int fellAsleep = 0;
+	#pragma omp parallel for reduction(+:fellAsleep)
+	for (auto &particle : particles)
+	{
+		if (particle.asleep)
+			continue;
+
+		const float error = glm::max(particle.rho - particle.r_density, 0.f) / particle.r_density;
+		if (glm::dot(particle.vel, particle.vel) < sleepVel2 && error < sleepDensityError)
+			particle.calmSteps++;
+		else
+			particle.calmSteps = 0;
+
+		if (particle.calmSteps >= sleepSteps)
+		{
+			// stop right here, with nothing left over from this step
+			particle.asleep = 1;
+			particle.vel = glm::vec3(0.f);
+			particle.pos_old = particle.pos;
+			particle.force = glm::vec3(0.f);
+			particle.neighbors.clear();
+			particle.wallNeighbors.clear();
+			fellAsleep++;
+		}
+	}
+
+	if (fellAsleep > 0)
+	{
+		numSleeping += fellAsleep;
+		sleepIndexDirty = true;
+	}
+}
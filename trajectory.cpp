@@ -0,0 +1,413 @@
+// --------------------------------------------------------------------
+// Trajectory output
+//
+// With recordTrajectory on, every rendered frame the positions and
+// velocities of all particles go to trajectoryFile for offline analysis.
+// The step loop only copies them into a free snapshot buffer; a writer
+// thread takes the full buffers off a bounded queue, encodes them and
+// writes them through an OutputStream (so with io_uring, if that is on).
+// The simulation waits only when all trajectoryQueueSize buffers are
+// still queued.
+//
+// Encoding a frame:
+//	- every component is quantized to trajectoryBits bits, the positions
+//	  in the box of the world (TrajectoryBox( )), the velocities in
+//	  [-trajectoryVelRange, trajectoryVelRange],
+//	- stored as six planes (all pos.x, all pos.y, ..., all vel.z),
+//	- each value as its difference to the same particle in the frame
+//	  before (or to 0 in a key frame, every trajectoryKeyInterval frames),
+//	- and the zigzagged differences as varints, with runs of zeros as a
+//	  single varint. A pool at rest costs a few bytes per frame.
+// No general purpose compressor is used: the quantized differences are
+// already small, and a varint pass runs at memory speed without a library.
+//
+// The file is a TrajectoryHeader followed by frames, each a
+// TrajectoryFrameHeader and its encoded bytes; DecodeTrajectoryPlanes( )
+// and DequantizeTrajectoryFrame( ) reverse the encoding.
+
+const char TRAJECTORY_MAGIC[8] = {'S', 'P', 'H', 'T', 'R', 'A', 'J', '\0'};
+const uint32_t TRAJECTORY_VERSION = 1;
+
+struct TrajectoryHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t bits;			// per quantized component, 1 to 16
+	uint32_t keyInterval;	// frames between key frames
+	float lo[3], hi[3];		// the box the positions are quantized in
+	float velRange;			// ... and the velocities in [-velRange, velRange]
+};
+
+struct TrajectoryFrameHeader
+{
+	uint32_t bytes;			// of the encoded frame that follows
+	uint32_t count;			// particles
+	uint32_t frame;			// number of the frame in the recording
+	uint32_t key;			// != 0 means not relative to the frame before
+};
+
+// --------------------------------------------------------------------
+// Quantization
+
+// the box of everywhere a particle can be: the world walls (as wide as
+// "Increase boundary" makes them), the floor, and above the top of the
+// initial column, with room for the give of the wall springs
+static inline void TrajectoryBox(float lo[3], float hi[3])
+{
+	const float give = 0.1f;
+	lo[0] = -3.f * SIM_W - give;	hi[0] = 3.f * SIM_W + give;
+	lo[1] = bottom - give;			hi[1] = 5.5f;
+	lo[2] = -SIM_W - give;			hi[2] = SIM_W + give;
+}
+
+static inline uint32_t Quantize(const float v, const float lo, const float hi, const uint32_t levels)
+{
+	const float t = glm::clamp((v - lo) / (hi - lo), 0.f, 1.f);
+	return (uint32_t)(t * (float)levels + 0.5f);
+}
+
+static inline float Dequantize(const uint32_t q, const float lo, const float hi, const uint32_t levels)
+{
+	return lo + (hi - lo) * ((float)q / (float)levels);
+}
+
+// --------------------------------------------------------------------
+// Varints
+
+static inline void PutVarint(uint8_t *&out, uint32_t v)
+{
+	while (v >= 0x80)
+	{
+		*out++ = (uint8_t)(v | 0x80);
+		v >>= 7;
+	}
+	*out++ = (uint8_t)v;
+}
+
+// false if the varint runs past end
+static inline bool GetVarint(const uint8_t *&in, const uint8_t *end, uint32_t &v)
+{
+	v = 0;
+	for (int shift = 0; shift < 35 && in < end; shift += 7)
+	{
+		const uint8_t b = *in++;
+		v |= (uint32_t)(b & 0x7f) << shift;
+		if ((b & 0x80) == 0)
+			return true;
+	}
+	return false;
+}
+
+// --------------------------------------------------------------------
+// Room enough for any encoding of count particles: a token per value at
+// most, of at most 5 bytes.
+static inline size_t MaxEncodedTrajectoryBytes(const int count)
+{
+	return 6 * (size_t)count * 5;
+}
+
+// Encode the planes q (6 * count values) against prev (the planes of the
+// frame before, with prevCount particles; none for a key frame) into out
+// and return the bytes used. A token with the low bit clear is a zigzagged
+// difference, with the low bit set a run of zero differences.
+static size_t EncodeTrajectoryPlanes(const std::vector<uint16_t> &q, const int count,
+	const std::vector<uint16_t> &prev, const int prevCount, const bool key, uint8_t *const out)
+{
+	uint8_t *at = out;
+	uint32_t zeros = 0;
+	for (int plane = 0; plane < 6; plane++)
+	{
+		for (int i = 0; i < count; i++)
+		{
+			const int before = (!key && i < prevCount) ? prev[plane * prevCount + i] : 0;
+			const int d = (int)q[plane * count + i] - before;
+			if (d == 0)
+			{
+				zeros++;
+				continue;
+			}
+			if (zeros > 0)
+			{
+				PutVarint(at, (zeros << 1) | 1);
+				zeros = 0;
+			}
+			const uint32_t zigzag = d < 0 ? (uint32_t)(-2 * d - 1) : (uint32_t)(2 * d);
+			PutVarint(at, zigzag << 1);
+		}
+	}
+	if (zeros > 0)
+		PutVarint(at, (zeros << 1) | 1);
+	return at - out;
+}
+
+// The inverse of EncodeTrajectoryPlanes( ): fill q (6 * count values) from
+// the bytes in [in, end). False if the bytes do not make count particles.
+bool DecodeTrajectoryPlanes(const uint8_t *in, const uint8_t *end, const int count,
+	const std::vector<uint16_t> &prev, const int prevCount, const bool key, std::vector<uint16_t> &q)
+{
+	q.resize(6 * count);
+	const int total = 6 * count;
+	int at = 0;
+	while (at < total)
+	{
+		uint32_t token;
+		if (!GetVarint(in, end, token))
+			return false;
+
+		int run = 1;
+		int d = 0;
+		if (token & 1)
+			run = (int)(token >> 1);
+		else
+		{
+			const uint32_t zigzag = token >> 1;
+			d = (zigzag & 1) ? -(int)((zigzag + 1) >> 1) : (int)(zigzag >> 1);
+		}
+		if (run <= 0 || at + run > total)
+			return false;
+
+		for (; run > 0; run--, at++)
+		{
+			const int plane = at / count;
+			const int i = at % count;
+			const int before = (!key && i < prevCount) ? prev[plane * prevCount + i] : 0;
+			q[at] = (uint16_t)(before + d);
+		}
+	}
+	return in == end;
+}
+
+// Turn the planes of a decoded frame back into positions and velocities.
+void DequantizeTrajectoryFrame(const TrajectoryHeader &h, const std::vector<uint16_t> &q, const int count,
+	std::vector<glm::vec3> &pos, std::vector<glm::vec3> &vel)
+{
+	const uint32_t levels = (1u << h.bits) - 1;
+	pos.resize(count);
+	vel.resize(count);
+	for (int c = 0; c < 3; c++)
+	{
+		for (int i = 0; i < count; i++)
+		{
+			pos[i][c] = Dequantize(q[c * count + i], h.lo[c], h.hi[c], levels);
+			vel[i][c] = Dequantize(q[(3 + c) * count + i], -h.velRange, h.velRange, levels);
+		}
+	}
+}
+
+// --------------------------------------------------------------------
+class TrajectoryWriter
+{
+public:
+	TrajectoryWriter() : mClosing(false), mFrame(0), mStalls(0), mBytes(0) {}
+
+	~TrajectoryWriter()
+	{
+		Close();
+	}
+
+	bool Open(const char *file, const int bits, const int keyInterval, const int queueSize)
+	{
+		Close();
+		if (!mOut.Open(file, trajectoryBufferBytes, trajectoryQueueSize))
+			return false;
+
+		memset(&mHeader, 0, sizeof(mHeader));
+		memcpy(mHeader.magic, TRAJECTORY_MAGIC, sizeof(mHeader.magic));
+		mHeader.version = TRAJECTORY_VERSION;
+		mHeader.bits = (uint32_t)glm::clamp(bits, 1, 16);
+		mHeader.keyInterval = (uint32_t)glm::max(keyInterval, 1);
+		TrajectoryBox(mHeader.lo, mHeader.hi);
+		mHeader.velRange = trajectoryVelRange;
+		mOut.Write(&mHeader, sizeof(mHeader));
+
+		mSnapshots.assign(glm::max(queueSize, 1), Snapshot());
+		mFree.clear();
+		mFull.clear();
+		for (int s = 0; s < (int)mSnapshots.size(); s++)
+			mFree.push_back(s);
+		mClosing = false;
+		mFrame = 0;
+		mStalls = 0;
+		mThread = std::thread(&TrajectoryWriter::Run, this);
+		return true;
+	}
+
+	// Write everything still queued and stop the writer thread.
+	void Close()
+	{
+		if (!mOut.IsOpen())
+			return;
+		{
+			std::lock_guard<std::mutex> lock(mMutex);
+			mClosing = true;
+		}
+		mChanged.notify_all();
+		mThread.join();
+		mBytes = mOut.Bytes();
+		if (!mOut.Close())
+			fprintf(stderr, "Cannot write all of the trajectory\n");
+	}
+
+	bool IsOpen() const
+	{
+		return mOut.IsOpen();
+	}
+
+	// Queue the particles as they are now. Waits only if every snapshot
+	// buffer is still waiting for the writer.
+	// (call outside of any parallel region)
+	void Push()
+	{
+		int s;
+		{
+			std::unique_lock<std::mutex> lock(mMutex);
+			if (mFree.empty())
+			{
+				mStalls++;
+				mChanged.wait(lock, [this] { return !mFree.empty(); });
+			}
+			s = mFree.front();
+			mFree.pop_front();
+		}
+
+		Snapshot &snap = mSnapshots[s];
+		const int n = (int)particles.size();
+		snap.frame = mFrame++;
+		snap.pos.resize(n);
+		snap.vel.resize(n);
+		#pragma omp parallel for
+		for (int i = 0; i < n; i++)
+		{
+			snap.pos[i] = particles[i].pos;
+			snap.vel[i] = particles[i].vel;
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(mMutex);
+			mFull.push_back(s);
+		}
+		mChanged.notify_all();
+	}
+
+	int Frames() const
+	{
+		return (int)mFrame;
+	}
+
+	// times Push( ) had to wait for the writer
+	int Stalls() const
+	{
+		return mStalls;
+	}
+
+	// written so far, only safe to read once closed
+	size_t Bytes() const
+	{
+		return mBytes;
+	}
+
+private:
+	struct Snapshot
+	{
+		uint32_t frame;
+		std::vector<glm::vec3> pos;
+		std::vector<glm::vec3> vel;
+	};
+
+	// the writer thread
+	void Run()
+	{
+		const uint32_t levels = (1u << mHeader.bits) - 1;
+		std::vector<uint16_t> q, prev;
+		int prevCount = 0;
+
+		for (;;)
+		{
+			int s;
+			{
+				std::unique_lock<std::mutex> lock(mMutex);
+				mChanged.wait(lock, [this] { return !mFull.empty() || mClosing; });
+				if (mFull.empty())
+					return;
+				s = mFull.front();
+				mFull.pop_front();
+			}
+
+			const Snapshot &snap = mSnapshots[s];
+			const int count = (int)snap.pos.size();
+			q.resize(6 * count);
+			for (int c = 0; c < 3; c++)
+			{
+				for (int i = 0; i < count; i++)
+				{
+					q[c * count + i] = (uint16_t)Quantize(snap.pos[i][c], mHeader.lo[c], mHeader.hi[c], levels);
+					q[(3 + c) * count + i] = (uint16_t)Quantize(snap.vel[i][c], -mHeader.velRange, mHeader.velRange, levels);
+				}
+			}
+			TrajectoryFrameHeader fh;
+			fh.count = (uint32_t)count;
+			fh.frame = snap.frame;
+			fh.key = (snap.frame % mHeader.keyInterval) == 0 ? 1 : 0;
+
+			// the snapshot is no longer needed
+			{
+				std::lock_guard<std::mutex> lock(mMutex);
+				mFree.push_back(s);
+			}
+			mChanged.notify_all();
+
+			// encoded straight into the output buffer, the header goes in front
+			uint8_t *out = mOut.Reserve(sizeof(fh) + MaxEncodedTrajectoryBytes(count));
+			fh.bytes = (uint32_t)EncodeTrajectoryPlanes(q, count, prev, prevCount, fh.key != 0, out + sizeof(fh));
+			memcpy(out, &fh, sizeof(fh));
+			mOut.Commit(sizeof(fh) + fh.bytes);
+
+			q.swap(prev);
+			prevCount = count;
+		}
+	}
+
+	TrajectoryHeader mHeader;
+	OutputStream mOut;
+	std::vector<Snapshot> mSnapshots;
+	std::deque<int> mFree;		// snapshot buffers the step loop may fill
+	std::deque<int> mFull;		// ... and the ones waiting for the writer, oldest first
+	std::mutex mMutex;
+	std::condition_variable mChanged;
+	std::thread mThread;
+	bool mClosing;
+	uint32_t mFrame;
+	int mStalls;
+	size_t mBytes;
+};
+
+TrajectoryWriter trajectoryWriter;
+
+// --------------------------------------------------------------------
+// Start or stop the recording to follow recordTrajectory, and record the
+// frame just simulated if it is on.
+// (call after every AdvanceFrame( ))
+void RecordTrajectoryFrame()
+{
+	if (!recordTrajectory)
+	{
+		if (trajectoryWriter.IsOpen())
+		{
+			const int frames = trajectoryWriter.Frames();
+			const int stalls = trajectoryWriter.Stalls();
+			trajectoryWriter.Close();
+			if (Verbose)
+				fprintf(stderr, "Trajectory '%s': %d frames, %zu bytes, the step loop waited %d times\n",
+					trajectoryFile, frames, trajectoryWriter.Bytes(), stalls);
+		}
+		return;
+	}
+
+	if (!trajectoryWriter.IsOpen() &&
+		!trajectoryWriter.Open(trajectoryFile, trajectoryBits, trajectoryKeyInterval, trajectoryQueueSize))
+	{
+		recordTrajectory = false;
+		return;
+	}
+	trajectoryWriter.Push();
+}
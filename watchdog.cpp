@@ -0,0 +1,275 @@
+// --------------------------------------------------------------------
+// Blow-up watchdog
+//
+// With useWatchdog on, every watchdogInterval frames the particles are
+// copied into a ring of watchdogSnapshots in memory (the first time before
+// the first frame, so there is always one), and every frame the
+// diagnostics of its last step (see diagnostics.cpp) are checked for a
+// blow-up. A blow-up is any one of:
+//	- a NaN or infinite velocity or density,
+//	- a particle that moved more than watchdogMaxTravel * r in one step,
+//	- a mean density error above watchdogMaxDensityError.
+// When one is found, the particles go back to the newest snapshot and the
+// step of the solver in use is cut by watchdogBackoff. A snapshot that
+// blows up watchdogRetries times in a row is dropped for the one before
+// it. With none left, the simulation stops and says so instead of running
+// on with NaNs.
+//
+// A snapshot holds the arrays of a checkpoint (see checkpoint.cpp),
+// compressed without loss:
+//	- the payload is cut into blocks of SNAPSHOT_BLOCK_WORDS 32 bit words,
+//	- every word is XORed with the one three before it, which in the vec3
+//	  arrays is the same component of the particle before,
+//	- every byte plane of a block is stored as runs: zeros as a count, and
+//	  anything else as a count followed by the bytes (the counts are
+//	  varints, see trajectory.cpp).
+// The fields every particle has the same value in, and the sign and
+// exponent bytes of the others, take next to nothing. The blocks do not
+// depend on each other, so they are packed and unpacked in parallel.
+//
+// Like a checkpoint a snapshot is the fluid only, so the rigid bodies are
+// not rolled back. The 2D slice is not watched.
+
+const size_t SNAPSHOT_BLOCK_WORDS = 1 << 16;
+
+struct WatchdogSnapshot
+{
+	int frame;								// of watchdogFrame, when it was taken
+	size_t count;							// particles
+	size_t bytes;							// of the checkpoint arrays
+	std::vector<std::vector<uint8_t> > planes;	// 4 per block
+	int retries;							// rollbacks to it in a row
+};
+
+static std::deque<WatchdogSnapshot> watchdogRing;	// oldest first
+static std::vector<uint8_t> watchdogArrays;		// a snapshot unpacked
+static int watchdogFrame = 0;						// frames checked
+
+// --------------------------------------------------------------------
+// Pack byte plane b of the words [first, end) of raw into out.
+static void PackSnapshotPlane(const uint8_t *raw, const size_t first, const size_t end, const int b,
+	std::vector<uint8_t> &out)
+{
+	const size_t n = end - first;
+	const uint8_t *word = raw + 4 * first + b;
+	#define PLANE_BYTE(j) ((uint8_t)(word[4 * (j)] ^ ((j) >= 3 ? word[4 * ((j) - 3)] : 0)))
+
+	// no run costs more than its token and bytes, and no token more than
+	// the run it stands for
+	out.resize(2 * n + 16);
+	uint8_t *at = &out[0];
+	size_t j = 0;
+	while (j < n)
+	{
+		size_t run = 0;
+		while (j + run < n && PLANE_BYTE(j + run) == 0)
+			run++;
+		if (run > 0)
+		{
+			PutVarint(at, (uint32_t)(run << 1) | 1);
+			j += run;
+			continue;
+		}
+
+		// up to the next two zeros (a single zero is cheaper left in)
+		while (j + run < n && !(PLANE_BYTE(j + run) == 0 && (j + run + 1 == n || PLANE_BYTE(j + run + 1) == 0)))
+			run++;
+		PutVarint(at, (uint32_t)(run << 1));
+		for (size_t k = 0; k < run; k++)
+			*at++ = PLANE_BYTE(j + k);
+		j += run;
+	}
+	#undef PLANE_BYTE
+	out.resize(at - &out[0]);
+}
+
+// The inverse of PackSnapshotPlane( ), into byte plane b of raw.
+static void UnpackSnapshotPlane(const std::vector<uint8_t> &in, uint8_t *raw, const size_t first, const size_t end,
+	const int b)
+{
+	const size_t n = end - first;
+	uint8_t *word = raw + 4 * first + b;
+	const uint8_t *at = in.data();
+	const uint8_t *stop = at + in.size();
+	size_t j = 0;
+	while (j < n && at < stop)
+	{
+		uint32_t token;
+		if (!GetVarint(at, stop, token))
+			break;
+		const size_t run = glm::min((size_t)(token >> 1), n - j);
+		for (size_t k = 0; k < run; k++, j++)
+		{
+			const uint8_t x = (token & 1) ? 0 : *at++;
+			word[4 * j] = x ^ (j >= 3 ? word[4 * (j - 3)] : 0);
+		}
+	}
+}
+
+// --------------------------------------------------------------------
+// Copy the particles into a snapshot at the end of the ring (in place of
+// the oldest one if the ring is full).
+static void TakeSnapshot()
+{
+	const size_t count = particles.size();
+	if (count == 0)
+		return;
+
+	CheckpointArrays a;
+	const size_t bytes = LayOutCheckpoint(NULL, count, a);
+	// (zeroed, for the padding between the arrays)
+	watchdogArrays.assign(bytes, 0);
+	LayOutCheckpoint((char *)&watchdogArrays[0], count, a);
+	StoreParticles(a);
+
+	WatchdogSnapshot s;
+	if ((int)watchdogRing.size() >= glm::max(watchdogSnapshots, 1))
+	{
+		// its planes keep their memory
+		s = std::move(watchdogRing.front());
+		watchdogRing.pop_front();
+	}
+
+	const size_t words = bytes / 4;
+	const int blocks = (int)((words + SNAPSHOT_BLOCK_WORDS - 1) / SNAPSHOT_BLOCK_WORDS);
+	s.planes.resize(4 * blocks);
+	#pragma omp parallel for
+	for (int job = 0; job < 4 * blocks; job++)
+	{
+		const size_t first = (job / 4) * SNAPSHOT_BLOCK_WORDS;
+		PackSnapshotPlane(&watchdogArrays[0], first, glm::min(first + SNAPSHOT_BLOCK_WORDS, words), job % 4, s.planes[job]);
+	}
+
+	s.frame = watchdogFrame;
+	s.count = count;
+	s.bytes = bytes;
+	s.retries = 0;
+	watchdogRing.push_back(std::move(s));
+
+	if (DebugOn != 0)
+	{
+		size_t packed = 0;
+		for (const auto &plane : watchdogRing.back().planes)
+			packed += plane.size();
+		fprintf(stderr, "Watchdog: snapshot of frame %d, %zu particles in %zu of %zu bytes\n", watchdogFrame, count, packed, bytes);
+	}
+}
+
+// Put the particles back the way s has them.
+static void RestoreSnapshot(const WatchdogSnapshot &s)
+{
+	watchdogArrays.resize(s.bytes);
+	const size_t words = s.bytes / 4;
+	const int jobs = (int)s.planes.size();
+	#pragma omp parallel for
+	for (int job = 0; job < jobs; job++)
+	{
+		const size_t first = (job / 4) * SNAPSHOT_BLOCK_WORDS;
+		UnpackSnapshotPlane(s.planes[job], &watchdogArrays[0], first, glm::min(first + SNAPSHOT_BLOCK_WORDS, words), job % 4);
+	}
+
+	CheckpointArrays a;
+	LayOutCheckpoint((char *)&watchdogArrays[0], s.count, a);
+	RestoreParticles(a, s.count);
+}
+
+// Drop the snapshots, they are of particles that are gone.
+// (call whenever the particles are replaced)
+void ForgetSnapshots()
+{
+	watchdogRing.clear();
+}
+
+// --------------------------------------------------------------------
+// The step size of the solver in use.
+static float &SolverStep()
+{
+	if (whichSolver == POSITION_BASED)
+		return pbfDT;
+	if (whichSolver == IMPLICIT_INCOMPRESSIBLE)
+		return iisphDT;
+	return useAdaptiveDT ? maxDT : dT;
+}
+
+// What is wrong with the last step, or NULL if nothing is.
+static const char *BlowUp()
+{
+	const StepMetrics &m = stepMetrics;
+	if (m.nonFinite > 0)
+		return "NaN or infinite values";
+	if (m.maxSpeed * SolverStep() > watchdogMaxTravel * r)
+		return "a velocity spike";
+	if (m.meanDensityError > watchdogMaxDensityError)
+		return "diverging densities";
+	return NULL;
+}
+
+// --------------------------------------------------------------------
+// Before a frame: make sure it is measured, and that there is a snapshot
+// to go back to (of the particles as they are, when there is none of
+// these particles yet).
+// (call before every AdvanceFrame( ))
+void WatchdogBeforeFrame()
+{
+	if (!useWatchdog || use2D)
+		return;
+	if (!useDiagnostics)
+	{
+		// the watchdog goes by the diagnostics, so they are on from now on
+		useDiagnostics = true;
+		if (GluiFluid != NULL)
+			GluiFluid->sync_live();
+	}
+
+	// particles were added or replaced since the last snapshot
+	if (!watchdogRing.empty() && watchdogRing.back().count != particles.size())
+		ForgetSnapshots();
+	if (watchdogRing.empty())
+		TakeSnapshot();
+}
+
+// After a frame: roll back if it blew up, or keep a snapshot of it if
+// one is due.
+// (call after every AdvanceFrame( ))
+void WatchdogAfterFrame()
+{
+	if (!useWatchdog || use2D || watchdogRing.empty())
+		return;
+
+	const char *trouble = BlowUp();
+	if (trouble == NULL)
+	{
+		watchdogFrame++;
+		if (watchdogFrame - watchdogRing.back().frame >= watchdogInterval)
+			TakeSnapshot();
+		return;
+	}
+
+	// the newest snapshot that has retries left
+	while (watchdogRing.size() > 1 && watchdogRing.back().retries >= watchdogRetries)
+		watchdogRing.pop_back();
+	WatchdogSnapshot &s = watchdogRing.back();
+	if (s.retries >= watchdogRetries)
+	{
+		// back to where the last try started, to leave something to look at
+		RestoreSnapshot(s);
+		fprintf(stderr, "Watchdog: %s at frame %d and no snapshot left to try again from, the simulation is stopped\n",
+			trouble, watchdogFrame);
+		doSimulation = false;
+		ForgetSnapshots();
+		if (GluiFluid != NULL)
+			GluiFluid->sync_live();
+		return;
+	}
+
+	s.retries++;
+	RestoreSnapshot(s);
+	float &step = SolverStep();
+	step *= watchdogBackoff;
+	if (useAdaptiveDT)
+		minDT = glm::min(minDT, maxDT);
+	fprintf(stderr, "Watchdog: %s at frame %d, back to frame %d with a step of %g\n", trouble, watchdogFrame, s.frame, step);
+	watchdogFrame = s.frame;
+	if (GluiFluid != NULL)
+		GluiFluid->sync_live();
+}